@@ -8,27 +8,41 @@
 using namespace std;
 
 
+/**
+ * Where a ray hit the scene. This is passed around by value for every ray, so
+ * it is kept small: the hit point is not stored (it is ray.pos + t * ray.dir)
+ * and the material is referred to rather than copied.
+ */
 class HitRecord
 {
 public:
     HitRecord() {
+        t = 0;
+        material = NULL;
+        instance = -1;
     }
 
-    HitRecord(float time, glm::vec4 intr, glm::vec4 nor, util::Material mat) {
+    /**
+     * \param time the ray parameter of the hit
+     * \param nor the unit normal at the hit, in the view coordinate system
+     * \param mat the material hit. It must outlive the hit record
+     * \param inst the instance of the compiled ray scene hit, or -1
+     */
+    HitRecord(float time, const glm::vec3& nor, const util::Material *mat, int inst = -1) {
         t = time;
-        inter = intr;
         normal = nor;
         material = mat;
+        instance = inst;
         hit = true;
     }
-    ~HitRecord() {}
 
     float t;
-    glm::vec4 inter;
-    glm::vec4 normal;
-    util::Material material;
+    glm::vec3 normal;
+    const util::Material *material;
+    int instance;
+    //the texture color at the hit, which the lit color is multiplied by
+    glm::vec3 textureColor = glm::vec3(1,1,1);
     bool hit = false;
-private:
 };
 
 #endif // HITRECORD_H
@@ -1,6 +1,7 @@
 #include "OpenGLWindow.h"
 #include <QScreen>
 #include <OpenGLFunctions.h>
+#include "SceneConfig.h"
 #include <QMessageBox> //requires QT += widgets in .pro file
 #include <QPainter>
 #include <QDebug>
@@ -33,45 +34,15 @@ OpenGLWindow::OpenGLWindow(QWindow *parent, int argc, char* argv[])
     frames = 0;
     setAnimating(true);
 
+    SceneConfig config;
     if (argv[1]) {
-        std::ifstream input(argv[1]);
-        int i = 0;
-        std::vector<std::string> lines;
-        for( std::string line; getline(input, line); i++)
-        {
-            lines.push_back(line);
-        }
-
-         xmlfilename = lines[0];
-
-         // sending eye pos
-         stringstream eye(lines[1]);
-         float e1; eye >> e1;
-         float e2; eye >> e2;
-         float e3; eye >> e3;
-         // sending cen pos
-         stringstream cen(lines[2]);
-         float c1; cen >> c1;
-         float c2; cen >> c2;
-         float c3; cen >> c3;
-         // sending up dir
-         stringstream up(lines[3]);
-         float u1; up >> u1;
-         float u2; up >> u2;
-         float u3; up >> u3;
-         view.setCamera(glm::vec3(e1, e2, e3), glm::vec3(c1, c2, c3), glm::vec3(u1, u2, u3));
-    } else {
-        xmlfilename = "scenegraphmodels/testmodellightstextures.xml";
+        config = SceneConfig::read(argv[1]);
     }
+    xmlfilename = config.xmlFilename;
+    view.setCamera(config.eye, config.center, config.up);
 
     camerasgraphfilename = "scenegraphmodels/camera.xml";
 
-    // format for the config file is
-    // 0: path to xml file
-    // 1: eye pos, ex: 0.0 50.0 80.0
-    // 2: center pos, ex: 0.0 50.0 0.0
-    // 3: up dir, ex: 0.0 1.0 0.0
-
 }
 
 
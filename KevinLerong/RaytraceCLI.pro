@@ -0,0 +1,64 @@
+# Renders a scene with the raytracer without opening a window, e.g.
+#   raytrace-cli -w 1920 -h 1080 -t 8 -o image.exr config.txt
+QT += core
+QT += gui xml
+
+CONFIG += c++11
+
+TARGET = raytrace-cli
+CONFIG += console
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../headers
+
+TEMPLATE = app
+
+SOURCES += RaytraceMain.cpp
+
+HEADERS += \
+    SceneConfig.h \
+    VertexAttrib.h \
+    sgraph/AbstractNode.h \
+    sgraph/FlatScenegraph.h \
+    sgraph/GLScenegraphRenderer.h \
+    sgraph/GroupNode.h \
+    sgraph/HierarchyBenchmark.h \
+    sgraph/INode.h \
+    sgraph/IScenegraph.h \
+    sgraph/LeafNode.h \
+    sgraph/RenderQueue.h \
+    sgraph/Scenegraph.h \
+    sgraph/scenegraphinfo.h \
+    sgraph/SceneXMLReader.h \
+    sgraph/TransformNode.h \
+    _3DRay.h \
+    HitRecord.h \
+    raytrace/AABB.h \
+    raytrace/AdaptiveSampler.h \
+    raytrace/BVH.h \
+    raytrace/Camera.h \
+    raytrace/Framebuffer.h \
+    raytrace/Frustum.h \
+    raytrace/ImageWriter.h \
+    raytrace/Instance.h \
+    raytrace/LightTree.h \
+    raytrace/MipTexture.h \
+    raytrace/PathTracer.h \
+    raytrace/Primitive.h \
+    raytrace/ProgressiveRender.h \
+    raytrace/RayDifferential.h \
+    raytrace/RayPacket.h \
+    raytrace/RayScene.h \
+    raytrace/ReprojectionCache.h \
+    raytrace/Raytracer.h \
+    raytrace/SceneLight.h \
+    raytrace/SIMD.h \
+    raytrace/TileDependencies.h \
+    raytrace/TileRenderer.h \
+    raytrace/TraceContext.h \
+    raytrace/TraceCounters.h \
+    raytrace/TracePath.h \
+    raytrace/TraversalBenchmark.h \
+    raytrace/Triangle.h \
+    raytrace/TriangleMesh.h \
+    raytrace/Wavefront.h
@@ -0,0 +1,360 @@
+#include "SceneConfig.h"
+#include "VertexAttrib.h"
+#include "sgraph/ScenegraphInfo.h"
+#include "sgraph/SceneXMLReader.h"
+#include "sgraph/HierarchyBenchmark.h"
+#include "raytrace/Camera.h"
+#include "raytrace/Framebuffer.h"
+#include "raytrace/ImageWriter.h"
+#include "raytrace/PathTracer.h"
+#include "raytrace/Raytracer.h"
+#include "raytrace/TraceCounters.h"
+#include "raytrace/TraversalBenchmark.h"
+#include "ThreadPool.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stack>
+#include <string>
+using namespace std;
+
+/*
+ * Raytraces a scene without opening a window, for batch jobs and benchmarks.
+ * The scene and camera are read from a config file in the same format as the
+ * interactive program takes, and the image is written to a PPM, PNG or
+ * OpenEXR file.
+ */
+
+/*
+ * Every heap allocation made by the program is counted, so that --allocations
+ * can check that tracing rays does not allocate
+ */
+static atomic<long long> heapAllocations(0);
+
+/*
+ * What a render may allocate once every thread has made its buffers: the
+ * pool's bookkeeping for every job handed to it (the job, and now and then a
+ * block of a queue). One more allocation per tile goes beyond this
+ */
+static const long long ALLOCATIONS_PER_JOB = 2;
+
+void *operator new(size_t size)
+{
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [options] config.txt\n"
+            "       %s --hierarchy-benchmark N [-t N]\n"
+            "  -o, --output FILE    image to write: .ppm, .png or .exr (default raytrace.png)\n"
+            "  -w, --width N        image width in pixels (default 500)\n"
+            "  -h, --height N       image height in pixels (default 500)\n"
+            "  -f, --fov DEGREES    vertical field of view (default 120)\n"
+            "  -t, --threads N      number of threads, 0 for one per core (default 0)\n"
+            "  -s, --tile N         size of the square tiles handed to threads (default 32)\n"
+            "  -d, --max-depth N    most bounces of reflected and refracted rays (default 8)\n"
+            "  -b, --ray-budget N   most secondary rays per pixel (default 32)\n"
+            "  -a, --antialias N    supersample edge pixels with N x N samples (default off)\n"
+            "  -l, --light-samples N  light each point with N point lights picked at random\n"
+            "                       (default 0: all of them)\n"
+            "      --single         trace one ray at a time instead of SIMD packets\n"
+            "      --wavefront      trace each tile breadth first, sorting its rays by\n"
+            "                       direction and its hits by material\n"
+            "      --path-trace     path trace instead, until every pixel is within the\n"
+            "                       target noise or has the most samples allowed\n"
+            "      --samples N      most samples per pixel when path tracing (default 1024)\n"
+            "      --noise X        target noise of a pixel's brightness (default 0.005)\n"
+            "      --seconds N      stop path tracing after N seconds (default no limit)\n"
+            "      --benchmark      also time single-ray against packet traversal\n"
+            "      --hierarchy-benchmark N  time updating the transformations of a\n"
+            "                       synthetic crowd of N transformation nodes on 1 to\n"
+            "                       --threads threads, instead of raytracing\n"
+            "      --allocations    trace twice and count the heap allocations of the second\n"
+            "                       trace; fail if there are more than the pool's per job\n"
+            "      --stats          print what the rays did: rays by type, hit rates,\n"
+            "                       nodes and primitives tested, and time per stage and thread\n"
+            "      --stats-json FILE  also write those counters to FILE as JSON\n",
+            program, program);
+}
+
+/*
+ * Read the integer value of an option, exiting with the usage message if it
+ * is missing or not a number
+ */
+static int intArgument(int argc, char *argv[], int& i, int minimum)
+{
+    if (i + 1 >= argc) {
+        fprintf(stderr, "%s needs a value\n", argv[i]);
+        usage(argv[0]);
+        exit(1);
+    }
+    char *end;
+    long value = strtol(argv[i + 1], &end, 10);
+    if ((*end != '\0') || (value < minimum)) {
+        fprintf(stderr, "invalid value for %s: %s\n", argv[i], argv[i + 1]);
+        usage(argv[0]);
+        exit(1);
+    }
+    i++;
+    return (int)value;
+}
+
+/*
+ * Read the positive number value of an option, exiting with the usage
+ * message if it is missing or not a number
+ */
+static float floatArgument(int argc, char *argv[], int& i)
+{
+    if (i + 1 >= argc) {
+        fprintf(stderr, "%s needs a value\n", argv[i]);
+        usage(argv[0]);
+        exit(1);
+    }
+    char *end;
+    float value = strtof(argv[i + 1], &end);
+    if ((*end != '\0') || !(value > 0)) {
+        fprintf(stderr, "invalid value for %s: %s\n", argv[i], argv[i + 1]);
+        usage(argv[0]);
+        exit(1);
+    }
+    i++;
+    return value;
+}
+
+/**
+ * Print and write the trace counters gathered since they were last reset, as
+ * the options ask
+ */
+static void reportCounters(bool print, const string& jsonFilename)
+{
+    if (!print && jsonFilename.empty())
+        return;
+    raytrace::TraceStatistics counters = raytrace::TraceStatistics::collect();
+    if (print)
+        counters.print();
+    if (!jsonFilename.empty()) {
+        counters.writeJSON(jsonFilename);
+        printf("wrote %s\n", jsonFilename.c_str());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    string configFilename;
+    string outputFilename = "raytrace.png";
+    int width = 500, height = 500;
+    float fov = 120.0f;
+    int threads = 0;
+    int tileSize = 32;
+    bool packets = true;
+    bool wavefront = false;
+    bool pathTrace = false;
+    int maxSamples = 1024;
+    float targetNoise = 0.005f;
+    int maxSeconds = 0;
+    bool benchmark = false;
+    int hierarchyTransforms = 0;
+    bool allocations = false;
+    bool printCounters = false;
+    string countersFilename;
+    raytrace::TraceSettings traceSettings;
+    int antialiasSamples = 0;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if ((arg == "-o") || (arg == "--output")) {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            outputFilename = argv[++i];
+        } else if ((arg == "-w") || (arg == "--width")) {
+            width = intArgument(argc, argv, i, 1);
+        } else if ((arg == "-h") || (arg == "--height")) {
+            height = intArgument(argc, argv, i, 1);
+        } else if ((arg == "-f") || (arg == "--fov")) {
+            fov = (float)intArgument(argc, argv, i, 1);
+        } else if ((arg == "-t") || (arg == "--threads")) {
+            threads = intArgument(argc, argv, i, 0);
+        } else if ((arg == "-s") || (arg == "--tile")) {
+            tileSize = intArgument(argc, argv, i, 1);
+        } else if ((arg == "-d") || (arg == "--max-depth")) {
+            traceSettings.maxDepth = min(intArgument(argc, argv, i, 0), (int)raytrace::TraceSettings::MAX_DEPTH);
+        } else if ((arg == "-b") || (arg == "--ray-budget")) {
+            traceSettings.rayBudget = intArgument(argc, argv, i, 0);
+        } else if ((arg == "-a") || (arg == "--antialias")) {
+            antialiasSamples = intArgument(argc, argv, i, 0);
+        } else if ((arg == "-l") || (arg == "--light-samples")) {
+            traceSettings.lightSamples = intArgument(argc, argv, i, 0);
+        } else if (arg == "--single") {
+            packets = false;
+        } else if (arg == "--wavefront") {
+            wavefront = true;
+        } else if (arg == "--path-trace") {
+            pathTrace = true;
+        } else if (arg == "--samples") {
+            maxSamples = intArgument(argc, argv, i, 1);
+        } else if (arg == "--noise") {
+            targetNoise = floatArgument(argc, argv, i);
+        } else if (arg == "--seconds") {
+            maxSeconds = intArgument(argc, argv, i, 1);
+        } else if (arg == "--benchmark") {
+            benchmark = true;
+        } else if (arg == "--hierarchy-benchmark") {
+            hierarchyTransforms = intArgument(argc, argv, i, 1);
+        } else if (arg == "--allocations") {
+            allocations = true;
+        } else if (arg == "--stats") {
+            printCounters = true;
+        } else if (arg == "--stats-json") {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            countersFilename = argv[++i];
+        } else if (arg == "--help") {
+            usage(argv[0]);
+            return 0;
+        } else if ((arg[0] == '-') || !configFilename.empty()) {
+            fprintf(stderr, "unexpected argument %s\n", arg.c_str());
+            usage(argv[0]);
+            return 1;
+        } else {
+            configFilename = arg;
+        }
+    }
+    if (hierarchyTransforms > 0) {
+        sgraph::HierarchyBenchmark bench;
+        bench.run(hierarchyTransforms, threads);
+        bench.print();
+        if (!bench.identical) {
+            fprintf(stderr, "updating on a pool gave different world transformations\n");
+            return 1;
+        }
+        return 0;
+    }
+    if (configFilename.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        SceneConfig config = SceneConfig::read(configFilename);
+
+        sgraph::ScenegraphInfo<VertexAttrib> sinfo;
+        sinfo = sgraph::SceneXMLReader::importScenegraph<VertexAttrib>(config.xmlFilename);
+        sgraph::Scenegraph *scenegraph = sinfo.scenegraph;
+        //no renderer: only the triangles are needed
+        scenegraph->setRaytraceMeshes<VertexAttrib>(sinfo.meshes);
+        scenegraph->setTraceSettings(traceSettings);
+
+        stack<glm::mat4> modelview;
+        modelview.push(glm::lookAt(config.eye, config.center, config.up));
+
+        util::ThreadPool pool(threads);
+        raytrace::Raytracer raytracer(pool);
+        raytracer.setTileSize(tileSize);
+        raytracer.setPacketTracing(packets);
+        raytracer.setWavefront(wavefront);
+        if (antialiasSamples > 0) {
+            raytracer.setAntialiasing(true);
+            raytracer.getSampler().samplesPerAxis = antialiasSamples;
+        }
+
+        raytrace::Camera camera(width, height, fov);
+        raytrace::Framebuffer framebuffer;
+        framebuffer.resize(width, height);
+        raytrace::TraceStatistics::reset();
+        scenegraph->compileRayScene(modelview);
+        if (pathTrace) {
+            raytrace::PathTracer pathTracer(pool);
+            pathTracer.setTileSize(tileSize);
+            pathTracer.maxSamples = maxSamples;
+            pathTracer.minSamples = min(pathTracer.minSamples, maxSamples);
+            pathTracer.targetNoise = targetNoise;
+            pathTracer.maxSeconds = maxSeconds;
+            raytrace::PathTraceStats stats = pathTracer.render(scenegraph, camera, modelview, framebuffer);
+            printf("path traced %dx%d in %d passes: %lld samples, %lld rays in %.3f s (%.0f samples/s)\n",
+                   width, height, stats.passes, stats.samples, stats.rays, stats.seconds,
+                   stats.getSamplesPerSecond());
+            printf("%.1f samples per pixel, noise %.4f, %d of %d pixels within %g\n",
+                   stats.samplesPerPixel, stats.noise, stats.convergedPixels, width * height, targetNoise);
+            reportCounters(printCounters, countersFilename);
+            raytrace::ImageWriter::write(outputFilename, framebuffer);
+            printf("wrote %s\n", outputFilename.c_str());
+            delete scenegraph;
+            return 0;
+        }
+
+        if (allocations) {
+            //an untimed trace first, so that every thread has made its buffers;
+            //the counters then count the second trace alone
+            raytracer.trace(scenegraph, camera, modelview, framebuffer);
+            raytrace::TraceStatistics::reset();
+        }
+        long long allocationsBefore = heapAllocations;
+        raytrace::RenderStats stats = raytracer.trace(scenegraph, camera, modelview, framebuffer);
+        long long tracingAllocations = heapAllocations - allocationsBefore;
+        printf("raytraced %dx%d in %d tiles on %u threads: %lld rays in %.3f s (%.0f rays/s)\n",
+               width, height, stats.tiles, stats.threads, stats.rays, stats.seconds, stats.getRaysPerSecond());
+        stats.printRaysPerDepth();
+        if (stats.refinedPixels > 0)
+            printf("anti-aliased %d edge pixels\n", stats.refinedPixels);
+        long long allowedAllocations = 0;
+        if (allocations) {
+            //anti-aliasing cuts the edge pixels into jobs that never straddle a tile
+            long long jobs = stats.tiles;
+            if (stats.refinedPixels > 0)
+                jobs += stats.tiles + stats.refinedPixels / raytracer.getSampler().pixelsPerJob + 1;
+            allowedAllocations = ALLOCATIONS_PER_JOB * jobs;
+            printf("heap allocations while tracing: %lld of at most %lld (%d tiles, %.6f per ray)\n",
+                   tracingAllocations, allowedAllocations, stats.tiles,
+                   stats.rays > 0 ? (double)tracingAllocations / stats.rays : 0.0);
+        }
+        reportCounters(printCounters, countersFilename);
+
+        if (benchmark) {
+            raytrace::TraversalBenchmark bench;
+            bench.run(scenegraph->getRayScene(), camera, pool);
+            bench.print();
+        }
+
+        raytrace::ImageWriter::write(outputFilename, framebuffer);
+        printf("wrote %s\n", outputFilename.c_str());
+        delete scenegraph;
+        if (allocations && (tracingAllocations > allowedAllocations)) {
+            fprintf(stderr, "tracing made %lld heap allocations, more than the %lld allowed\n",
+                    tracingAllocations, allowedAllocations);
+            return 1;
+        }
+    } catch (exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef SCENECONFIG_H
+#define SCENECONFIG_H
+
+#include <glm/glm.hpp>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+/*
+ * The contents of a scene config file, which names the scene to be loaded and
+ * the initial camera. The format of the file is
+ * 0: path to xml file
+ * 1: eye pos, ex: 0.0 50.0 80.0
+ * 2: center pos, ex: 0.0 50.0 0.0
+ * 3: up dir, ex: 0.0 1.0 0.0
+ */
+class SceneConfig
+{
+public:
+    string xmlFilename;
+    glm::vec3 eye;
+    glm::vec3 center;
+    glm::vec3 up;
+
+    SceneConfig()
+    {
+        xmlFilename = "scenegraphmodels/testmodellightstextures.xml";
+        eye = glm::vec3(0.0f, 50.0f, 80.0f);
+        center = glm::vec3(0.0f, 50.0f, 0.0f);
+        up = glm::vec3(0.0f, 1.0f, 0.0f);
+    }
+
+    /*
+     * Read a config file in the above format
+     * \param filename the path to the config file
+     * \return the scene and camera named in the file
+     */
+    static SceneConfig read(const string& filename) throw(runtime_error)
+    {
+        ifstream input(filename.c_str());
+        if (!input.is_open())
+            throw runtime_error("Could not open config file " + filename);
+
+        vector<string> lines;
+        for (string line; getline(input, line);)
+            lines.push_back(line);
+        if (lines.size() < 4)
+            throw runtime_error("Config file " + filename +
+                                " needs a scene and the eye, center and up of the camera");
+
+        SceneConfig config;
+        config.xmlFilename = lines[0];
+        //strip the carriage return left behind by files saved on Windows
+        if (!config.xmlFilename.empty() && (config.xmlFilename[config.xmlFilename.size() - 1] == '\r'))
+            config.xmlFilename.erase(config.xmlFilename.size() - 1);
+        config.eye = readVector(lines[1]);
+        config.center = readVector(lines[2]);
+        config.up = readVector(lines[3]);
+        return config;
+    }
+
+private:
+    static glm::vec3 readVector(const string& line)
+    {
+        stringstream str(line);
+        glm::vec3 v;
+        str >> v.x >> v.y >> v.z;
+        return v;
+    }
+};
+
+#endif // SCENECONFIG_H
@@ -12,6 +12,7 @@
 using namespace std;
 
 View::View()
+    :progressiveRender(raytracePool)
 {   
   WINDOW_WIDTH = WINDOW_HEIGHT = 0;
   trackballRadius = 300;
@@ -26,10 +27,22 @@ View::View()
   zoom = 0;
   renderCamera = false;
   rayTrace = false;
+  benchmark = false;
+  packetTracing = true;
+  wavefront = false;
+  pathTracing = false;
+  //a path traced image is refined for this long each time R is pressed
+  progressiveRender.getPathTracer().maxSeconds = 10;
+  antialiasing = false;
+  raytraceTexture = raytraceFBO = 0;
+  raytraceWidth = raytraceHeight = 0;
+  showRaytrace = false;
+  raytraceReported = false;
 }
 
 View::~View()
 {
+  progressiveRender.cancel();
   if (scenegraph!=NULL)
     delete scenegraph;
 }
@@ -45,6 +58,7 @@ void View::initScenegraph(util::OpenGLFunctions &gl, const string& filename) thr
   scenegraph = sinfo.scenegraph;
 
   renderer.setContext(&gl);
+  renderer.setThreadPool(&drawPool);
   map<string,string> shaderVarsToVertexAttribs;
   shaderVarsToVertexAttribs["vPosition"] = "position";
   shaderVarsToVertexAttribs["vNormal"] = "normal";
@@ -86,6 +100,14 @@ void View::init(util::OpenGLFunctions& gl) throw(runtime_error)
   //assuming it got created, get all the shader variables that it uses
   //so we can initialize them at some point
   shaderLocations = program.getAllShaderVariables(gl);
+
+  //the raytraced image is streamed into a texture and blitted to the screen
+  gl.glGenTextures(1, &raytraceTexture);
+  gl.glBindTexture(GL_TEXTURE_2D, raytraceTexture);
+  gl.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  gl.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  gl.glBindTexture(GL_TEXTURE_2D, 0);
+  gl.glGenFramebuffers(1, &raytraceFBO);
 }
 
 void View::draw(util::OpenGLFunctions& gl) {
@@ -120,12 +142,30 @@ void View::draw(util::OpenGLFunctions& gl) {
   modelview.top() = modelview.top() *
           glm::lookAt(glm::vec3(0.0, 0.0, 0.0),
                 glm::vec3(0.0, 0.0, -2.0),
-                glm::vec3(0.0, 1.0, 0.0));// * trackballTransform;
+                glm::vec3(0.0, 1.0, 0.0)) * trackballTransform;
+
+  if (benchmark) {
+      benchmarkTraversal(WINDOW_WIDTH, WINDOW_HEIGHT, modelview);
+      benchmark = false;
+  }
 
   if (rayTrace) {
       printf("raytrace\n");
-      raytrace(WINDOW_WIDTH, WINDOW_HEIGHT, modelview);
+      raytrace(gl, WINDOW_WIDTH, WINDOW_HEIGHT, modelview);
       rayTrace = false;
+  }
+
+  //while raytracing interactively, a new frame is started as soon as the last
+  //one is done if the view has moved since, and once more when it stops so
+  //that the reprojected frame is replaced by an exact one
+  if (interactiveRaytrace && !progressiveRender.isRunning() &&
+      (!showRaytrace || !raytraceSettled || (modelview.top() != raytraceView))) {
+      raytrace(gl, WINDOW_WIDTH, WINDOW_HEIGHT, modelview);
+  }
+
+  if (showRaytrace) {
+      drawRaytrace(gl);
+      program.disable(gl);
   } else {
 
       /*
@@ -136,6 +176,7 @@ void View::draw(util::OpenGLFunctions& gl) {
                             false,
                             glm::value_ptr(proj));
 
+      renderer.setProjection(proj);
       scenegraph->draw(modelview);
 
       gl.glFlush();
@@ -144,28 +185,108 @@ void View::draw(util::OpenGLFunctions& gl) {
   }
 }
 
-void View::raytrace(int w, int h, stack<glm::mat4> stack) {
-    glm::vec3 colors[w][h];
-
-    for (int i = 0; i < w; i++) {
-      for (int j = 0; j < h; j++) {
-        //_3DRay ray = calculate the ray to be cast here;
-         _3DRay ray = _3DRay(glm::vec4(0,0,0,1), glm::vec4(i - w / 2, j - h / 2,
-                                       (float) ((-0.5f * h) / 1.73205080757), 0));
-        colors[i][j] = scenegraph->raycast(ray, stack);
-//        if (colors[i][j].x != 0.0f && colors[i][j].y != 0.0f && colors[i][j].z != 0.0f)
-//            printf("%f %f %f \n", colors[i][j].x, colors[i][j].y, colors[i][j].z);
-      }
+void View::raytrace(util::OpenGLFunctions& gl, int w, int h, stack<glm::mat4>& stack) {
+    progressiveRender.getRaytracer().setPacketTracing(packetTracing);
+    progressiveRender.getRaytracer().setWavefront(wavefront);
+    progressiveRender.getRaytracer().setAntialiasing(antialiasing);
+    progressiveRender.setPathTracing(pathTracing);
+    progressiveRender.start(scenegraph, raytrace::Camera(w, h), stack);
+    showRaytrace = true;
+    //frames made while moving are not worth reporting
+    raytraceReported = interactiveRaytrace;
+    raytraceSettled = (stack.top() == raytraceView);
+    raytraceView = stack.top();
+
+    //an image of the same size is updated in place, as only the tiles that
+    //changed are traced again; otherwise start from a black image
+    if ((w == raytraceWidth) && (h == raytraceHeight))
+        return;
+    raytraceWidth = w;
+    raytraceHeight = h;
+    vector<float> black(4 * w * h, 0.0f);
+    gl.glBindTexture(GL_TEXTURE_2D, raytraceTexture);
+    gl.glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, black.data());
+    gl.glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void View::cancelRaytrace() {
+    if (progressiveRender.isRunning())
+        printf("raytrace cancelled\n");
+    progressiveRender.cancel();
+    showRaytrace = false;
+}
+
+void View::drawRaytrace(util::OpenGLFunctions& gl) {
+    const raytrace::Framebuffer& fb = progressiveRender.getFramebuffer();
+
+    //copy the newly finished tiles into the texture
+    vector<raytrace::TileRect> tiles;
+    if (progressiveRender.takeFinishedTiles(tiles)) {
+        gl.glBindTexture(GL_TEXTURE_2D, raytraceTexture);
+        gl.glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        gl.glPixelStorei(GL_UNPACK_ROW_LENGTH, fb.getWidth());
+        for (unsigned int i = 0; i < tiles.size(); i++) {
+            const raytrace::TileRect& t = tiles[i];
+            const glm::vec3 *pixels = fb.getPixels() + (size_t)t.y * fb.getWidth() + t.x;
+            gl.glTexSubImage2D(GL_TEXTURE_2D, 0, t.x, t.y, t.width, t.height, GL_RGB, GL_FLOAT, pixels);
+        }
+        gl.glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        gl.glBindTexture(GL_TEXTURE_2D, 0);
     }
 
-    for (int i = 0; i < w; i++) {
-      for (int j = 0; j < h; j++) {
-        printf("%f %f %f \n", colors[i][j].x, colors[i][j].y, colors[i][j].z);
-      }
+    //blit the texture over the whole window
+    GLint screen;
+    gl.glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &screen);
+    gl.glBindFramebuffer(GL_READ_FRAMEBUFFER, raytraceFBO);
+    gl.glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, raytraceTexture, 0);
+    gl.glBlitFramebuffer(0, 0, raytraceWidth, raytraceHeight,
+                         0, 0, WINDOW_WIDTH, WINDOW_HEIGHT,
+                         GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    gl.glBindFramebuffer(GL_READ_FRAMEBUFFER, screen);
+
+    if (progressiveRender.isFinished() && !raytraceReported) {
+        raytraceReported = true;
+        bool cancelled;
+        if (progressiveRender.isPathTracing()) {
+            raytrace::PathTraceStats stats = progressiveRender.getPathTraceStats();
+            printf("path traced %dx%d: %lld samples in %.3f s (%.0f samples/s), %.1f samples per pixel, "
+                   "noise %.4f, %d pixels converged\n",
+                   fb.getWidth(), fb.getHeight(), stats.samples, stats.seconds, stats.getSamplesPerSecond(),
+                   stats.samplesPerPixel, stats.noise, stats.convergedPixels);
+            cancelled = stats.cancelled;
+        } else {
+            raytrace::RenderStats stats = progressiveRender.getStats();
+            printf("raytraced %dx%d in %d tiles on %u threads: %lld rays in %.3f s (%.0f rays/s)\n",
+                   fb.getWidth(), fb.getHeight(), stats.tiles, stats.threads, stats.rays, stats.seconds,
+                   stats.getRaysPerSecond());
+            stats.printRaysPerDepth();
+            if (stats.refinedPixels > 0)
+                printf("anti-aliased %d edge pixels\n", stats.refinedPixels);
+            cancelled = stats.cancelled;
+        }
+        progressiveRender.getCounters().print();
+        if (!cancelled) {
+            try {
+                raytrace::ImageWriter::write("raytrace.png", fb);
+                printf("wrote raytrace.png\n");
+            } catch (exception& e) {
+                printf("%s\n", e.what());
+            }
+        }
     }
 }
 
 
+void View::benchmarkTraversal(int w, int h, stack<glm::mat4>& stack) {
+    cancelRaytrace();
+    scenegraph->compileRayScene(stack, &raytracePool);
+
+    raytrace::TraversalBenchmark bench;
+    bench.run(scenegraph->getRayScene(), raytrace::Camera(w, h), raytracePool);
+    bench.print();
+}
+
+
 void View::switchCamera() {
     fixedCamera = !fixedCamera;
 }
@@ -188,6 +309,10 @@ void View::mouseDragged(int x,int y)
   glm::vec2 delta = glm::vec2((float)(newM.x-mousePos.x),(float)(newM.y-mousePos.y));
   mousePos = newM;
 
+  //an interactive raytrace follows the trackball instead
+  if (!interactiveRaytrace)
+    cancelRaytrace();
+
   trackballTransform =
       glm::rotate(glm::mat4(1.0),delta.x/trackballRadius,glm::vec3(0.0f,1.0f,0.0f)) *
       glm::rotate(glm::mat4(1.0),delta.y/trackballRadius,glm::vec3(1.0f,0.0f,0.0f)) *
@@ -196,6 +321,9 @@ void View::mouseDragged(int x,int y)
 
 void View::reshape(util::OpenGLFunctions& gl,int width,int height)
 {
+  //a raytrace of the old size is of no use any more
+  cancelRaytrace();
+
   //record the new width and height
   WINDOW_WIDTH = width;
   WINDOW_HEIGHT = height;
@@ -227,6 +355,7 @@ void View::setCamera(glm::vec3 e, glm::vec3 c, glm::vec3 u) {
 }
 
 void View::addToCamera(glm::vec3 e, glm::vec3 c, glm::vec3 u) {
+    cancelRaytrace();
     eye = glm::vec3(eye.x + e.x, eye.y + e.y, eye.z + e.z);
     center = glm::vec3(center.x + c.x, center.y + c.y, center.z + c.z);
     up = glm::vec3(up.x + u.x, up.y + u.y, up.z + u.z);
@@ -286,10 +415,54 @@ void View::onKeyPressed(int key) {
         rayTrace = true;
     }
 
+    if(key == Qt::Key_P){
+        packetTracing = !packetTracing;
+        printf("packet tracing %s\n", packetTracing ? "on" : "off");
+    }
+
+    if(key == Qt::Key_Q){
+        wavefront = !wavefront;
+        printf("wavefront tracing %s\n", wavefront ? "on" : "off");
+    }
+
+    if(key == Qt::Key_T){
+        pathTracing = !pathTracing;
+        printf("path tracing %s\n", pathTracing ? "on" : "off");
+    }
+
+    if(key == Qt::Key_B){
+        benchmark = true;
+    }
+
+    if(key == Qt::Key_N){
+        antialiasing = !antialiasing;
+        printf("anti-aliasing %s\n", antialiasing ? "on" : "off");
+    }
+
+    if(key == Qt::Key_I){
+        interactiveRaytrace = !interactiveRaytrace;
+        progressiveRender.getRaytracer().setReprojection(interactiveRaytrace);
+        if (!interactiveRaytrace)
+            cancelRaytrace();
+        printf("interactive raytracing %s\n", interactiveRaytrace ? "on" : "off");
+    }
+
+    if(key == Qt::Key_V){
+        //report the last frame before switching
+        printf("drew %d leaves, culled %d\n", renderer.getDrawnCount(), renderer.getCulledCount());
+        renderer.setCulling(!renderer.isCulling());
+        printf("frustum culling %s\n", renderer.isCulling() ? "on" : "off");
+    }
+
 }
 
 void View::dispose(util::OpenGLFunctions& gl)
 {
+  //stop raytracing before the scene graph goes away
+  progressiveRender.cancel();
+  gl.glDeleteFramebuffers(1, &raytraceFBO);
+  gl.glDeleteTextures(1, &raytraceTexture);
+
   //clean up the OpenGL resources used by the object
   scenegraph->dispose();
   renderer.dispose();
@@ -10,6 +10,12 @@
 #include "ObjectInstance.h"
 #include "VertexAttrib.h"
 #include "sgraph/GLScenegraphRenderer.h"
+#include "raytrace/Framebuffer.h"
+#include "raytrace/ImageWriter.h"
+#include "raytrace/ProgressiveRender.h"
+#include "raytrace/Camera.h"
+#include "raytrace/TraversalBenchmark.h"
+#include "ThreadPool.h"
 #include <stack>
 #include <QKeyEvent>
 
@@ -77,7 +83,18 @@ public:
 
     void addToCamera(glm::vec3 e, glm::vec3 c, glm::vec3 u);
 
-    void raytrace(int w, int h, stack<glm::mat4> stack);
+    //starts raytracing the scene in the background; the image is shown as it
+    //is made until the camera moves
+    void raytrace(util::OpenGLFunctions& gl, int w, int h, stack<glm::mat4>& stack);
+
+    //stops the background raytrace and returns to the OpenGL view
+    void cancelRaytrace();
+
+    //copies the tiles finished since the last frame to the screen
+    void drawRaytrace(util::OpenGLFunctions& gl);
+
+    //compares single-ray and packet traversal of the primary rays
+    void benchmarkTraversal(int w, int h, stack<glm::mat4>& stack);
 
 private:
     int time;
@@ -104,6 +121,21 @@ private:
     //the GLSL shader
     util::ShaderProgram program;
     sgraph::GLScenegraphRenderer renderer;
+    //the worker threads that bring the transformations up to date before
+    //every draw, apart from the raytrace so that a frame never waits on tiles
+    util::ThreadPool drawPool;
+    //the worker threads that trace tiles of the image in parallel
+    util::ThreadPool raytracePool;
+    //the raytrace running in the background, and the image it produces
+    raytrace::ProgressiveRender progressiveRender;
+    //the texture the raytraced image is copied to, and the framebuffer
+    //object used to blit it to the screen
+    GLuint raytraceTexture, raytraceFBO;
+    int raytraceWidth, raytraceHeight;
+    //whether the raytraced image is shown instead of the OpenGL view
+    bool showRaytrace = false;
+    //whether the end of the current raytrace has been reported
+    bool raytraceReported = false;
 
     bool fixedCamera = false;
 
@@ -120,6 +152,28 @@ private:
     bool renderCamera= false;
 
     bool rayTrace = false;
+
+    bool benchmark = false;
+
+    //trace primary rays in SIMD packets instead of one at a time
+    bool packetTracing = true;
+
+    //trace each tile breadth first through a wavefront pipeline
+    bool wavefront = false;
+
+    //path trace instead of raytracing, refining the image on every render
+    //while the view stays still
+    bool pathTracing = false;
+
+    //supersample the pixels on edges of the raytraced image
+    bool antialiasing = false;
+
+    //keep raytracing while the view moves, reusing the last frame
+    bool interactiveRaytrace = false;
+    //the view of the last raytrace started, and whether it was the same as
+    //the one before (so that the image is exact rather than reprojected)
+    glm::mat4 raytraceView;
+    bool raytraceSettled = false;
 };
 
 #endif // VIEW_H
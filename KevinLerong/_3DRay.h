@@ -8,6 +8,10 @@ using namespace std;
 class _3DRay
 {
 public:
+    _3DRay() {
+        pos = glm::vec4(0,0,0,1);
+        dir = glm::vec4(0,0,-1,0);
+    }
     _3DRay(glm::vec4 _pos, glm::vec4 _dir) {
         pos = _pos;
         dir = _dir;
@@ -0,0 +1,130 @@
+#ifndef _AABB_H_
+#define _AABB_H_
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <limits>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * An axis-aligned bounding box. A newly created box is empty (its minimum is
+ * larger than its maximum), so that expanding it by the first point or box
+ * yields exactly that point or box.
+ */
+  class AABB
+  {
+  public:
+    glm::vec3 min,max;
+
+    AABB()
+    {
+      float inf = numeric_limits<float>::infinity();
+      min = glm::vec3(inf,inf,inf);
+      max = glm::vec3(-inf,-inf,-inf);
+    }
+
+    AABB(const glm::vec3& min,const glm::vec3& max)
+    {
+      this->min = min;
+      this->max = max;
+    }
+
+    bool isEmpty() const
+    {
+      return (min.x>max.x) || (min.y>max.y) || (min.z>max.z);
+    }
+
+    void expand(const glm::vec3& p)
+    {
+      min = glm::min(min,p);
+      max = glm::max(max,p);
+    }
+
+    void expand(const AABB& box)
+    {
+      min = glm::min(min,box.min);
+      max = glm::max(max,box.max);
+    }
+
+    glm::vec3 getCentroid() const
+    {
+      return 0.5f*(min+max);
+    }
+
+    glm::vec3 getExtent() const
+    {
+      return max-min;
+    }
+
+    /**
+     * Surface area of this box, as used by the surface area heuristic. An
+     * empty box has no area
+     */
+    float getSurfaceArea() const
+    {
+      if (isEmpty())
+        return 0;
+      glm::vec3 e = max-min;
+      return 2.0f*(e.x*e.y + e.y*e.z + e.z*e.x);
+    }
+
+    /**
+     * Returns the index (0,1,2) of the longest axis of this box
+     */
+    int getLongestAxis() const
+    {
+      glm::vec3 e = getExtent();
+      if ((e.x>=e.y) && (e.x>=e.z))
+        return 0;
+      return (e.y>=e.z)?1:2;
+    }
+
+    /**
+     * Returns the box that bounds this box after it has been transformed by the
+     * given matrix. All 8 corners are transformed, so the result is
+     * conservative for any affine transformation
+     */
+    AABB transform(const glm::mat4& m) const
+    {
+      AABB result;
+      if (isEmpty())
+        return result;
+      for (int i=0;i<8;i++)
+        {
+          glm::vec4 corner((i&1)?max.x:min.x,
+                           (i&2)?max.y:min.y,
+                           (i&4)?max.z:min.z,
+                           1.0f);
+          result.expand(glm::vec3(m*corner));
+        }
+      return result;
+    }
+
+    /**
+     * Slab test of a ray against this box.
+     * \param origin the start of the ray
+     * \param invDir the componentwise reciprocal of the ray direction
+     * \param tMin the smallest ray parameter of interest
+     * \param tMax the largest ray parameter of interest
+     * \param tEntry on a hit, the ray parameter where the ray enters the box
+     * \return true if the ray overlaps the box within [tMin,tMax]
+     */
+    bool intersect(const glm::vec3& origin,const glm::vec3& invDir,
+                   float tMin,float tMax,float& tEntry) const
+    {
+      glm::vec3 t0 = (min-origin)*invDir;
+      glm::vec3 t1 = (max-origin)*invDir;
+      glm::vec3 tNear = glm::min(t0,t1);
+      glm::vec3 tFar = glm::max(t0,t1);
+      float enter = std::max(std::max(tNear.x,tNear.y),std::max(tNear.z,tMin));
+      float exit = std::min(std::min(tFar.x,tFar.y),std::min(tFar.z,tMax));
+      tEntry = enter;
+      return enter<=exit;
+    }
+  };
+}
+
+#endif
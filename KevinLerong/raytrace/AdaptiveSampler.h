@@ -0,0 +1,254 @@
+#ifndef _ADAPTIVESAMPLER_H_
+#define _ADAPTIVESAMPLER_H_
+
+#include "Framebuffer.h"
+#include "SIMD.h"
+#include "TileRenderer.h"
+#include "ThreadPool.h"
+#include "TraceCounters.h"
+#include "_3DRay.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * Anti-aliases a raytraced image by supersampling only where it is needed.
+ *
+ * The image is first traced with one ray per pixel, which also records what
+ * every pixel hit (see Framebuffer::setHit). A pixel is on an edge if it
+ * differs from a neighbour in the object hit, in depth, or in color by more
+ * than a threshold. Only the edge pixels are traced again, with a stratified
+ * grid of jittered samples over the pixel, and their color replaced by the
+ * average of these samples. Flat regions such as the background cost nothing
+ * extra.
+ *
+ * The edge pixels are handed to the thread pool in small jobs of their own,
+ * grouped by tile, so that the refinement is balanced across threads however
+ * unevenly the edges are spread over the image.
+ */
+  class AdaptiveSampler
+  {
+  public:
+    /**
+     * The number of samples along each side of a refined pixel
+     */
+    int samplesPerAxis;
+    /**
+     * Neighbours whose colors differ by more than this in any channel are
+     * refined
+     */
+    float colorThreshold;
+    /**
+     * Neighbours whose depths differ by more than this fraction of the nearer
+     * depth are refined
+     */
+    float depthThreshold;
+    /**
+     * The most edge pixels in one job
+     */
+    int pixelsPerJob;
+
+  protected:
+    util::ThreadPool& pool;
+    int tileSize;
+    const atomic<bool> *cancelFlag;
+    TileRenderer::TileListener tileListener;
+    //which pixels findEdges found on an edge, kept from one call to the next
+    vector<char> edge;
+
+  public:
+    AdaptiveSampler(util::ThreadPool& pool,int tileSize=32)
+      :pool(pool)
+    {
+      samplesPerAxis = 4;
+      colorThreshold = 0.1f;
+      depthThreshold = 0.05f;
+      pixelsPerJob = 64;
+      this->tileSize = max(tileSize,1);
+      cancelFlag = NULL;
+    }
+
+    void setTileSize(int size)
+    {
+      tileSize = max(size,1);
+    }
+
+    void setCancelFlag(const atomic<bool> *flag)
+    {
+      cancelFlag = flag;
+    }
+
+    /**
+     * Set the function told about every refined region, see
+     * TileRenderer::setTileListener
+     */
+    void setTileListener(const TileRenderer::TileListener& listener)
+    {
+      tileListener = listener;
+    }
+
+    /**
+     * Find the pixels of a traced image that lie on an edge
+     * \param fb the image, with the hits of its pixels recorded
+     * \param pixels receives the edge pixels, as y*width+x, grouped by tile
+     */
+    void findEdges(const Framebuffer& fb,vector<int>& pixels)
+    {
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+      edge.assign((size_t)w*h,0);
+      for (int y=0;y<h;y++)
+        {
+          for (int x=0;x<w;x++)
+            {
+              if ((x+1<w) && differ(fb,x,y,x+1,y))
+                edge[(size_t)y*w+x] = edge[(size_t)y*w+x+1] = 1;
+              if ((y+1<h) && differ(fb,x,y,x,y+1))
+                edge[(size_t)y*w+x] = edge[(size_t)(y+1)*w+x] = 1;
+            }
+        }
+
+      pixels.clear();
+      for (int ty=0;ty<h;ty+=tileSize)
+        for (int tx=0;tx<w;tx+=tileSize)
+          for (int y=ty;y<min(ty+tileSize,h);y++)
+            for (int x=tx;x<min(tx+tileSize,w);x++)
+              if (edge[(size_t)y*w+x])
+                pixels.push_back(y*w+x);
+    }
+
+    /**
+     * Supersample the given pixels, and block until all are done
+     * \param fb the framebuffer whose pixels are replaced
+     * \param pixels the pixels to be refined, as returned by findEdges
+     * \param rayThrough a function (float x,float y)->_3DRay that returns
+     * the ray through a point of the image in pixel coordinates
+     * \param traceRays a function (int x,int y,const _3DRay *rays,int n,
+     * glm::vec3 *colors) that traces up to SIMD_WIDTH rays of pixel (x,y)
+     * \return the number of extra rays and time taken
+     */
+    template <class RayFunction,class TraceFunction>
+    RenderStats refine(Framebuffer& fb,const vector<int>& pixels,
+                       RayFunction rayThrough,TraceFunction traceRays)
+    {
+      RenderStats stats;
+      atomic<long long> rays(0);
+      util::ThreadPool::Batch jobs;
+      int w = fb.getWidth();
+      int n = samplesPerAxis;
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+      //cut the list into jobs that never straddle a tile
+      unsigned int first = 0;
+      while (first<pixels.size())
+        {
+          unsigned int last = first+1;
+          int tile = getTile(pixels[first],w);
+          while ((last<pixels.size()) && (last-first<(unsigned int)pixelsPerJob) &&
+                 (getTile(pixels[last],w)==tile))
+            last++;
+
+          pool.submit(jobs,[this,&fb,&pixels,&rayThrough,&traceRays,&rays,w,n,first,last]()
+          {
+            StageTimer timer(STAGE_ANTIALIAS);
+            int x0 = w,y0 = fb.getHeight(),x1 = 0,y1 = 0;
+            //the samples are traced SIMD_WIDTH at a time, so a pixel needs no
+            //more room than that however many samples it takes
+            _3DRay samples[SIMD_WIDTH];
+            glm::vec3 colors[SIMD_WIDTH];
+            for (unsigned int p=first;p<last;p++)
+              {
+                if (isCancelled())
+                  return;
+                int x = pixels[p]%w;
+                int y = pixels[p]/w;
+
+                //one jittered sample in every cell of an n x n grid over the
+                //pixel, which is centered on (x,y)
+                unsigned int rng = (unsigned int)pixels[p]*2654435761u+1;
+                glm::vec3 sum(0,0,0);
+                int count = 0;
+                for (int s=0;s<n*n;s++)
+                  {
+                    float sx = x-0.5f+(s%n+random(rng))/n;
+                    float sy = y-0.5f+(s/n+random(rng))/n;
+                    samples[count++] = rayThrough(sx,sy);
+                    if ((count==SIMD_WIDTH) || (s==n*n-1))
+                      {
+                        traceRays(x,y,samples,count,colors);
+                        for (int c=0;c<count;c++)
+                          sum += colors[c];
+                        count = 0;
+                      }
+                  }
+                fb.setColor(x,y,sum/(float)(n*n));
+
+                x0 = min(x0,x);
+                y0 = min(y0,y);
+                x1 = max(x1,x+1);
+                y1 = max(y1,y+1);
+              }
+            rays += (long long)(last-first)*n*n;
+            if (tileListener)
+              tileListener(x0,y0,x1-x0,y1-y0);
+          });
+          stats.tiles++;
+          first = last;
+        }
+      pool.wait(jobs);
+
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      stats.seconds = elapsed.count();
+      stats.rays = rays;
+      stats.threads = pool.getThreadCount();
+      stats.cancelled = isCancelled();
+      return stats;
+    }
+
+  protected:
+    bool isCancelled() const
+    {
+      return (cancelFlag!=NULL) && (*cancelFlag);
+    }
+
+    bool differ(const Framebuffer& fb,int xa,int ya,int xb,int yb) const
+    {
+      if (fb.getObject(xa,ya)!=fb.getObject(xb,yb))
+        return true;
+
+      float da = fb.getDepth(xa,ya);
+      float db = fb.getDepth(xb,yb);
+      if ((da!=db) && (fabs(da-db)>depthThreshold*min(da,db)))
+        return true;
+
+      glm::vec3 diff = glm::abs(fb.getColor(xa,ya)-fb.getColor(xb,yb));
+      return max(diff.x,max(diff.y,diff.z))>colorThreshold;
+    }
+
+    int getTile(int pixel,int w) const
+    {
+      int tilesPerRow = (w+tileSize-1)/tileSize;
+      return ((pixel/w)/tileSize)*tilesPerRow+(pixel%w)/tileSize;
+    }
+
+    /**
+     * A random number in [0,1) from a xorshift generator
+     */
+    static float random(unsigned int& state)
+    {
+      state ^= state<<13;
+      state ^= state>>17;
+      state ^= state<<5;
+      return (state>>8)*(1.0f/16777216.0f);
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,748 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include "AABB.h"
+#include "RayPacket.h"
+#include "ThreadPool.h"
+#include "TraceCounters.h"
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+   * One node of a raytrace::BVH. Nodes are stored in a flat array. An interior
+   * node has count==0 and its two children are at leftFirst and leftFirst+1.
+   * A leaf has count>0 and refers to the primitives
+   * indices[leftFirst .. leftFirst+count-1] of the BVH.
+   */
+  class BVHNode
+  {
+  public:
+    AABB bounds;
+    int leftFirst;
+    int count;
+
+    BVHNode()
+    {
+      leftFirst = 0;
+      count = 0;
+    }
+
+    bool isLeaf() const
+    {
+      return count>0;
+    }
+  };
+
+  /**
+   * What BVH::refit() did to bring a hierarchy up to date
+   */
+  enum BVHUpdate
+  {
+    BVH_REFITTED,
+    BVH_PARTLY_REBUILT,
+    BVH_REBUILT
+  };
+
+  /**
+ * A bounding volume hierarchy over a set of primitives, of which it knows only
+ * the bounding boxes. It is built top-down with the surface area heuristic
+ * (SAH) evaluated over a fixed number of bins on each axis.
+ *
+ * The hierarchy stores indices into the caller's primitive array. What a
+ * primitive actually is (an object instance, a triangle, ...) is known only
+ * to the function passed to traverse().
+ *
+ * When the primitives move, refit() updates the hierarchy for much less than
+ * building it again, as long as it stays good enough.
+ */
+  class BVH
+  {
+  public:
+    /**
+     * The deepest a BVH is allowed to get. This bounds the size of the
+     * traversal stack
+     */
+    static const int MAX_DEPTH = 64;
+
+  protected:
+    static const int NUM_BINS = 16;
+
+    vector<BVHNode> nodes;
+    vector<int> indices;
+    int maxLeafSize;
+    //the surface area of every node, and the SAH cost of the hierarchy, when
+    //they were last built
+    vector<float> builtAreas;
+    float builtCost;
+
+    class Bin
+    {
+    public:
+      AABB bounds;
+      int count;
+      Bin() { count = 0; }
+    };
+
+    class BuildTask
+    {
+    public:
+      int node,depth;
+      BuildTask(int node,int depth)
+      {
+        this->node = node;
+        this->depth = depth;
+      }
+    };
+
+  public:
+    BVH()
+    {
+      maxLeafSize = 4;
+      builtCost = 0;
+    }
+
+    /**
+     * Build the hierarchy over the given primitives
+     * \param primBounds the bounding box of every primitive
+     * \param maxLeafSize leaves with more than these many primitives are always split
+     */
+    void build(const vector<AABB>& primBounds,int maxLeafSize=4)
+    {
+      int n = primBounds.size();
+      this->maxLeafSize = maxLeafSize;
+      nodes.clear();
+      indices.resize(n);
+      for (int i=0;i<n;i++)
+        indices[i] = i;
+      if (n>0)
+        {
+          nodes.reserve(2*n);
+          nodes.push_back(BVHNode());
+          nodes[0].leftFirst = 0;
+          nodes[0].count = n;
+          split(primBounds,0,1);
+        }
+      builtAreas.resize(nodes.size());
+      for (unsigned int i=0;i<nodes.size();i++)
+        builtAreas[i] = nodes[i].bounds.getSurfaceArea();
+      builtCost = getCost();
+    }
+
+    /**
+     * Bring the hierarchy up to date after its primitives moved, without
+     * changing which primitives it holds. The boxes are refitted bottom-up,
+     * keeping the structure, which is much cheaper than building again but
+     * lets the hierarchy get worse as primitives drift apart from the ones
+     * they were grouped with. So its SAH cost is then compared with its cost
+     * when it was last built:
+     * - if it is within maxCostRatio of it, the refitted hierarchy is kept,
+     * - otherwise, the highest subtrees whose box grew by more than
+     *   maxCostRatio are built again over their own primitives,
+     * - and if that is not enough, the whole hierarchy is built again.
+     * \param primBounds the new bounding box of every primitive, as many as
+     * the hierarchy was built over
+     * \param maxCostRatio how much worse than when it was built the hierarchy
+     * may get
+     * \param pool if not NULL, subtrees are refitted on this pool
+     * \return what was done
+     */
+    BVHUpdate refit(const vector<AABB>& primBounds,float maxCostRatio,util::ThreadPool *pool=NULL)
+    {
+      if (nodes.empty())
+        return BVH_REFITTED;
+
+      //a few subtrees per thread, refitted in parallel, then the nodes above them
+      vector<int> top,subtrees;
+      subtrees.push_back(0);
+      unsigned int enough = (pool!=NULL)?4*pool->getThreadCount():1;
+      while ((subtrees.size()<enough) && !nodes[subtrees[0]].isLeaf())
+        {
+          vector<int> next;
+          for (unsigned int i=0;i<subtrees.size();i++)
+            {
+              const BVHNode& node = nodes[subtrees[i]];
+              if (node.isLeaf())
+                next.push_back(subtrees[i]);
+              else
+                {
+                  top.push_back(subtrees[i]);
+                  next.push_back(node.leftFirst);
+                  next.push_back(node.leftFirst+1);
+                }
+            }
+          if (next.size()==subtrees.size())
+            break;
+          subtrees.swap(next);
+        }
+      if ((pool!=NULL) && (subtrees.size()>1))
+        {
+          util::ThreadPool::Batch jobs;
+          for (unsigned int i=0;i<subtrees.size();i++)
+            {
+              int root = subtrees[i];
+              pool->submit(jobs,[this,&primBounds,root]() { refitSubtree(primBounds,root); });
+            }
+          pool->wait(jobs);
+        }
+      else
+        {
+          for (unsigned int i=0;i<subtrees.size();i++)
+            refitSubtree(primBounds,subtrees[i]);
+        }
+      for (int i=top.size()-1;i>=0;i--)
+        refitNode(primBounds,top[i]);
+
+      if (getCost()<=maxCostRatio*builtCost)
+        return BVH_REFITTED;
+
+      //build again the highest subtrees that grew too much, as long as the
+      //nodes they leave behind do not pile up
+      int rebuilt = 0;
+      vector<int> todo(1,0);
+      vector<int> depths(1,1);
+      while (!todo.empty() && (nodes.size()<4*indices.size()))
+        {
+          int n = todo.back();
+          int depth = depths.back();
+          todo.pop_back();
+          depths.pop_back();
+          if (nodes[n].isLeaf())
+            continue;
+          if (nodes[n].bounds.getSurfaceArea()>maxCostRatio*builtAreas[n])
+            {
+              rebuildSubtree(primBounds,n,depth);
+              rebuilt++;
+              continue;
+            }
+          todo.push_back(nodes[n].leftFirst);
+          todo.push_back(nodes[n].leftFirst+1);
+          depths.push_back(depth+1);
+          depths.push_back(depth+1);
+        }
+      float cost = getCost();
+      if ((rebuilt>0) && (cost<=maxCostRatio*builtCost))
+        {
+          builtCost = cost;
+          return BVH_PARTLY_REBUILT;
+        }
+      build(primBounds,maxLeafSize);
+      return BVH_REBUILT;
+    }
+
+    /**
+     * The SAH cost of the hierarchy: the expected number of node visits and
+     * primitive tests for a ray through its box, counting one for each
+     */
+    float getCost() const
+    {
+      if (nodes.empty())
+        return 0;
+      float rootArea = nodes[0].bounds.getSurfaceArea();
+      if (rootArea<=0)
+        return 0;
+      float cost = 0;
+      vector<int> todo(1,0);
+      while (!todo.empty())
+        {
+          const BVHNode& node = nodes[todo.back()];
+          todo.pop_back();
+          if (node.isLeaf())
+            cost += node.bounds.getSurfaceArea()*node.count;
+          else
+            {
+              cost += node.bounds.getSurfaceArea();
+              todo.push_back(node.leftFirst);
+              todo.push_back(node.leftFirst+1);
+            }
+        }
+      return cost/rootArea;
+    }
+
+    bool isEmpty() const
+    {
+      return nodes.empty();
+    }
+
+    /**
+     * Returns the bounding box of everything in this hierarchy
+     */
+    AABB getBounds() const
+    {
+      if (nodes.empty())
+        return AABB();
+      return nodes[0].bounds;
+    }
+
+    const vector<BVHNode>& getNodes() const
+    {
+      return nodes;
+    }
+
+    const vector<int>& getIndices() const
+    {
+      return indices;
+    }
+
+    /**
+     * Find the closest intersection along a ray. Nodes are visited front to back
+     * and skipped once they lie entirely beyond the closest hit found so far.
+     * \param origin the start of the ray
+     * \param dir the direction of the ray (need not be normalized)
+     * \param tMin the smallest ray parameter of interest
+     * \param tMax the largest ray parameter of interest. It is updated by the
+     * intersection function whenever a closer hit is found
+     * \param intersect a function (int prim,float& tMax)->bool that intersects
+     * the ray with primitive number prim, and on a hit closer than tMax records
+     * the hit, lowers tMax and returns true
+     * \return true if any primitive was hit
+     */
+    template <class IntersectFunction>
+    bool traverse(const glm::vec3& origin,const glm::vec3& dir,
+                  float tMin,float& tMax,IntersectFunction intersect) const
+    {
+      if (nodes.empty())
+        return false;
+
+      glm::vec3 invDir = 1.0f/dir;
+      float tEntry;
+      if (!nodes[0].bounds.intersect(origin,invDir,tMin,tMax,tEntry))
+        return false;
+
+      int stackNodes[MAX_DEPTH];
+      float stackEntry[MAX_DEPTH];
+      int sp = 0;
+      int current = 0;
+      bool hit = false;
+      //counted here and added to the counters of the thread once per ray
+      int visited = 0;
+
+      while (true)
+        {
+          const BVHNode& node = nodes[current];
+          visited++;
+          if (node.isLeaf())
+            {
+              for (int i=0;i<node.count;i++)
+                {
+                  if (intersect(indices[node.leftFirst+i],tMax))
+                    hit = true;
+                }
+            }
+          else
+            {
+              int closer = node.leftFirst;
+              int farther = closer+1;
+              float tCloser,tFarther;
+              bool hitCloser = nodes[closer].bounds.intersect(origin,invDir,tMin,tMax,tCloser);
+              bool hitFarther = nodes[farther].bounds.intersect(origin,invDir,tMin,tMax,tFarther);
+              if (hitCloser && hitFarther)
+                {
+                  if (tFarther<tCloser)
+                    {
+                      std::swap(closer,farther);
+                      std::swap(tCloser,tFarther);
+                    }
+                  stackNodes[sp] = farther;
+                  stackEntry[sp] = tFarther;
+                  sp++;
+                  current = closer;
+                  continue;
+                }
+              else if (hitCloser)
+                {
+                  current = closer;
+                  continue;
+                }
+              else if (hitFarther)
+                {
+                  current = farther;
+                  continue;
+                }
+            }
+
+          //pop the next node that still lies in front of the closest hit
+          do
+            {
+              if (sp==0)
+                {
+                  TraceCounters::local().nodes += visited;
+                  return hit;
+                }
+              sp--;
+            }
+          while (stackEntry[sp]>tMax);
+          current = stackNodes[sp];
+        }
+    }
+
+    /**
+     * Find out whether a ray hits anything at all between tMin and tMax (e.g.
+     * whether a shadow ray is blocked). Traversal stops at the first primitive
+     * hit, so nodes are neither ordered nor pruned by distance.
+     * \param origin the start of the ray
+     * \param dir the direction of the ray (need not be normalized)
+     * \param tMin the smallest ray parameter of interest
+     * \param tMax the largest ray parameter of interest
+     * \param intersect a function (int prim)->bool that returns true if the
+     * ray hits primitive number prim between tMin and tMax
+     * \return true if any primitive was hit
+     */
+    template <class IntersectFunction>
+    bool traverseAny(const glm::vec3& origin,const glm::vec3& dir,
+                     float tMin,float tMax,IntersectFunction intersect) const
+    {
+      if (nodes.empty())
+        return false;
+
+      glm::vec3 invDir = 1.0f/dir;
+      float tEntry;
+      int stackNodes[MAX_DEPTH];
+      int sp = 0;
+      stackNodes[sp++] = 0;
+      int visited = 0;
+
+      while (sp>0)
+        {
+          const BVHNode& node = nodes[stackNodes[--sp]];
+          visited++;
+          if (!node.bounds.intersect(origin,invDir,tMin,tMax,tEntry))
+            continue;
+          if (node.isLeaf())
+            {
+              for (int i=0;i<node.count;i++)
+                {
+                  if (intersect(indices[node.leftFirst+i]))
+                    {
+                      TraceCounters::local().nodes += visited;
+                      return true;
+                    }
+                }
+            }
+          else
+            {
+              stackNodes[sp++] = node.leftFirst+1;
+              stackNodes[sp++] = node.leftFirst;
+            }
+        }
+      TraceCounters::local().nodes += visited;
+      return false;
+    }
+
+    /**
+     * Trace a packet of rays through the hierarchy. A node is visited if any
+     * active ray of the packet overlaps it, and the children are visited in the
+     * order the packet as a whole is heading. Traversal stops early once no ray
+     * is active any more, which lets the intersection function implement
+     * any-hit queries by deactivating rays as they hit.
+     * \param packet the rays. The intersection function lowers tMax of rays
+     * that hit, and may clear their active bit
+     * \param intersect a function (int prim,RayPacket& packet,const SimdMask& mask)
+     * that intersects the rays in mask with primitive number prim
+     */
+    template <class IntersectFunction>
+    void traversePacket(RayPacket& packet,IntersectFunction intersect) const
+    {
+      if (nodes.empty() || packet.active.none())
+        return;
+
+      //a representative direction to order children front to back
+      int lane = 0;
+      while (!packet.active.get(lane))
+        lane++;
+      glm::vec3 heading = packet.dir.get(lane);
+
+      int stackNodes[MAX_DEPTH];
+      int sp = 0;
+      int current = 0;
+      SimdMask mask = intersectNode(nodes[0],packet);
+      int visited = 1;
+
+      while (true)
+        {
+          if (mask.any())
+            {
+              const BVHNode& node = nodes[current];
+              if (node.isLeaf())
+                {
+                  for (int i=0;i<node.count;i++)
+                    {
+                      intersect(indices[node.leftFirst+i],packet,mask);
+                      if (packet.active.none())
+                        {
+                          TraceCounters::local().packetNodes += visited;
+                          return;
+                        }
+                    }
+                }
+              else
+                {
+                  int closer = node.leftFirst;
+                  int farther = closer+1;
+                  if (glm::dot(heading,nodes[farther].bounds.getCentroid()-nodes[closer].bounds.getCentroid())<0)
+                    std::swap(closer,farther);
+                  stackNodes[sp++] = farther;
+                  current = closer;
+                  mask = intersectNode(nodes[current],packet);
+                  visited++;
+                  continue;
+                }
+            }
+
+          if (sp==0)
+            {
+              TraceCounters::local().packetNodes += visited;
+              return;
+            }
+          current = stackNodes[--sp];
+          mask = intersectNode(nodes[current],packet);
+          visited++;
+        }
+    }
+
+  protected:
+    /**
+     * Split a node holding indices[leftFirst .. leftFirst+count-1] top-down
+     * with the SAH, appending its descendants to the nodes
+     * \param primBounds the bounding box of every primitive
+     * \param root the node
+     * \param rootDepth the depth of the node in the whole hierarchy, 1 for
+     * the root
+     */
+    void split(const vector<AABB>& primBounds,int root,int rootDepth)
+    {
+      vector<glm::vec3> centroids(primBounds.size());
+      for (int i=nodes[root].leftFirst;i<nodes[root].leftFirst+nodes[root].count;i++)
+        centroids[indices[i]] = primBounds[indices[i]].getCentroid();
+
+      vector<BuildTask> todo;
+      todo.push_back(BuildTask(root,rootDepth));
+      while (!todo.empty())
+        {
+          BuildTask task = todo.back();
+          todo.pop_back();
+          int first = nodes[task.node].leftFirst;
+          int count = nodes[task.node].count;
+
+          AABB bounds,centroidBounds;
+          for (int i=first;i<first+count;i++)
+            {
+              bounds.expand(primBounds[indices[i]]);
+              centroidBounds.expand(centroids[indices[i]]);
+            }
+          nodes[task.node].bounds = bounds;
+
+          if ((count==1) || (task.depth>=MAX_DEPTH))
+            continue;
+
+          int axis,split;
+          float cost;
+          if (!findSplit(primBounds,centroids,first,count,centroidBounds,axis,split,cost))
+            continue;
+
+          //SAH: traversal cost 1, intersection cost 1 per primitive
+          float splitCost = 1.0f + cost/std::max(bounds.getSurfaceArea(),1e-20f);
+          if ((count<=maxLeafSize) && (count<=splitCost))
+            continue;
+
+          float cmin = centroidBounds.min[axis];
+          float scale = NUM_BINS/(centroidBounds.max[axis]-cmin);
+          int *mid = std::partition(&indices[first],&indices[first]+count,
+              [&](int p) { return binOf(centroids[p][axis],cmin,scale)<=split; });
+          int leftCount = mid-&indices[first];
+          if ((leftCount==0) || (leftCount==count))
+            continue;
+
+          int left = nodes.size();
+          nodes.push_back(BVHNode());
+          nodes.push_back(BVHNode());
+          nodes[left].leftFirst = first;
+          nodes[left].count = leftCount;
+          nodes[left+1].leftFirst = first+leftCount;
+          nodes[left+1].count = count-leftCount;
+          nodes[task.node].leftFirst = left;
+          nodes[task.node].count = 0;
+
+          todo.push_back(BuildTask(left+1,task.depth+1));
+          todo.push_back(BuildTask(left,task.depth+1));
+        }
+    }
+
+    /**
+     * Recompute the box of a node from its primitives or its children
+     */
+    void refitNode(const vector<AABB>& primBounds,int n)
+    {
+      BVHNode& node = nodes[n];
+      AABB bounds;
+      if (node.isLeaf())
+        {
+          for (int i=node.leftFirst;i<node.leftFirst+node.count;i++)
+            bounds.expand(primBounds[indices[i]]);
+        }
+      else
+        {
+          bounds = nodes[node.leftFirst].bounds;
+          bounds.expand(nodes[node.leftFirst+1].bounds);
+        }
+      node.bounds = bounds;
+    }
+
+    /**
+     * Recompute the boxes of a node and all its descendants, children first
+     */
+    void refitSubtree(const vector<AABB>& primBounds,int root)
+    {
+      //both children are pushed at once, so the stack holds two nodes per level
+      int stack[2*MAX_DEPTH+2];
+      bool expanded[2*MAX_DEPTH+2];
+      int sp = 0;
+      stack[sp] = root;
+      expanded[sp] = false;
+      sp++;
+      while (sp>0)
+        {
+          int n = stack[sp-1];
+          if (nodes[n].isLeaf() || expanded[sp-1])
+            {
+              refitNode(primBounds,n);
+              sp--;
+              continue;
+            }
+          expanded[sp-1] = true;
+          stack[sp] = nodes[n].leftFirst;
+          expanded[sp] = false;
+          sp++;
+          stack[sp] = nodes[n].leftFirst+1;
+          expanded[sp] = false;
+          sp++;
+        }
+    }
+
+    /**
+     * Build a subtree again over the primitives it holds, which are all
+     * together in indices. Its old descendants are left unused
+     * \param primBounds the bounding box of every primitive
+     * \param root the root of the subtree
+     * \param depth the depth of the root in the whole hierarchy
+     */
+    void rebuildSubtree(const vector<AABB>& primBounds,int root,int depth)
+    {
+      int first = indices.size();
+      int count = 0;
+      vector<int> todo(1,root);
+      while (!todo.empty())
+        {
+          const BVHNode& node = nodes[todo.back()];
+          todo.pop_back();
+          if (node.isLeaf())
+            {
+              first = std::min(first,node.leftFirst);
+              count += node.count;
+            }
+          else
+            {
+              todo.push_back(node.leftFirst);
+              todo.push_back(node.leftFirst+1);
+            }
+        }
+      nodes[root].leftFirst = first;
+      nodes[root].count = count;
+      int added = nodes.size();
+      split(primBounds,root,depth);
+      builtAreas.resize(nodes.size());
+      builtAreas[root] = nodes[root].bounds.getSurfaceArea();
+      for (unsigned int i=added;i<nodes.size();i++)
+        builtAreas[i] = nodes[i].bounds.getSurfaceArea();
+    }
+
+    /**
+     * Slab test of all active rays of a packet against the box of a node
+     */
+    static SimdMask intersectNode(const BVHNode& node,const RayPacket& p)
+    {
+      SimdFloat t0x = (SimdFloat(node.bounds.min.x)-p.origin.x)*p.invDir.x;
+      SimdFloat t1x = (SimdFloat(node.bounds.max.x)-p.origin.x)*p.invDir.x;
+      SimdFloat t0y = (SimdFloat(node.bounds.min.y)-p.origin.y)*p.invDir.y;
+      SimdFloat t1y = (SimdFloat(node.bounds.max.y)-p.origin.y)*p.invDir.y;
+      SimdFloat t0z = (SimdFloat(node.bounds.min.z)-p.origin.z)*p.invDir.z;
+      SimdFloat t1z = (SimdFloat(node.bounds.max.z)-p.origin.z)*p.invDir.z;
+      SimdFloat enter = max(max(min(t0x,t1x),min(t0y,t1y)),max(min(t0z,t1z),p.tMin));
+      SimdFloat exit = min(min(max(t0x,t1x),max(t0y,t1y)),min(max(t0z,t1z),p.tMax));
+      return (enter<=exit) & p.active;
+    }
+
+    static int binOf(float c,float cmin,float scale)
+    {
+      int b = (int)((c-cmin)*scale);
+      return std::min(std::max(b,0),NUM_BINS-1);
+    }
+
+    /**
+     * Find the cheapest split of the given range according to the SAH. The
+     * returned cost is sum(area*count) over the two halves.
+     * \return false if no split exists (all centroids coincide)
+     */
+    bool findSplit(const vector<AABB>& primBounds,const vector<glm::vec3>& centroids,
+                   int first,int count,const AABB& centroidBounds,
+                   int& bestAxis,int& bestSplit,float& bestCost) const
+    {
+      bestAxis = -1;
+      bestSplit = 0;
+      bestCost = numeric_limits<float>::infinity();
+
+      for (int axis=0;axis<3;axis++)
+        {
+          float cmin = centroidBounds.min[axis];
+          float extent = centroidBounds.max[axis]-cmin;
+          if (extent<=0)
+            continue;
+          float scale = NUM_BINS/extent;
+
+          Bin bins[NUM_BINS];
+          for (int i=first;i<first+count;i++)
+            {
+              int p = indices[i];
+              Bin& bin = bins[binOf(centroids[p][axis],cmin,scale)];
+              bin.bounds.expand(primBounds[p]);
+              bin.count++;
+            }
+
+          //sweep from the right to record the cost of everything right of each plane
+          float rightCost[NUM_BINS];
+          AABB right;
+          int rightCount = 0;
+          for (int i=NUM_BINS-1;i>0;i--)
+            {
+              right.expand(bins[i].bounds);
+              rightCount += bins[i].count;
+              rightCost[i-1] = right.getSurfaceArea()*rightCount;
+            }
+
+          AABB left;
+          int leftCount = 0;
+          for (int i=0;i<NUM_BINS-1;i++)
+            {
+              left.expand(bins[i].bounds);
+              leftCount += bins[i].count;
+              if ((leftCount==0) || (leftCount==count))
+                continue;
+              float cost = left.getSurfaceArea()*leftCount + rightCost[i];
+              if (cost<bestCost)
+                {
+                  bestCost = cost;
+                  bestAxis = axis;
+                  bestSplit = i;
+                }
+            }
+        }
+      return bestAxis>=0;
+    }
+  };
+}
+
+#endif
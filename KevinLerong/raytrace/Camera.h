@@ -0,0 +1,122 @@
+#ifndef _CAMERA_H_
+#define _CAMERA_H_
+
+#include "AABB.h"
+#include "_3DRay.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * Generates the primary rays of an image. The camera sits at the origin of the
+ * view coordinate system looking down -z, with the given vertical field of view
+ * (the same one the projection matrix of the OpenGL view uses).
+ */
+  class Camera
+  {
+  protected:
+    int width,height;
+    float focalLength;
+
+  public:
+    Camera(int width,int height,float fovyDegrees=120.0f)
+    {
+      this->width = width;
+      this->height = height;
+      focalLength = (0.5f*height)/tan(glm::radians(0.5f*fovyDegrees));
+    }
+
+    int getWidth() const
+    {
+      return width;
+    }
+
+    int getHeight() const
+    {
+      return height;
+    }
+
+    /**
+     * The distance of the image plane from the camera, in pixels
+     */
+    float getFocalLength() const
+    {
+      return focalLength;
+    }
+
+    /**
+     * The ray through a point of the image, in pixel coordinates with (0,0)
+     * at the bottom left
+     */
+    _3DRay getRay(float x,float y) const
+    {
+      return _3DRay(glm::vec4(0,0,0,1),
+                    glm::vec4(x - width/2,y - height/2,-focalLength,0));
+    }
+
+    /**
+     * Returns true if both cameras make the same rays
+     */
+    bool operator==(const Camera& camera) const
+    {
+      return (width==camera.width) && (height==camera.height) &&
+          (focalLength==camera.focalLength);
+    }
+
+    /**
+     * Find the pixels whose rays may pass through a box, counting every ray
+     * within half a pixel of a pixel's center (as anti-aliasing traces) as
+     * belonging to it
+     * \param box the box in the view coordinate system
+     * \param x0 receives the leftmost such pixel
+     * \param y0 receives the bottom such pixel
+     * \param x1 receives one past the rightmost such pixel
+     * \param y1 receives one past the top such pixel. The range is empty if
+     * the box is behind the camera
+     */
+    void getPixelBounds(const AABB& box,int& x0,int& y0,int& x1,int& y1) const
+    {
+      x0 = y0 = 0;
+      x1 = width;
+      y1 = height;
+      if (box.isEmpty() || (box.min.z>=0))
+        {
+          x1 = y1 = 0;
+          return;
+        }
+      //a box around the camera may be seen anywhere
+      if (box.max.z>=0)
+        return;
+
+      float inf = numeric_limits<float>::infinity();
+      glm::vec2 low(inf,inf),high(-inf,-inf);
+      for (int i=0;i<8;i++)
+        {
+          glm::vec3 corner((i&1)?box.max.x:box.min.x,
+                           (i&2)?box.max.y:box.min.y,
+                           (i&4)?box.max.z:box.min.z);
+          glm::vec2 p = glm::vec2(corner)*(focalLength/-corner.z) +
+              glm::vec2(width/2,height/2);
+          low = glm::min(low,p);
+          high = glm::max(high,p);
+        }
+      //boxes close to the eye project far outside the image
+      glm::vec2 limit(width+1,height+1);
+      low = glm::clamp(low,-limit,limit);
+      high = glm::clamp(high,-limit,limit);
+      x0 = max(x0,(int)floor(low.x-0.5f));
+      y0 = max(y0,(int)floor(low.y-0.5f));
+      x1 = min(x1,(int)floor(high.x+0.5f)+1);
+      y1 = min(y1,(int)floor(high.y+0.5f)+1);
+      x1 = max(x0,x1);
+      y1 = max(y0,y1);
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef _FRAMEBUFFER_H_
+#define _FRAMEBUFFER_H_
+
+#include <glm/glm.hpp>
+#include <limits>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * A heap-allocated image of floating point colors that the raytracer writes into.
+ * Pixels are stored row by row, with (0,0) at the bottom-left to match the
+ * way rays are generated from the camera.
+ *
+ * Next to its color, every pixel may record what its primary ray hit: the ray
+ * parameter of the hit (its depth) and the object (the index of the instance
+ * in the raytrace::RayScene), or infinity and -1 if it hit nothing.
+ *
+ * Different threads may write to different pixels at the same time.
+ */
+  class Framebuffer
+  {
+  protected:
+    int width,height;
+    vector<glm::vec3> pixels;
+    vector<float> depths;
+    vector<int> objects;
+
+  public:
+    Framebuffer()
+    {
+      width = height = 0;
+    }
+
+    Framebuffer(int width,int height)
+    {
+      this->width = this->height = 0;
+      resize(width,height);
+    }
+
+    /**
+     * Resize this framebuffer. All pixels are cleared to black
+     * \param width the new width in pixels
+     * \param height the new height in pixels
+     */
+    void resize(int width,int height)
+    {
+      if (width<0)
+        width = 0;
+      if (height<0)
+        height = 0;
+      this->width = width;
+      this->height = height;
+      pixels.assign((size_t)width*height,glm::vec3(0,0,0));
+      depths.assign(pixels.size(),numeric_limits<float>::infinity());
+      objects.assign(pixels.size(),-1);
+    }
+
+    /**
+     * Set every pixel to the given color, and forget what the pixels hit
+     */
+    void clear(const glm::vec3& color=glm::vec3(0,0,0))
+    {
+      pixels.assign(pixels.size(),color);
+      depths.assign(pixels.size(),numeric_limits<float>::infinity());
+      objects.assign(pixels.size(),-1);
+    }
+
+    int getWidth() const
+    {
+      return width;
+    }
+
+    int getHeight() const
+    {
+      return height;
+    }
+
+    void setColor(int x,int y,const glm::vec3& color)
+    {
+      pixels[(size_t)y*width+x] = color;
+    }
+
+    glm::vec3 getColor(int x,int y) const
+    {
+      return pixels[(size_t)y*width+x];
+    }
+
+    /**
+     * Record what the primary ray through a pixel hit
+     * \param x the column of the pixel
+     * \param y the row of the pixel
+     * \param depth the ray parameter of the hit, or infinity
+     * \param object the object hit, or -1
+     */
+    void setHit(int x,int y,float depth,int object)
+    {
+      depths[(size_t)y*width+x] = depth;
+      objects[(size_t)y*width+x] = object;
+    }
+
+    float getDepth(int x,int y) const
+    {
+      return depths[(size_t)y*width+x];
+    }
+
+    int getObject(int x,int y) const
+    {
+      return objects[(size_t)y*width+x];
+    }
+
+    /**
+     * Direct access to the pixel array, row by row
+     */
+    const glm::vec3 *getPixels() const
+    {
+      return pixels.data();
+    }
+  };
+}
+
+#endif
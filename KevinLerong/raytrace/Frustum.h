@@ -0,0 +1,97 @@
+#ifndef _FRUSTUM_H_
+#define _FRUSTUM_H_
+
+#include "AABB.h"
+#include "SIMD.h"
+#include <glm/glm.hpp>
+
+namespace raytrace
+{
+
+  /**
+ * The six planes bounding what a projection shows, for telling which boxes
+ * are out of view. The planes are extracted from the matrix taking points to
+ * clip coordinates, so they are in whatever coordinate system that matrix
+ * starts from (e.g. the world, for the projection times the view matrix).
+ *
+ * A box is tested against the planes a SIMD register at a time, one plane per
+ * lane: it is out of view if its corner furthest along the inward normal of
+ * some plane is still outside that plane. The test is conservative: a box may
+ * be kept although it is out of view (near the corners of the frustum), but is
+ * never dropped while any of it is in view.
+ */
+  class Frustum
+  {
+  public:
+    //the planes (a,b,c,d), with ax+by+cz+d>=0 on the inside: left, right,
+    //bottom, top, near and far
+    glm::vec4 planes[6];
+
+  protected:
+    static const int PLANE_GROUPS = (6+SIMD_WIDTH-1)/SIMD_WIDTH;
+    //the planes in structure-of-arrays form, the lanes past the sixth plane
+    //filled with a plane nothing is outside of
+    SimdVec3 normals[PLANE_GROUPS];
+    SimdVec3 absNormals[PLANE_GROUPS];
+    SimdFloat offsets[PLANE_GROUPS];
+
+  public:
+    /**
+     * The frustum of the given matrix
+     * \param clip the matrix taking points to clip coordinates, e.g.
+     * projection*view
+     */
+    explicit Frustum(const glm::mat4& clip)
+    {
+      //the rows of the matrix (GLM stores it by columns)
+      glm::vec4 rows[4];
+      for (int i=0;i<4;i++)
+        rows[i] = glm::vec4(clip[0][i],clip[1][i],clip[2][i],clip[3][i]);
+      for (int i=0;i<3;i++)
+        {
+          planes[2*i] = rows[3]+rows[i];
+          planes[2*i+1] = rows[3]-rows[i];
+        }
+
+      float lanes[4][PLANE_GROUPS*SIMD_WIDTH];
+      for (int p=0;p<PLANE_GROUPS*SIMD_WIDTH;p++)
+        {
+          glm::vec4 plane = (p<6)?planes[p]:glm::vec4(0,0,0,1);
+          for (int k=0;k<4;k++)
+            lanes[k][p] = plane[k];
+        }
+      for (int g=0;g<PLANE_GROUPS;g++)
+        {
+          normals[g] = SimdVec3(SimdFloat::load(&lanes[0][g*SIMD_WIDTH]),
+                                SimdFloat::load(&lanes[1][g*SIMD_WIDTH]),
+                                SimdFloat::load(&lanes[2][g*SIMD_WIDTH]));
+          absNormals[g] = SimdVec3(abs(normals[g].x),abs(normals[g].y),abs(normals[g].z));
+          offsets[g] = SimdFloat::load(&lanes[3][g*SIMD_WIDTH]);
+        }
+    }
+
+    /**
+     * Returns true if some of the given box may be in view, false if all of it
+     * is out of view. An empty box is never in view
+     */
+    bool intersects(const AABB& box) const
+    {
+      if (box.isEmpty())
+        return false;
+      SimdVec3 center(box.getCentroid());
+      SimdVec3 halfExtent(0.5f*box.getExtent());
+      for (int g=0;g<PLANE_GROUPS;g++)
+        {
+          //the signed distance of the center, and how far the box reaches
+          //towards the inside from it
+          SimdFloat distance = dot(normals[g],center) + offsets[g];
+          SimdFloat reach = dot(absNormals[g],halfExtent);
+          if (((distance+reach)<SimdFloat(0.0f)).any())
+            return false;
+        }
+      return true;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef _IMAGEWRITER_H_
+#define _IMAGEWRITER_H_
+
+#include "Framebuffer.h"
+#include <QImage>
+#include <QString>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * Writes a framebuffer to an image file. PPM and PNG files store 8 bits per
+ * channel, clamped to [0,1]. OpenEXR files store the unclamped floating point
+ * colors, uncompressed.
+ *
+ * The framebuffer has (0,0) at the bottom-left, while all three formats store
+ * the top row first, so rows are flipped while writing.
+ */
+  class ImageWriter
+  {
+  public:
+    /**
+     * Write the framebuffer in the format given by the extension of the
+     * filename: .ppm, .png or .exr
+     * \param filename the file to be written
+     * \param fb the image to be written
+     * \throws runtime_error if the format is unknown or the file cannot be
+     * written
+     */
+    static void write(const string& filename,const Framebuffer& fb) throw(runtime_error)
+    {
+      string ext = getExtension(filename);
+      if (ext=="ppm")
+        writePPM(filename,fb);
+      else if (ext=="png")
+        writePNG(filename,fb);
+      else if (ext=="exr")
+        writeEXR(filename,fb);
+      else
+        throw runtime_error("Unknown image format for "+filename+": use .ppm, .png or .exr");
+    }
+
+    /**
+     * Write a binary (P6) PPM file
+     */
+    static void writePPM(const string& filename,const Framebuffer& fb) throw(runtime_error)
+    {
+      FILE *file = fopen(filename.c_str(),"wb");
+      if (file==NULL)
+        throw runtime_error("Could not open "+filename+" for writing");
+
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+      fprintf(file,"P6\n%d %d\n255\n",w,h);
+      vector<unsigned char> row(3*(size_t)w);
+      bool ok = true;
+      for (int y=h-1;(y>=0) && ok;y--)
+        {
+          for (int x=0;x<w;x++)
+            {
+              glm::vec3 color = fb.getColor(x,y);
+              row[3*x] = toByte(color.r);
+              row[3*x+1] = toByte(color.g);
+              row[3*x+2] = toByte(color.b);
+            }
+          ok = fwrite(row.data(),1,row.size(),file)==row.size();
+        }
+      if ((fclose(file)!=0) || !ok)
+        throw runtime_error("Could not write "+filename);
+    }
+
+    /**
+     * Write a PNG file
+     */
+    static void writePNG(const string& filename,const Framebuffer& fb) throw(runtime_error)
+    {
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+      QImage image(w,h,QImage::Format_RGB32);
+      for (int y=0;y<h;y++)
+        {
+          QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(h-1-y));
+          for (int x=0;x<w;x++)
+            {
+              glm::vec3 color = fb.getColor(x,y);
+              line[x] = qRgb(toByte(color.r),toByte(color.g),toByte(color.b));
+            }
+        }
+      if (!image.save(QString::fromStdString(filename),"PNG"))
+        throw runtime_error("Could not write "+filename);
+    }
+
+    /**
+     * Write a scanline OpenEXR file with 32-bit float R, G and B channels and
+     * no compression
+     */
+    static void writeEXR(const string& filename,const Framebuffer& fb) throw(runtime_error)
+    {
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+      vector<unsigned char> header;
+
+      //magic number and version 2, single-part scanline file
+      putInt(header,20000630);
+      putInt(header,2);
+
+      //channels are stored in alphabetical order
+      vector<unsigned char> channels;
+      const char *names[] = {"B","G","R"};
+      for (int c=0;c<3;c++)
+        {
+          putString(channels,names[c]);
+          putInt(channels,2); //FLOAT
+          putInt(channels,0); //pLinear and reserved bytes
+          putInt(channels,1); //x sampling
+          putInt(channels,1); //y sampling
+        }
+      channels.push_back(0);
+      putAttribute(header,"channels","chlist",channels);
+
+      vector<unsigned char> value;
+      value.push_back(0); //NO_COMPRESSION
+      putAttribute(header,"compression","compression",value);
+
+      value.clear();
+      putInt(value,0);
+      putInt(value,0);
+      putInt(value,w-1);
+      putInt(value,h-1);
+      putAttribute(header,"dataWindow","box2i",value);
+      putAttribute(header,"displayWindow","box2i",value);
+
+      value.clear();
+      value.push_back(0); //INCREASING_Y
+      putAttribute(header,"lineOrder","lineOrder",value);
+
+      value.clear();
+      putFloat(value,1.0f);
+      putAttribute(header,"pixelAspectRatio","float",value);
+
+      value.clear();
+      putFloat(value,0.0f);
+      putFloat(value,0.0f);
+      putAttribute(header,"screenWindowCenter","v2f",value);
+
+      value.clear();
+      putFloat(value,1.0f);
+      putAttribute(header,"screenWindowWidth","float",value);
+      header.push_back(0);
+
+      //one uncompressed scanline per chunk, each preceded by its y coordinate
+      //and size
+      unsigned long long lineSize = 3*4*(unsigned long long)w;
+      unsigned long long offset = header.size()+8*(unsigned long long)h;
+      for (int y=0;y<h;y++)
+        {
+          putLong(header,offset);
+          offset += 8+lineSize;
+        }
+
+      FILE *file = fopen(filename.c_str(),"wb");
+      if (file==NULL)
+        throw runtime_error("Could not open "+filename+" for writing");
+      bool ok = fwrite(header.data(),1,header.size(),file)==header.size();
+
+      vector<unsigned char> line;
+      for (int y=0;(y<h) && ok;y++)
+        {
+          int row = h-1-y;
+          line.clear();
+          putInt(line,y);
+          putInt(line,(int)lineSize);
+          for (int c=2;c>=0;c--)
+            for (int x=0;x<w;x++)
+              putFloat(line,fb.getColor(x,row)[c]);
+          ok = fwrite(line.data(),1,line.size(),file)==line.size();
+        }
+      if ((fclose(file)!=0) || !ok)
+        throw runtime_error("Could not write "+filename);
+    }
+
+  private:
+    static string getExtension(const string& filename)
+    {
+      size_t dot = filename.find_last_of('.');
+      if (dot==string::npos)
+        return "";
+      string ext = filename.substr(dot+1);
+      transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+      return ext;
+    }
+
+    static unsigned char toByte(float c)
+    {
+      return (unsigned char)(255.0f*max(0.0f,min(1.0f,c))+0.5f);
+    }
+
+    //OpenEXR files are little-endian
+    static void putInt(vector<unsigned char>& out,int v)
+    {
+      unsigned int u = (unsigned int)v;
+      for (int i=0;i<4;i++)
+        out.push_back((unsigned char)((u>>(8*i)) & 0xff));
+    }
+
+    static void putLong(vector<unsigned char>& out,unsigned long long v)
+    {
+      for (int i=0;i<8;i++)
+        out.push_back((unsigned char)((v>>(8*i)) & 0xff));
+    }
+
+    static void putFloat(vector<unsigned char>& out,float v)
+    {
+      unsigned int u;
+      memcpy(&u,&v,sizeof(u));
+      putInt(out,(int)u);
+    }
+
+    static void putString(vector<unsigned char>& out,const char *s)
+    {
+      out.insert(out.end(),s,s+strlen(s)+1);
+    }
+
+    static void putAttribute(vector<unsigned char>& out,const char *name,const char *type,const vector<unsigned char>& value)
+    {
+      putString(out,name);
+      putString(out,type);
+      putInt(out,(int)value.size());
+      out.insert(out.end(),value.begin(),value.end());
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _INSTANCE_H_
+#define _INSTANCE_H_
+
+#include <glm/glm.hpp>
+#include "Material.h"
+#include "Primitive.h"
+#include <string>
+using namespace std;
+
+namespace sgraph
+{
+  class INode;
+}
+
+namespace raytrace
+{
+  class TriangleMesh;
+  class MipTexture;
+
+  /**
+ * A leaf of the scene graph flattened out for raytracing: the mesh it draws,
+ * how it looks, and the complete transformation from its object coordinate
+ * system to the view coordinate system.
+ *
+ * The inverse and normal matrices are computed once when the instance is
+ * compiled, so that tracing a ray never has to invert a matrix.
+ */
+  class Instance
+  {
+  public:
+    /**
+     * The leaf that this instance was created from
+     */
+    sgraph::INode *node;
+    string meshName;
+    /**
+     * What kind of shape the mesh is, resolved when the leaf was loaded
+     */
+    PrimitiveKind kind;
+    /**
+     * The triangles of the mesh, shared by all instances of that mesh
+     */
+    const TriangleMesh *mesh;
+    string textureName;
+    /**
+     * The image of textureName, or NULL if the instance is not textured
+     */
+    const MipTexture *texture;
+    util::Material material;
+    /**
+     * Object to view coordinates. For a primitive other than a mesh,
+     * raytrace::RayScene makes this the transformation of the canonical shape
+     * fitted to the mesh
+     */
+    glm::mat4 transform;
+    /**
+     * View to object coordinates, used to bring rays into the mesh
+     */
+    glm::mat4 inverseTransform;
+    /**
+     * Transforms object-space normals to view coordinates
+     */
+    glm::mat3 normalTransform;
+
+    Instance()
+    {
+      node = NULL;
+      kind = PRIMITIVE_MESH;
+      mesh = NULL;
+      texture = NULL;
+      setTransform(glm::mat4(1.0));
+    }
+
+    /**
+     * Set the transformation of this instance, and update the matrices derived from it
+     */
+    void setTransform(const glm::mat4& m)
+    {
+      transform = m;
+      inverseTransform = glm::inverse(m);
+      normalTransform = glm::transpose(glm::mat3(inverseTransform));
+    }
+  };
+}
+
+#endif
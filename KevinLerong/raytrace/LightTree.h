@@ -0,0 +1,332 @@
+#ifndef _LIGHTTREE_H_
+#define _LIGHTTREE_H_
+
+#include "AABB.h"
+#include "SceneLight.h"
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+   * One node of a raytrace::LightTree, stored like a raytrace::BVHNode. A
+   * leaf holds exactly one light, so count is 0 or 1.
+   *
+   * Besides the box around its lights, a node bounds where they can shine:
+   * every spot direction is within directionAngle of axis, and every spot
+   * cone is at most cutoffAngle wide around its direction. A node with a
+   * light that shines everywhere has directionAngle pi. For the tests made
+   * while shading, the box is also kept as a sphere, and the sum of the two
+   * angles (with a little slack, so that rounding never culls a light that
+   * reaches) as its cosine and sine.
+   */
+  class LightTreeNode
+  {
+  public:
+    AABB bounds;
+    glm::vec3 axis;
+    float directionAngle,cutoffAngle;
+    glm::vec3 center;
+    float radius;
+    float cosReach,sinReach;
+    bool everywhere;
+    //the brightness of the ambient, and of the diffuse and specular parts
+    float ambient,power;
+    int leftFirst;
+    int count;
+
+    LightTreeNode()
+    {
+      directionAngle = cutoffAngle = 0;
+      radius = 0;
+      cosReach = 1;
+      sinReach = 0;
+      everywhere = false;
+      ambient = power = 0;
+      leftFirst = 0;
+      count = 0;
+    }
+
+    bool isLeaf() const
+    {
+      return count>0;
+    }
+  };
+
+  /**
+ * A hierarchy over the point lights of a scene, for shading points without
+ * casting a shadow ray towards every light.
+ *
+ * sample() picks one light at random, walking down the tree and choosing each
+ * child with a probability proportional to a bound on how much light it can
+ * give the point. Subtrees of spotlights whose cones cannot contain the point
+ * are never picked. Shading with a few sampled lights, each weighed by one
+ * over its probability, gives the right image on average with a shadow ray
+ * count that does not grow with the number of lights, at the price of noise.
+ * Picking a light takes time logarithmic in the number of lights.
+ *
+ * Lights do not fade with distance in this renderer (as in the shader), so
+ * the bound is made of the brightness of the lights, whether their cones can
+ * reach the point and how squarely they can face its surface.
+ *
+ * Directional lights are everywhere at once, so they are kept apart and are
+ * always lit exactly.
+ */
+  class LightTree
+  {
+  protected:
+    vector<LightTreeNode> nodes;
+    vector<int> indices;
+    vector<int> directional;
+
+  public:
+    LightTree()
+    {
+    }
+
+    /**
+     * Build the hierarchy over the given lights
+     * \param lights the lights of the scene. Only their indices are kept, so
+     * they must outlive this tree unchanged
+     */
+    void build(const vector<SceneLight>& lights)
+    {
+      nodes.clear();
+      indices.clear();
+      directional.clear();
+      for (unsigned int i=0;i<lights.size();i++)
+        {
+          if (lights[i].isDirectional())
+            directional.push_back(i);
+          else
+            indices.push_back(i);
+        }
+      if (indices.empty())
+        return;
+
+      nodes.reserve(2*indices.size());
+      nodes.push_back(LightTreeNode());
+      split(lights,0,0,indices.size());
+    }
+
+    /**
+     * The indices of the directional lights
+     */
+    const vector<int>& getDirectionalLights() const
+    {
+      return directional;
+    }
+
+    /**
+     * The number of lights in the hierarchy, i.e. all but the directional ones
+     */
+    int getLightCount() const
+    {
+      return indices.size();
+    }
+
+    /**
+     * Pick a light for shading a point
+     * \param point the point in the view coordinate system
+     * \param normal the normal of the surface at the point
+     * \param u a random number in [0,1)
+     * \param probability set to the probability that the light returned
+     * was picked
+     * \return the index of the light, or -1 if no light can give the point
+     * anything
+     */
+    int sample(const glm::vec3& point,const glm::vec3& normal,float u,float& probability) const
+    {
+      probability = 0;
+      if (nodes.empty() || (getImportance(nodes[0],point,normal)<=0))
+        return -1;
+      probability = 1;
+      int n = 0;
+      while (!nodes[n].isLeaf())
+        {
+          int left = nodes[n].leftFirst;
+          float l = getImportance(nodes[left],point,normal);
+          float r = getImportance(nodes[left+1],point,normal);
+          if (l+r<=0)
+            return -1;
+          float p = l/(l+r);
+          if (u<p)
+            {
+              u = u/p;
+              probability *= p;
+              n = left;
+            }
+          else
+            {
+              u = (u-p)/(1.0f-p);
+              probability *= 1.0f-p;
+              n = left+1;
+            }
+          u = min(u,0.99999994f);
+        }
+      return indices[nodes[n].leftFirst];
+    }
+
+  protected:
+    /**
+     * Fill in the node over indices[first .. first+count-1], splitting it at
+     * the median of the longest side of its box until one light is left
+     */
+    void split(const vector<SceneLight>& lights,int node,int first,int count)
+    {
+      if (count==1)
+        {
+          LightTreeNode& leaf = nodes[node];
+          const SceneLight& light = lights[indices[first]];
+          glm::vec3 p = glm::vec3(light.position);
+          leaf.bounds = AABB(p,p);
+          leaf.leftFirst = first;
+          leaf.count = 1;
+          leaf.ambient = getBrightness(light.ambient);
+          leaf.power = getBrightness(light.diffuse+light.specular);
+          if (light.spot)
+            {
+              leaf.axis = light.spotDirection;
+              leaf.directionAngle = 0;
+              leaf.cutoffAngle = acos(max(-1.0f,min(1.0f,light.cosSpotCutoff)));
+            }
+          else
+            {
+              leaf.axis = glm::vec3(0,0,-1);
+              leaf.directionAngle = glm::pi<float>();
+              leaf.cutoffAngle = 0;
+            }
+          finish(leaf);
+          return;
+        }
+
+      AABB centers;
+      for (int i=first;i<first+count;i++)
+        centers.expand(glm::vec3(lights[indices[i]].position));
+      glm::vec3 size = centers.max-centers.min;
+      int axis = ((size.x>=size.y) && (size.x>=size.z))?0:((size.y>=size.z)?1:2);
+      vector<int>::iterator begin = indices.begin()+first;
+      nth_element(begin,begin+count/2,begin+count,
+                  [&lights,axis](int a,int b)
+                  {
+                    return lights[a].position[axis]<lights[b].position[axis];
+                  });
+
+      int left = nodes.size();
+      nodes.push_back(LightTreeNode());
+      nodes.push_back(LightTreeNode());
+      nodes[node].leftFirst = left;
+      nodes[node].count = 0;
+      split(lights,left,first,count/2);
+      split(lights,left+1,first+count/2,count-count/2);
+      merge(nodes[node],nodes[left],nodes[left+1]);
+      finish(nodes[node]);
+    }
+
+    /**
+     * Work out what the tests made while shading need from a built node
+     */
+    static void finish(LightTreeNode& node)
+    {
+      node.center = node.bounds.getCentroid();
+      node.radius = 0.5f*glm::length(node.bounds.max-node.bounds.min);
+      float reach = node.directionAngle+node.cutoffAngle+1e-4f;
+      node.everywhere = reach>=glm::pi<float>();
+      node.cosReach = cos(reach);
+      node.sinReach = sin(reach);
+    }
+
+    /**
+     * Bound the lights of two children in their parent
+     */
+    static void merge(LightTreeNode& parent,const LightTreeNode& a,const LightTreeNode& b)
+    {
+      parent.bounds = a.bounds;
+      parent.bounds.expand(b.bounds);
+      parent.ambient = a.ambient+b.ambient;
+      parent.power = a.power+b.power;
+      parent.cutoffAngle = max(a.cutoffAngle,b.cutoffAngle);
+
+      //the smallest cone around both cones of directions
+      float pi = glm::pi<float>();
+      const LightTreeNode *wide = &a,*narrow = &b;
+      if (b.directionAngle>a.directionAngle)
+        swap(wide,narrow);
+      float between = acos(max(-1.0f,min(1.0f,glm::dot(wide->axis,narrow->axis))));
+      if (min(between+narrow->directionAngle,pi)<=wide->directionAngle)
+        {
+          parent.axis = wide->axis;
+          parent.directionAngle = wide->directionAngle;
+          return;
+        }
+      float angle = 0.5f*(wide->directionAngle+between+narrow->directionAngle);
+      glm::vec3 ortho = narrow->axis-glm::dot(narrow->axis,wide->axis)*wide->axis;
+      if ((angle>=pi) || (glm::length(ortho)<1e-6f))
+        {
+          parent.axis = wide->axis;
+          parent.directionAngle = pi;
+          return;
+        }
+      //turn the wide axis towards the narrow one
+      float turn = angle-wide->directionAngle;
+      parent.axis = glm::normalize(cos(turn)*wide->axis+sin(turn)*glm::normalize(ortho));
+      parent.directionAngle = angle;
+    }
+
+    /**
+     * Returns false if the point is surely outside the spot cone of every
+     * light of the node
+     */
+    static bool mayReach(const LightTreeNode& node,const glm::vec3& point)
+    {
+      if (node.everywhere)
+        return true;
+      glm::vec3 toPoint = point-node.center;
+      float distance = glm::length(toPoint);
+      if (distance<=node.radius)
+        return true;
+      //the point may be reached if the angle between the axis and the
+      //direction from the center to it is at most the reach plus the angle
+      //the sphere spans from the point, compared by their cosines
+      float sinSpread = node.radius/distance;
+      float cosSpread = sqrt(1.0f-sinSpread*sinSpread);
+      if (node.sinReach*cosSpread+node.cosReach*sinSpread<0)
+        return true;
+      float cosBound = node.cosReach*cosSpread-node.sinReach*sinSpread;
+      return glm::dot(node.axis,toPoint)>=cosBound*distance;
+    }
+
+    /**
+     * A bound on how much light the lights of a node can give a point
+     */
+    static float getImportance(const LightTreeNode& node,const glm::vec3& point,const glm::vec3& normal)
+    {
+      if (!mayReach(node,point))
+        return 0;
+      glm::vec3 toLights = node.center-point;
+      float distance = glm::length(toLights);
+      if (distance<=node.radius)
+        return node.ambient+node.power;
+      //the largest cosine between the normal and a direction to the sphere
+      float cosAngle = max(-1.0f,min(1.0f,glm::dot(normal,toLights)/distance));
+      float sinSpread = node.radius/distance;
+      float cosSpread = sqrt(1.0f-sinSpread*sinSpread);
+      float facing = 1.0f;
+      if (cosAngle<cosSpread)
+        facing = max(0.0f,cosAngle*cosSpread+sqrt(1.0f-cosAngle*cosAngle)*sinSpread);
+      return node.ambient+node.power*facing;
+    }
+
+    static float getBrightness(const glm::vec3& color)
+    {
+      return 0.2126f*color.r+0.7152f*color.g+0.0722f*color.b;
+    }
+  };
+}
+
+#endif
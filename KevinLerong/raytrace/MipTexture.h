@@ -0,0 +1,271 @@
+#ifndef _MIPTEXTURE_H_
+#define _MIPTEXTURE_H_
+
+#include "SIMD.h"
+#include <QImage>
+#include <QString>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * A texture image prepared for sampling by the raytracer.
+ *
+ * The image is converted once into 8-bit RGBA texels and a chain of mipmaps,
+ * each half the size of the previous one. Every level is stored in tiles of
+ * 8x8 texels (256 bytes, four cache lines), with the texels of a tile in
+ * Morton (Z) order. The four texels of a bilinear lookup thus nearly always
+ * lie in the same few cache lines, whichever direction the rays walk across
+ * the texture.
+ *
+ * Lookups wrap around (like GL_REPEAT), and use the same orientation as the
+ * OpenGL renderer: (0,0) is the bottom-left of the image. A texture is never
+ * modified after it is created, so any number of threads may sample it at once.
+ */
+  class MipTexture
+  {
+  protected:
+    static const int TILE_BITS = 3;
+    static const int TILE_SIZE = 1<<TILE_BITS;
+
+    class Level
+    {
+    public:
+      int width,height;
+      int tilesPerRow;
+      vector<unsigned int> texels;
+
+      void resize(int width,int height)
+      {
+        this->width = width;
+        this->height = height;
+        tilesPerRow = (width+TILE_SIZE-1)>>TILE_BITS;
+        int tileRows = (height+TILE_SIZE-1)>>TILE_BITS;
+        texels.assign((size_t)tilesPerRow*tileRows*TILE_SIZE*TILE_SIZE,0);
+      }
+
+      unsigned int& at(int x,int y)
+      {
+        return texels[index(x,y)];
+      }
+
+      unsigned int at(int x,int y) const
+      {
+        return texels[index(x,y)];
+      }
+
+      size_t index(int x,int y) const
+      {
+        size_t tile = (size_t)(y>>TILE_BITS)*tilesPerRow + (x>>TILE_BITS);
+        return (tile<<(2*TILE_BITS)) + morton(x & (TILE_SIZE-1),y & (TILE_SIZE-1));
+      }
+
+      //interleave the bits of x and y within a tile: y2 x2 y1 x1 y0 x0
+      static unsigned int morton(unsigned int x,unsigned int y)
+      {
+        return (x & 1) | ((x & 2)<<1) | ((x & 4)<<2) |
+            ((y & 1)<<1) | ((y & 2)<<2) | ((y & 4)<<3);
+      }
+    };
+
+    vector<Level> levels;
+
+  public:
+    MipTexture()
+    {
+    }
+
+    /**
+     * Load an image file and build its mipmaps
+     * \param path the path to the image
+     * \throws runtime_error if the image cannot be read
+     */
+    explicit MipTexture(const string& path) throw(runtime_error)
+    {
+      QImage image(QString::fromStdString(path));
+      if (image.isNull())
+        throw runtime_error("Texture "+path+" cannot be read!");
+      init(image);
+    }
+
+    /**
+     * Convert an image and build its mipmaps
+     */
+    void init(const QImage& source)
+    {
+      QImage image = source.convertToFormat(QImage::Format_ARGB32);
+      int w = image.width();
+      int h = image.height();
+      levels.clear();
+      levels.push_back(Level());
+      levels[0].resize(w,h);
+
+      //QImage rows go top to bottom, texture rows bottom to top
+      for (int y=0;y<h;y++)
+        {
+          const QRgb *line = reinterpret_cast<const QRgb *>(image.constScanLine(h-1-y));
+          for (int x=0;x<w;x++)
+            {
+              QRgb c = line[x];
+              levels[0].at(x,y) = pack(qRed(c),qGreen(c),qBlue(c),qAlpha(c));
+            }
+        }
+
+      //each level averages 2x2 texels of the one before it
+      while ((w>1) || (h>1))
+        {
+          const Level& fine = levels.back();
+          Level coarse;
+          coarse.resize(max(w/2,1),max(h/2,1));
+          for (int y=0;y<coarse.height;y++)
+            {
+              for (int x=0;x<coarse.width;x++)
+                {
+                  int x0 = min(2*x,w-1),x1 = min(2*x+1,w-1);
+                  int y0 = min(2*y,h-1),y1 = min(2*y+1,h-1);
+                  unsigned int sum[4] = {0,0,0,0};
+                  unsigned int texels[4] = {fine.at(x0,y0),fine.at(x1,y0),fine.at(x0,y1),fine.at(x1,y1)};
+                  for (int t=0;t<4;t++)
+                    for (int c=0;c<4;c++)
+                      sum[c] += (texels[t]>>(8*c)) & 0xff;
+                  coarse.at(x,y) = pack((sum[0]+2)/4,(sum[1]+2)/4,(sum[2]+2)/4,(sum[3]+2)/4);
+                }
+            }
+          w = coarse.width;
+          h = coarse.height;
+          levels.push_back(coarse);
+        }
+    }
+
+    bool isEmpty() const
+    {
+      return levels.empty();
+    }
+
+    int getWidth() const
+    {
+      return levels.empty()?0:levels[0].width;
+    }
+
+    int getHeight() const
+    {
+      return levels.empty()?0:levels[0].height;
+    }
+
+    int getLevelCount() const
+    {
+      return levels.size();
+    }
+
+    /**
+     * Sample the texture with trilinear filtering. The mipmap level is chosen
+     * so that one texel covers about the area the lookup stands for, given by
+     * how far the texture coordinates move from one pixel to the next
+     * \param uv the texture coordinates
+     * \param duvdx the change in uv from this pixel to the next one across
+     * \param duvdy the change in uv from this pixel to the next one up
+     * \return the color, with each channel in [0,1]
+     */
+    glm::vec4 sample(const glm::vec2& uv,const glm::vec2& duvdx,const glm::vec2& duvdy) const
+    {
+      if (levels.empty())
+        return glm::vec4(1,1,1,1);
+
+      glm::vec2 size((float)levels[0].width,(float)levels[0].height);
+      float footprint = max(glm::length(duvdx*size),glm::length(duvdy*size));
+      float lod = (footprint>1.0f)?log2(footprint):0.0f;
+      lod = min(lod,(float)(levels.size()-1));
+
+      int fine = (int)lod;
+      float blend = lod-fine;
+      if ((blend<=0.0f) || (fine+1>=(int)levels.size()))
+        return bilinear(levels[fine],uv);
+      return glm::mix(bilinear(levels[fine],uv),bilinear(levels[fine+1],uv),blend);
+    }
+
+    /**
+     * Sample the full-resolution image with bilinear filtering
+     */
+    glm::vec4 sample(const glm::vec2& uv) const
+    {
+      if (levels.empty())
+        return glm::vec4(1,1,1,1);
+      return bilinear(levels[0],uv);
+    }
+
+  protected:
+    static unsigned int pack(unsigned int r,unsigned int g,unsigned int b,unsigned int a)
+    {
+      return r | (g<<8) | (b<<16) | (a<<24);
+    }
+
+    static int wrap(int i,int n)
+    {
+      i %= n;
+      return (i<0)?i+n:i;
+    }
+
+    /**
+     * Blend the four texels around a point, weighted by how close they are
+     */
+    static glm::vec4 bilinear(const Level& level,const glm::vec2& uv)
+    {
+      float x = uv.x*level.width-0.5f;
+      float y = uv.y*level.height-0.5f;
+      float fx = floor(x);
+      float fy = floor(y);
+      float tx = x-fx;
+      float ty = y-fy;
+      int x0 = wrap((int)fx,level.width);
+      int y0 = wrap((int)fy,level.height);
+      int x1 = (x0+1<level.width)?x0+1:0;
+      int y1 = (y0+1<level.height)?y0+1:0;
+
+      unsigned int t00 = level.at(x0,y0);
+      unsigned int t10 = level.at(x1,y0);
+      unsigned int t01 = level.at(x0,y1);
+      unsigned int t11 = level.at(x1,y1);
+      float w00 = (1-tx)*(1-ty);
+      float w10 = tx*(1-ty);
+      float w01 = (1-tx)*ty;
+      float w11 = tx*ty;
+
+#if defined(RAYTRACE_SIMD_AVX) || defined(RAYTRACE_SIMD_SSE)
+      //widen all four channels of a texel at once, and blend them together
+      __m128 sum = _mm_mul_ps(unpack(t00),_mm_set1_ps(w00*(1.0f/255.0f)));
+      sum = _mm_add_ps(sum,_mm_mul_ps(unpack(t10),_mm_set1_ps(w10*(1.0f/255.0f))));
+      sum = _mm_add_ps(sum,_mm_mul_ps(unpack(t01),_mm_set1_ps(w01*(1.0f/255.0f))));
+      sum = _mm_add_ps(sum,_mm_mul_ps(unpack(t11),_mm_set1_ps(w11*(1.0f/255.0f))));
+      float result[4];
+      _mm_storeu_ps(result,sum);
+      return glm::vec4(result[0],result[1],result[2],result[3]);
+#else
+      return (w00*unpack(t00)+w10*unpack(t10)+w01*unpack(t01)+w11*unpack(t11))*(1.0f/255.0f);
+#endif
+    }
+
+#if defined(RAYTRACE_SIMD_AVX) || defined(RAYTRACE_SIMD_SSE)
+    static __m128 unpack(unsigned int texel)
+    {
+      __m128i zero = _mm_setzero_si128();
+      __m128i bytes = _mm_cvtsi32_si128((int)texel);
+      __m128i words = _mm_unpacklo_epi8(bytes,zero);
+      return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words,zero));
+    }
+#else
+    static glm::vec4 unpack(unsigned int texel)
+    {
+      return glm::vec4(texel & 0xff,(texel>>8) & 0xff,(texel>>16) & 0xff,texel>>24);
+    }
+#endif
+  };
+}
+
+#endif
@@ -0,0 +1,634 @@
+#ifndef _PATHTRACER_H_
+#define _PATHTRACER_H_
+
+#include "Camera.h"
+#include "Framebuffer.h"
+#include "Instance.h"
+#include "RayDifferential.h"
+#include "RayScene.h"
+#include "SceneLight.h"
+#include "ThreadPool.h"
+#include "TileDependencies.h"
+#include "TileRenderer.h"
+#include "TraceCounters.h"
+#include "TracePath.h"
+#include "sgraph/Scenegraph.h"
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <stack>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * The running sums of the samples of every pixel of an image, kept from one
+ * render to the next so that more samples can be added to it later. Besides
+ * the sum of the colors, the sums of the brightness of the samples and of its
+ * square are kept, from which the variance of every pixel is estimated.
+ *
+ * Different threads may add samples to different pixels at the same time.
+ */
+  class AccumulationBuffer
+  {
+  protected:
+    int width,height;
+    vector<glm::vec3> sums;
+    vector<double> brightness,squares;
+    vector<int> counts;
+
+  public:
+    AccumulationBuffer()
+    {
+      width = height = 0;
+    }
+
+    /**
+     * Resize the buffer, dropping every sample
+     */
+    void resize(int width,int height)
+    {
+      this->width = max(width,0);
+      this->height = max(height,0);
+      clear();
+    }
+
+    /**
+     * Drop every sample
+     */
+    void clear()
+    {
+      size_t n = (size_t)width*height;
+      sums.assign(n,glm::vec3(0,0,0));
+      brightness.assign(n,0.0);
+      squares.assign(n,0.0);
+      counts.assign(n,0);
+    }
+
+    int getWidth() const
+    {
+      return width;
+    }
+
+    int getHeight() const
+    {
+      return height;
+    }
+
+    void add(int x,int y,const glm::vec3& color)
+    {
+      size_t i = (size_t)y*width+x;
+      double b = 0.2126*color.r+0.7152*color.g+0.0722*color.b;
+      sums[i] += color;
+      brightness[i] += b;
+      squares[i] += b*b;
+      counts[i]++;
+    }
+
+    /**
+     * The number of samples of pixel (x,y)
+     */
+    int getSamples(int x,int y) const
+    {
+      return counts[(size_t)y*width+x];
+    }
+
+    /**
+     * The mean of the samples of pixel (x,y), or black if it has none
+     */
+    glm::vec3 getColor(int x,int y) const
+    {
+      size_t i = (size_t)y*width+x;
+      if (counts[i]==0)
+        return glm::vec3(0,0,0);
+      return sums[i]/(float)counts[i];
+    }
+
+    /**
+     * An estimate of the variance of the brightness of pixel (x,y), i.e. of
+     * the square of its expected error, from the spread of its samples. It is
+     * infinity until the pixel has at least two samples
+     */
+    double getVariance(int x,int y) const
+    {
+      size_t i = (size_t)y*width+x;
+      int n = counts[i];
+      if (n<2)
+        return numeric_limits<double>::infinity();
+      double mean = brightness[i]/n;
+      double spread = max(0.0,(squares[i]-n*mean*mean)/(n-1));
+      return spread/n;
+    }
+  };
+
+  /**
+   * Statistics about one call to raytrace::PathTracer::render
+   */
+  class PathTraceStats
+  {
+  public:
+    PathTraceStats()
+    {
+      samples = 0;
+      rays = 0;
+      seconds = 0;
+      passes = 0;
+      cancelled = false;
+      samplesPerPixel = 0;
+      noise = 0;
+      convergedPixels = 0;
+    }
+
+    //the samples taken and rays traced by this render alone
+    long long samples;
+    long long rays;
+    double seconds;
+    //the number of times the unfinished pixels were each given a sample
+    int passes;
+    bool cancelled;
+    //the mean number of samples per pixel, the root mean square of the
+    //estimated error of the pixels, and the pixels whose error is below the
+    //target, all over the whole accumulated image
+    double samplesPerPixel;
+    double noise;
+    int convergedPixels;
+
+    double getSamplesPerSecond() const
+    {
+      if (seconds<=0)
+        return 0;
+      return samples/seconds;
+    }
+  };
+
+  /**
+ * Renders a scene graph by path tracing: every sample of a pixel follows one
+ * path of rays through the scene, choosing one way to bounce at random at
+ * every hit, and the samples of a pixel are averaged. Unlike the raytracer,
+ * this gathers the light that bounces off diffuse surfaces and through
+ * transparent ones onto others, at the price of noise that fades as the
+ * samples add up.
+ *
+ * At every point a path hits, it is lit directly by the lights of the scene
+ * (with shadow rays, and the light hierarchy if the trace settings ask for
+ * light samples) and by the emission of its material, and the path then goes
+ * on in one of the ways the material allows, picked in proportion to its
+ * absorption (a diffuse bounce, tinted by the diffuse color), reflection and
+ * transparency. If these add up to less than one, the path may stop there
+ * instead, which keeps it unbiased. The ambient terms of lights and
+ * materials stand in for bounced light in the raytracer and the shader, so
+ * they are left out here. Paths are at most TraceSettings::maxDepth bounces
+ * long.
+ *
+ * Samples go into an raytrace::AccumulationBuffer, one pass over the image at
+ * a time, on the same tiles and thread pool as the raytracer. A render stops
+ * once every pixel has either reached the target noise (the estimated error
+ * of its brightness) or the most samples allowed, or once it has taken as
+ * long as allowed. Rendering the same compiled scene with the same camera and
+ * view again adds to the samples already there, so a static scene keeps
+ * getting better from one frame to the next; any change starts over.
+ */
+  class PathTracer
+  {
+  public:
+    /**
+     * A pixel is finished once the estimated error of its brightness is
+     * below this
+     */
+    float targetNoise;
+    /**
+     * A pixel is never finished before it has this many samples, since the
+     * error of fewer samples cannot be estimated well
+     */
+    int minSamples;
+    /**
+     * A pixel is finished once it has this many samples
+     */
+    int maxSamples;
+    /**
+     * A render stops after this many seconds, or runs until every pixel is
+     * finished if this is 0
+     */
+    double maxSeconds;
+
+  protected:
+    util::ThreadPool& pool;
+    int tileSize;
+    const atomic<bool> *cancelFlag;
+    TileRenderer::TileListener tileListener;
+    AccumulationBuffer accumulation;
+    //what the accumulated samples were taken of
+    Camera camera;
+    glm::mat4 worldToView;
+    vector<Instance> instances;
+    vector<SceneLight> lights;
+    TraceSettings settings;
+
+  public:
+    PathTracer(util::ThreadPool& pool)
+      :pool(pool),camera(0,0)
+    {
+      targetNoise = 0.005f;
+      minSamples = 16;
+      maxSamples = 1024;
+      maxSeconds = 0;
+      tileSize = 32;
+      cancelFlag = NULL;
+    }
+
+    void setTileSize(int size)
+    {
+      tileSize = size>0?size:1;
+    }
+
+    int getTileSize() const
+    {
+      return tileSize;
+    }
+
+    /**
+     * Set the flag that stops a render when it becomes true, as for
+     * TileRenderer::setCancelFlag. The samples taken so far are kept
+     */
+    void setCancelFlag(const atomic<bool> *flag)
+    {
+      cancelFlag = flag;
+    }
+
+    /**
+     * Set a function that is told about every tile as soon as its pixels have
+     * been written, after every pass
+     */
+    void setTileListener(const TileRenderer::TileListener& listener)
+    {
+      tileListener = listener;
+    }
+
+    /**
+     * Drop the accumulated samples, so that the next render starts over
+     */
+    void reset()
+    {
+      accumulation.resize(0,0);
+    }
+
+    const AccumulationBuffer& getAccumulation() const
+    {
+      return accumulation;
+    }
+
+    /**
+     * Path trace a scene graph whose ray scene has already been compiled into
+     * a framebuffer of the camera's size, adding to the samples of the last
+     * render if nothing has changed since. Nothing in the scene graph is
+     * modified, so this may run on another thread than the one that owns it
+     * \param scenegraph the compiled scene graph
+     * \param camera the camera generating the primary rays
+     * \param modelview the stack whose top is the world-to-view transformation
+     * \param fb receives the mean of the samples of every pixel
+     * \return the samples taken, the time taken and how noisy the image is
+     */
+    PathTraceStats render(sgraph::Scenegraph *scenegraph,const Camera& camera,
+                          stack<glm::mat4>& modelview,Framebuffer& fb)
+    {
+      const RayScene& scene = scenegraph->getRayScene();
+      const TraceSettings& traceSettings = scenegraph->getTraceSettings();
+      int w = camera.getWidth();
+      int h = camera.getHeight();
+      if (!isSameScene(scene,camera,modelview.top(),traceSettings))
+        {
+          accumulation.resize(w,h);
+          remember(scene,camera,modelview.top(),traceSettings);
+        }
+      if ((fb.getWidth()!=w) || (fb.getHeight()!=h))
+        fb.resize(w,h);
+      //start from the samples there are, which may be none
+      for (int y=0;y<h;y++)
+        for (int x=0;x<w;x++)
+          fb.setColor(x,y,accumulation.getColor(x,y));
+      if (tileListener)
+        tileListener(0,0,w,h);
+
+      PathTraceStats stats;
+      //the rays of this render are what the counters of the threads gained
+      long long raysBefore = getPathRays();
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      vector<char> unfinished;
+      while (findUnfinishedPixels(unfinished))
+        {
+          TileRenderer tiles(pool,tileSize);
+          tiles.setCancelFlag(cancelFlag);
+          tiles.setTileListener(tileListener);
+          tiles.setPixelMask(&unfinished);
+          RenderStats pass = tiles.render(fb,[this,&scene,&camera,w](int x,int y)
+          {
+            //every sample of every pixel has its own random numbers
+            unsigned int seed = mix((unsigned int)(y*w+x)) ^ mix(accumulation.getSamples(x,y)+1);
+            TracePath path(settings,seed);
+            float u = path.random();
+            float v = path.random();
+            accumulation.add(x,y,trace(scene,camera.getRay(x+u-0.5f,y+v-0.5f),path));
+            path.countInto(TraceCounters::local());
+            return accumulation.getColor(x,y);
+          });
+          stats.samples += pass.rays;
+          stats.passes++;
+          if (pass.cancelled)
+            {
+              stats.cancelled = true;
+              break;
+            }
+          chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+          if ((maxSeconds>0) && (elapsed.count()>=maxSeconds))
+            break;
+        }
+
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      stats.seconds = elapsed.count();
+      stats.rays = getPathRays() - raysBefore;
+      measureNoise(stats);
+      return stats;
+    }
+
+  protected:
+    /**
+     * The primary and secondary rays counted by all threads so far. Only to
+     * be called while no thread is tracing rays
+     */
+    static long long getPathRays()
+    {
+      TraceCounters total = TraceStatistics::getTotal();
+      return total.rays[RAY_PRIMARY] + total.rays[RAY_SECONDARY];
+    }
+
+    /**
+     * Returns true if the accumulated samples were taken of the same scene,
+     * seen the same way, and so can be added to
+     */
+    bool isSameScene(const RayScene& scene,const Camera& camera,
+                     const glm::mat4& worldToView,const TraceSettings& traceSettings) const
+    {
+      const vector<Instance>& now = scene.getInstances();
+      if ((accumulation.getWidth()!=camera.getWidth()) ||
+          (accumulation.getHeight()!=camera.getHeight()) ||
+          !(camera==this->camera) || (worldToView!=this->worldToView) ||
+          (traceSettings.maxDepth!=settings.maxDepth) ||
+          (traceSettings.lightSamples!=settings.lightSamples) ||
+          (now.size()!=instances.size()) ||
+          !TileDependencies::sameLights(scene.getLights(),lights))
+        return false;
+      for (unsigned int i=0;i<now.size();i++)
+        {
+          if ((now[i].node!=instances[i].node) || (now[i].mesh!=instances[i].mesh) ||
+              (now[i].kind!=instances[i].kind) || (now[i].texture!=instances[i].texture) ||
+              (now[i].transform!=instances[i].transform) ||
+              !TileDependencies::sameMaterial(now[i].material,instances[i].material))
+            return false;
+        }
+      return true;
+    }
+
+    void remember(const RayScene& scene,const Camera& camera,
+                  const glm::mat4& worldToView,const TraceSettings& traceSettings)
+    {
+      this->camera = camera;
+      this->worldToView = worldToView;
+      instances = scene.getInstances();
+      lights = scene.getLights();
+      settings = traceSettings;
+    }
+
+    /**
+     * Choose the pixels that need another sample
+     * \param unfinished receives one flag per pixel
+     * \return false if every pixel is finished
+     */
+    bool findUnfinishedPixels(vector<char>& unfinished) const
+    {
+      int w = accumulation.getWidth();
+      int h = accumulation.getHeight();
+      double target = (double)targetNoise*targetNoise;
+      unfinished.assign((size_t)w*h,0);
+      bool any = false;
+      for (int y=0;y<h;y++)
+        for (int x=0;x<w;x++)
+          {
+            int n = accumulation.getSamples(x,y);
+            if ((n<minSamples) ||
+                ((n<maxSamples) && (accumulation.getVariance(x,y)>target)))
+              {
+                unfinished[(size_t)y*w+x] = 1;
+                any = true;
+              }
+          }
+      return any;
+    }
+
+    /**
+     * Work out how noisy the accumulated image is
+     */
+    void measureNoise(PathTraceStats& stats) const
+    {
+      int w = accumulation.getWidth();
+      int h = accumulation.getHeight();
+      double target = (double)targetNoise*targetNoise;
+      double samples = 0,variance = 0;
+      int measured = 0;
+      for (int y=0;y<h;y++)
+        for (int x=0;x<w;x++)
+          {
+            samples += accumulation.getSamples(x,y);
+            double v = accumulation.getVariance(x,y);
+            if (v<=target)
+              stats.convergedPixels++;
+            if (v<numeric_limits<double>::infinity())
+              {
+                variance += v;
+                measured++;
+              }
+          }
+      if (w*h>0)
+        stats.samplesPerPixel = samples/((double)w*h);
+      stats.noise = (measured>0)?sqrt(variance/measured):numeric_limits<double>::infinity();
+    }
+
+    /**
+     * Follow one path from the camera
+     * \param scene the compiled scene
+     * \param ray the primary ray, in the view coordinate system
+     * \param path supplies the random numbers, and counts the rays
+     * \return the light the path brings back
+     */
+    glm::vec3 trace(const RayScene& scene,_3DRay ray,TracePath& path) const
+    {
+      glm::vec3 color(0,0,0);
+      glm::vec3 throughput(1,1,1);
+      RayDifferential differential = RayDifferential::primary();
+      for (int depth=0;;depth++)
+        {
+          path.count(depth);
+          //the texture is filtered over the pixel for primary rays only
+          HitRecord hitRecord = scene.intersect(ray,(depth==0)?&differential:NULL);
+          if (!hitRecord.hit)
+            break;
+          path.hit(depth);
+          const util::Material& material = *hitRecord.material;
+          glm::vec3 position = glm::vec3(ray.pos+hitRecord.t*ray.dir);
+          float absorption = material.getAbsorption();
+          color += throughput*glm::vec3(material.getEmission());
+          if (absorption>0)
+            color += throughput*absorption*light(scene,ray,hitRecord,path);
+          if ((depth>=settings.maxDepth) || (depth>=TraceSettings::MAX_DEPTH))
+            break;
+
+          glm::vec3 dir = glm::normalize(glm::vec3(ray.dir));
+          glm::vec3 normal = hitRecord.normal;
+          //make the normal face the ray, remembering whether the ray leaves the object
+          float cosIn = glm::dot(dir,normal);
+          float eta = 1.0f/material.getRefractiveIndex();
+          if (cosIn>0)
+            {
+              normal = -normal;
+              eta = material.getRefractiveIndex();
+            }
+          else
+            cosIn = -cosIn;
+          float offset = 1e-4f*max(1.0f,glm::length(position));
+
+          glm::vec3 albedo = glm::vec3(material.getDiffuse())*hitRecord.textureColor;
+          float diffuse = absorption*max(albedo.r,max(albedo.g,albedo.b));
+          float reflection = material.getReflection();
+          float transparency = material.getTransparency();
+          float k = 1.0f-eta*eta*(1.0f-cosIn*cosIn);
+          if ((transparency>0) && (k<0))
+            {
+              //total internal reflection: the transmitted light is reflected too
+              reflection += transparency;
+              transparency = 0;
+            }
+
+          //pick how the path goes on, or whether it stops here
+          float total = max(diffuse+reflection+transparency,1.0f);
+          float u = path.random()*total;
+          if (u<diffuse)
+            {
+              throughput *= absorption*albedo*(total/diffuse);
+              ray = _3DRay(glm::vec4(position+offset*normal,1.0f),
+                           glm::vec4(sampleCosine(normal,path),0.0f));
+            }
+          else if (u<diffuse+reflection)
+            {
+              throughput *= total;
+              ray = _3DRay(glm::vec4(position+offset*normal,1.0f),
+                           glm::vec4(glm::reflect(dir,normal),0.0f));
+            }
+          else if (u<diffuse+reflection+transparency)
+            {
+              throughput *= total;
+              glm::vec3 refracted = eta*dir+(eta*cosIn-sqrt(k))*normal;
+              ray = _3DRay(glm::vec4(position-offset*normal,1.0f),
+                           glm::vec4(glm::normalize(refracted),0.0f));
+            }
+          else
+            break;
+        }
+      return color;
+    }
+
+    /**
+     * The diffuse and specular light the lights of the scene give a point,
+     * chosen as Scenegraph::shade chooses them, and multiplied by the texture
+     * color at the point
+     */
+    glm::vec3 light(const RayScene& scene,const _3DRay& ray,const HitRecord& hitRecord,
+                    TracePath& path) const
+    {
+      const vector<SceneLight>& sceneLights = scene.getLights();
+      const LightTree& lightTree = scene.getLightTree();
+      glm::vec3 position = glm::vec3(ray.pos+hitRecord.t*ray.dir);
+      glm::vec3 viewVec = glm::normalize(-glm::vec3(ray.dir));
+      glm::vec3 origin = position+1e-4f*max(1.0f,glm::length(position))*hitRecord.normal;
+      glm::vec3 color(0,0,0);
+
+      int samples = settings.lightSamples;
+      if ((samples<=0) || (samples>=lightTree.getLightCount()))
+        {
+          for (unsigned int i=0;i<sceneLights.size();i++)
+            color += light(scene,sceneLights[i],*hitRecord.material,position,origin,hitRecord.normal,viewVec,path);
+          return color*hitRecord.textureColor;
+        }
+      const vector<int>& directional = lightTree.getDirectionalLights();
+      for (unsigned int i=0;i<directional.size();i++)
+        color += light(scene,sceneLights[directional[i]],*hitRecord.material,position,origin,hitRecord.normal,viewVec,path);
+      for (int s=0;s<samples;s++)
+        {
+          float probability;
+          int i = lightTree.sample(position,hitRecord.normal,path.random(),probability);
+          if (i<0)
+            continue;
+          color += light(scene,sceneLights[i],*hitRecord.material,position,origin,hitRecord.normal,viewVec,path)/
+              (probability*samples);
+        }
+      return color*hitRecord.textureColor;
+    }
+
+    /**
+     * The diffuse and specular light one light gives a point, casting a
+     * shadow ray towards it
+     * \param path counts the shadow ray
+     */
+    glm::vec3 light(const RayScene& scene,const SceneLight& sceneLight,const util::Material& material,
+                    const glm::vec3& position,const glm::vec3& origin,const glm::vec3& normal,
+                    const glm::vec3& viewVec,TracePath& path) const
+    {
+      glm::vec3 ambient,lit;
+      if (!sceneLight.getColor(material,position,normal,viewVec,ambient,lit))
+        return glm::vec3(0,0,0);
+      glm::vec3 toLight;
+      float far;
+      sceneLight.getShadowRay(origin,toLight,far);
+      bool blocked = scene.occluded(origin,toLight,0.0f,far);
+      path.shadow(blocked);
+      if (blocked)
+        return glm::vec3(0,0,0);
+      return lit;
+    }
+
+    /**
+     * A random direction around a normal, more likely the more squarely it
+     * faces the normal (with a probability density proportional to the
+     * cosine), as a diffuse surface scatters light
+     */
+    static glm::vec3 sampleCosine(const glm::vec3& normal,TracePath& path)
+    {
+      float r = sqrt(path.random());
+      float phi = 2.0f*glm::pi<float>()*path.random();
+      glm::vec3 helper = (fabs(normal.x)>0.5f)?glm::vec3(0,1,0):glm::vec3(1,0,0);
+      glm::vec3 tangent = glm::normalize(glm::cross(helper,normal));
+      glm::vec3 bitangent = glm::cross(normal,tangent);
+      return r*cos(phi)*tangent+r*sin(phi)*bitangent+sqrt(max(0.0f,1.0f-r*r))*normal;
+    }
+
+    /**
+     * Scramble a number, so that nearby numbers give unrelated seeds
+     */
+    static unsigned int mix(unsigned int h)
+    {
+      h ^= h>>16;
+      h *= 0x85ebca6bu;
+      h ^= h>>13;
+      h *= 0xc2b2ae35u;
+      h ^= h>>16;
+      return h;
+    }
+  };
+}
+
+#endif
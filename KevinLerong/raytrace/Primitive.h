@@ -0,0 +1,414 @@
+#ifndef _PRIMITIVE_H_
+#define _PRIMITIVE_H_
+
+#include "SIMD.h"
+#include "RayPacket.h"
+#include <glm/glm.hpp>
+#include <cmath>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+   * The kinds of shapes a leaf can draw. The standard models are traced as the
+   * exact shapes they approximate, and any other mesh as its triangles.
+   */
+  enum PrimitiveKind
+  {
+    PRIMITIVE_MESH,
+    PRIMITIVE_SPHERE,
+    PRIMITIVE_BOX,
+    PRIMITIVE_CYLINDER,
+    PRIMITIVE_CONE
+  };
+
+  /**
+   * The kind of primitive a standard model is, from its exact name ("box",
+   * "sphere", "cylinder" or "cone"), or PRIMITIVE_MESH for any other name
+   */
+  inline PrimitiveKind getStandardKind(const string& name)
+  {
+    if (name=="box")
+      return PRIMITIVE_BOX;
+    if (name=="sphere")
+      return PRIMITIVE_SPHERE;
+    if (name=="cylinder")
+      return PRIMITIVE_CYLINDER;
+    if (name=="cone")
+      return PRIMITIVE_CONE;
+    return PRIMITIVE_MESH;
+  }
+
+  /**
+   * The kind of primitive an object instance is. It is a standard model if
+   * either its name or the file name of its model (e.g. "models/box.obj") is
+   * exactly that of one, and a mesh otherwise, so that an instance such as
+   * "mailbox" keeps its own triangles. This is meant to be called once, when
+   * the scene is loaded.
+   * \param instanceName the name of the object instance
+   * \param path the file of its model, or empty if not known
+   */
+  inline PrimitiveKind getPrimitiveKind(const string& instanceName,const string& path="")
+  {
+    PrimitiveKind kind = getStandardKind(instanceName);
+    if ((kind!=PRIMITIVE_MESH) || path.empty())
+      return kind;
+    size_t slash = path.find_last_of("/\\");
+    string file = (slash==string::npos)?path:path.substr(slash+1);
+    if ((file.length()>4) && (file.compare(file.length()-4,4,".obj")==0))
+      file = file.substr(0,file.length()-4);
+    return getStandardKind(file);
+  }
+
+  /*
+   * The mask type that comparing two values of type F produces, so that the
+   * kernels below can be written once for single rays and for packets
+   */
+  template <class F>
+  class SimdTraits
+  {
+  public:
+    typedef bool Mask;
+  };
+
+  template <>
+  class SimdTraits<SimdFloat>
+  {
+  public:
+    typedef SimdMask Mask;
+  };
+
+  inline float select(bool m,float a,float b)
+  {
+    return m?a:b;
+  }
+
+  /*
+   * Keep a candidate hit if it is valid and closer than the best one so far
+   */
+  template <class F>
+  inline void keepCloser(const F& t,const typename SimdTraits<F>::Mask& valid,
+                         F& best,typename SimdTraits<F>::Mask& hit)
+  {
+    typename SimdTraits<F>::Mask closer = valid & (t<best);
+    best = select(closer,t,best);
+    hit = hit | closer;
+  }
+
+  /**
+   * The intersection kernel of each kind of primitive, in the coordinate system
+   * of its canonical shape:
+   * <ul>
+   *     <li>sphere: the unit sphere around the origin</li>
+   *     <li>box: the cube from (-1,-1,-1) to (1,1,1)</li>
+   *     <li>cylinder: radius 1 around the y axis, from y=0 to y=1, with caps</li>
+   *     <li>cone: base of radius 1 at y=0, apex at (0,1,0), with a cap</li>
+   * </ul>
+   * Each kernel is a template over float (one ray, with glm::vec3) and
+   * raytrace::SimdFloat (a packet, with raytrace::SimdVec3). Like triangles,
+   * all shapes can be hit from inside as well as from outside.
+   * \return whether the ray hits the shape strictly between tMin and tMax.
+   * If so, t receives the closest hit.
+   */
+  template <PrimitiveKind kind>
+  class PrimitiveKernel;
+
+  template <>
+  class PrimitiveKernel<PRIMITIVE_SPHERE>
+  {
+  public:
+    template <class F,class V>
+    static typename SimdTraits<F>::Mask intersect(const V& o,const V& d,const F& tMin,const F& tMax,F& t)
+    {
+      typedef typename SimdTraits<F>::Mask M;
+      F a = d.x*d.x + d.y*d.y + d.z*d.z;
+      F b = o.x*d.x + o.y*d.y + o.z*d.z;
+      F c = o.x*o.x + o.y*o.y + o.z*o.z - F(1.0f);
+      F disc = b*b - a*c;
+      M real = disc>=F(0.0f);
+      F s = sqrt(max(disc,F(0.0f)));
+      F t0 = (F(0.0f)-b-s)/a;
+      F t1 = (F(0.0f)-b+s)/a;
+
+      M hit = M();
+      t = tMax;
+      keepCloser(t0,real & (t0>tMin),t,hit);
+      keepCloser(t1,real & (t1>tMin),t,hit);
+      return hit;
+    }
+  };
+
+  template <>
+  class PrimitiveKernel<PRIMITIVE_BOX>
+  {
+  public:
+    template <class F,class V>
+    static typename SimdTraits<F>::Mask intersect(const V& o,const V& d,const F& tMin,const F& tMax,F& t)
+    {
+      typedef typename SimdTraits<F>::Mask M;
+      F one(1.0f);
+      F ix = one/d.x,iy = one/d.y,iz = one/d.z;
+      F x0 = (F(-1.0f)-o.x)*ix,x1 = (one-o.x)*ix;
+      F y0 = (F(-1.0f)-o.y)*iy,y1 = (one-o.y)*iy;
+      F z0 = (F(-1.0f)-o.z)*iz,z1 = (one-o.z)*iz;
+      F tNear = max(max(min(x0,x1),min(y0,y1)),min(z0,z1));
+      F tFar = min(min(max(x0,x1),max(y0,y1)),max(z0,z1));
+      M overlap = tNear<=tFar;
+
+      M hit = M();
+      t = tMax;
+      keepCloser(tNear,overlap & (tNear>tMin),t,hit);
+      keepCloser(tFar,overlap & (tFar>tMin),t,hit);
+      return hit;
+    }
+  };
+
+  template <>
+  class PrimitiveKernel<PRIMITIVE_CYLINDER>
+  {
+  public:
+    template <class F,class V>
+    static typename SimdTraits<F>::Mask intersect(const V& o,const V& d,const F& tMin,const F& tMax,F& t)
+    {
+      typedef typename SimdTraits<F>::Mask M;
+      F zero(0.0f),one(1.0f);
+      F a = d.x*d.x + d.z*d.z;
+      F b = o.x*d.x + o.z*d.z;
+      F c = o.x*o.x + o.z*o.z - one;
+      F disc = b*b - a*c;
+      M real = disc>=zero;
+      F s = sqrt(max(disc,zero));
+      F t0 = (zero-b-s)/a;
+      F t1 = (zero-b+s)/a;
+      F y0 = o.y + t0*d.y;
+      F y1 = o.y + t1*d.y;
+
+      M hit = M();
+      t = tMax;
+      keepCloser(t0,real & (t0>tMin) & (y0>=zero) & (y0<=one),t,hit);
+      keepCloser(t1,real & (t1>tMin) & (y1>=zero) & (y1<=one),t,hit);
+
+      //the caps at y=0 and y=1
+      F bottom = (zero-o.y)/d.y;
+      F top = (one-o.y)/d.y;
+      F bx = o.x + bottom*d.x,bz = o.z + bottom*d.z;
+      F tx = o.x + top*d.x,tz = o.z + top*d.z;
+      keepCloser(bottom,(bottom>tMin) & ((bx*bx + bz*bz)<=one),t,hit);
+      keepCloser(top,(top>tMin) & ((tx*tx + tz*tz)<=one),t,hit);
+      return hit;
+    }
+  };
+
+  template <>
+  class PrimitiveKernel<PRIMITIVE_CONE>
+  {
+  public:
+    template <class F,class V>
+    static typename SimdTraits<F>::Mask intersect(const V& o,const V& d,const F& tMin,const F& tMax,F& t)
+    {
+      typedef typename SimdTraits<F>::Mask M;
+      F zero(0.0f),one(1.0f);
+      //x^2 + z^2 = (1-y)^2
+      F k = one-o.y;
+      F a = d.x*d.x + d.z*d.z - d.y*d.y;
+      F b = o.x*d.x + o.z*d.z + k*d.y;
+      F c = o.x*o.x + o.z*o.z - k*k;
+      F disc = b*b - a*c;
+      M real = disc>=zero;
+      F s = sqrt(max(disc,zero));
+      F t0 = (zero-b-s)/a;
+      F t1 = (zero-b+s)/a;
+      F y0 = o.y + t0*d.y;
+      F y1 = o.y + t1*d.y;
+
+      M hit = M();
+      t = tMax;
+      keepCloser(t0,real & (t0>tMin) & (y0>=zero) & (y0<=one),t,hit);
+      keepCloser(t1,real & (t1>tMin) & (y1>=zero) & (y1<=one),t,hit);
+
+      //the base at y=0
+      F bottom = (zero-o.y)/d.y;
+      F bx = o.x + bottom*d.x,bz = o.z + bottom*d.z;
+      keepCloser(bottom,(bottom>tMin) & ((bx*bx + bz*bz)<=one),t,hit);
+      return hit;
+    }
+  };
+
+  /**
+   * The outward normal of a canonical shape at a point on its surface. The
+   * result is not normalized.
+   */
+  inline glm::vec3 getPrimitiveNormal(PrimitiveKind kind,const glm::vec3& p)
+  {
+    switch (kind)
+      {
+      case PRIMITIVE_SPHERE:
+        return p;
+      case PRIMITIVE_BOX:
+        {
+          glm::vec3 a = glm::abs(p);
+          if ((a.x>=a.y) && (a.x>=a.z))
+            return glm::vec3(p.x,0,0);
+          if (a.y>=a.z)
+            return glm::vec3(0,p.y,0);
+          return glm::vec3(0,0,p.z);
+        }
+      case PRIMITIVE_CYLINDER:
+        {
+          float r = sqrt(p.x*p.x + p.z*p.z);
+          float side = fabs(r-1.0f);
+          if (min(p.y,1.0f-p.y)<side)
+            return glm::vec3(0,(p.y<0.5f)?-1.0f:1.0f,0);
+          return glm::vec3(p.x,0,p.z);
+        }
+      case PRIMITIVE_CONE:
+        {
+          float r = sqrt(p.x*p.x + p.z*p.z);
+          if (fabs(p.y)<fabs(r-(1.0f-p.y)))
+            return glm::vec3(0,-1,0);
+          return glm::vec3(p.x,r,p.z);
+        }
+      default:
+        return glm::vec3(0,1,0);
+      }
+  }
+
+  /**
+   * Texture coordinates on a canonical shape: longitude and latitude on the
+   * sphere, angle around the axis and height on the sides of the cylinder and
+   * cone, and planar mapping on their caps and on each face of the box
+   */
+  inline glm::vec2 getPrimitiveTexcoord(PrimitiveKind kind,const glm::vec3& p)
+  {
+    const float PI = 3.14159265358979f;
+    switch (kind)
+      {
+      case PRIMITIVE_SPHERE:
+        {
+          float y = glm::clamp(p.y/glm::length(p),-1.0f,1.0f);
+          return glm::vec2(0.5f + atan2(p.x,p.z)/(2*PI),0.5f + asin(y)/PI);
+        }
+      case PRIMITIVE_BOX:
+        {
+          glm::vec3 a = glm::abs(p);
+          glm::vec2 face;
+          if ((a.x>=a.y) && (a.x>=a.z))
+            face = glm::vec2((p.x>0)?-p.z:p.z,p.y);
+          else if (a.y>=a.z)
+            face = glm::vec2(p.x,(p.y>0)?-p.z:p.z);
+          else
+            face = glm::vec2((p.z>0)?p.x:-p.x,p.y);
+          return 0.5f*(face+glm::vec2(1,1));
+        }
+      case PRIMITIVE_CYLINDER:
+      case PRIMITIVE_CONE:
+        {
+          glm::vec3 n = getPrimitiveNormal(kind,p);
+          if ((n.x==0) && (n.z==0))
+            return 0.5f*(glm::vec2(p.x,p.z)+glm::vec2(1,1));
+          return glm::vec2(0.5f + atan2(p.x,p.z)/(2*PI),p.y);
+        }
+      default:
+        return glm::vec2(0,0);
+      }
+  }
+
+  /**
+   * All the instances of one kind of primitive, with the transformation of each
+   * from the view coordinate system to its canonical shape. The first three
+   * rows are enough, as the transformations are affine, and they are kept
+   * together, row by row, as the 12 floats of an instance are always read
+   * together: the top-level hierarchy hands out one instance at a time.
+   *
+   * The kernel of the kind is fixed at compile time, so tracing a ray through a
+   * batch involves neither a virtual call nor a test of the kind.
+   */
+  template <PrimitiveKind kind>
+  class PrimitiveBatch
+  {
+  protected:
+    //12 floats per instance: rows 0, 1 and 2 of its matrix
+    vector<float> matrices;
+
+  public:
+    void clear()
+    {
+      matrices.clear();
+    }
+
+    /**
+     * Add an instance
+     * \param toCanonical the transformation from view coordinates to the
+     * canonical shape
+     * \return the slot of the instance in this batch
+     */
+    int add(const glm::mat4& toCanonical)
+    {
+      matrices.resize(matrices.size()+12);
+      int slot = size()-1;
+      set(slot,toCanonical);
+      return slot;
+    }
+
+    /**
+     * Change the transformation of the instance in a slot
+     * \param slot the slot returned by add()
+     * \param toCanonical the new transformation from view coordinates to the
+     * canonical shape
+     */
+    void set(int slot,const glm::mat4& toCanonical)
+    {
+      float *m = &matrices[12*slot];
+      for (int r=0;r<3;r++)
+        for (int c=0;c<4;c++)
+          m[4*r+c] = toCanonical[c][r];
+    }
+
+    int size() const
+    {
+      return matrices.size()/12;
+    }
+
+    /**
+     * Intersect a ray given in view coordinates with the instance in a slot
+     */
+    bool intersect(int slot,const glm::vec3& origin,const glm::vec3& dir,
+                   float tMin,float tMax,float& t) const
+    {
+      const float *m = &matrices[12*slot];
+      glm::vec3 o,d;
+      for (int r=0;r<3;r++)
+        {
+          o[r] = m[4*r]*origin.x + m[4*r+1]*origin.y + m[4*r+2]*origin.z + m[4*r+3];
+          d[r] = m[4*r]*dir.x + m[4*r+1]*dir.y + m[4*r+2]*dir.z;
+        }
+      return PrimitiveKernel<kind>::intersect(o,d,tMin,tMax,t);
+    }
+
+    /**
+     * Intersect the rays of a packet given in view coordinates with the
+     * instance in a slot
+     * \return the lanes, among mask, that hit the instance within their
+     * (tMin,tMax)
+     */
+    SimdMask intersect(int slot,const RayPacket& packet,const SimdMask& mask,SimdFloat& t) const
+    {
+      const float *row = &matrices[12*slot];
+      SimdFloat m[12];
+      for (int i=0;i<12;i++)
+        m[i] = SimdFloat(row[i]);
+      SimdVec3 o(m[0]*packet.origin.x + m[1]*packet.origin.y + m[2]*packet.origin.z + m[3],
+                 m[4]*packet.origin.x + m[5]*packet.origin.y + m[6]*packet.origin.z + m[7],
+                 m[8]*packet.origin.x + m[9]*packet.origin.y + m[10]*packet.origin.z + m[11]);
+      SimdVec3 d(m[0]*packet.dir.x + m[1]*packet.dir.y + m[2]*packet.dir.z,
+                 m[4]*packet.dir.x + m[5]*packet.dir.y + m[6]*packet.dir.z,
+                 m[8]*packet.dir.x + m[9]*packet.dir.y + m[10]*packet.dir.z);
+      return mask & PrimitiveKernel<kind>::intersect(o,d,packet.tMin,packet.tMax,t);
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef _PROGRESSIVERENDER_H_
+#define _PROGRESSIVERENDER_H_
+
+#include "Camera.h"
+#include "Framebuffer.h"
+#include "PathTracer.h"
+#include "Raytracer.h"
+#include "TileRenderer.h"
+#include "ThreadPool.h"
+#include "TraceCounters.h"
+#include "sgraph/Scenegraph.h"
+#include <glm/glm.hpp>
+#include <atomic>
+#include <mutex>
+#include <stack>
+#include <thread>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+   * A rectangle of pixels in a framebuffer, with (x,y) at its bottom-left
+   */
+  class TileRect
+  {
+  public:
+    int x,y,width,height;
+  };
+
+  /**
+ * Raytraces a scene graph in the background, so that the thread owning the
+ * window stays free to draw. The image can be shown while it is being made:
+ * every tile is reported as soon as it is written, and the owner picks up the
+ * newly finished tiles whenever it redraws (e.g. to copy them to a texture).
+ *
+ * Only one render runs at a time. Starting a new one, or cancelling, stops the
+ * current render within a row of pixels and waits for it.
+ *
+ * Starting a render of the same scene graph with the same camera as the last
+ * one updates the last image rather than making a new one: only the tiles
+ * that changed since are traced again (see Raytracer::retrace). If the view
+ * has moved instead and the raytracer has reprojection on, the last image is
+ * reprojected to the new view (see Raytracer::reproject).
+ *
+ * With path tracing on, renders are made by a raytrace::PathTracer instead,
+ * which goes on adding samples to the last image for as long as the scene and
+ * the view stay the same.
+ */
+  class ProgressiveRender
+  {
+  protected:
+    util::ThreadPool& pool;
+    Raytracer raytracer;
+    PathTracer pathTracer;
+    bool pathTracing;
+    //true if the framebuffer holds a path traced image
+    bool pathTraced;
+    Framebuffer fb;
+    //copies of the view the background thread renders
+    Camera camera;
+    stack<glm::mat4> modelview;
+    sgraph::Scenegraph *scenegraph;
+
+    thread driver;
+    atomic<bool> cancelFlag;
+    atomic<bool> finished;
+    RenderStats stats;
+    PathTraceStats pathStats;
+
+    //tiles written since the owner last asked, guarded by tileLock
+    mutex tileLock;
+    vector<TileRect> finishedTiles;
+
+  public:
+    ProgressiveRender(util::ThreadPool& pool)
+      :pool(pool),raytracer(pool),pathTracer(pool),camera(0,0)
+    {
+      scenegraph = NULL;
+      pathTracing = false;
+      pathTraced = false;
+      cancelFlag = false;
+      finished = false;
+      raytracer.setCancelFlag(&cancelFlag);
+      raytracer.setDependencyTracking(true);
+      TileRenderer::TileListener listener = [this](int x,int y,int width,int height)
+      {
+        TileRect tile;
+        tile.x = x;
+        tile.y = y;
+        tile.width = width;
+        tile.height = height;
+        lock_guard<mutex> lock(tileLock);
+        finishedTiles.push_back(tile);
+      };
+      raytracer.setTileListener(listener);
+      pathTracer.setCancelFlag(&cancelFlag);
+      pathTracer.setTileListener(listener);
+    }
+
+    ~ProgressiveRender()
+    {
+      cancel();
+    }
+
+    /**
+     * The raytracer used for every render, e.g. to change the tile size or
+     * switch packet tracing. It must not be changed while a render is running
+     */
+    Raytracer& getRaytracer()
+    {
+      return raytracer;
+    }
+
+    /**
+     * The path tracer used while path tracing is on, e.g. to change when it
+     * stops. It must not be changed while a render is running
+     */
+    PathTracer& getPathTracer()
+    {
+      return pathTracer;
+    }
+
+    /**
+     * Choose whether renders are path traced rather than raytraced. It must
+     * not be changed while a render is running
+     */
+    void setPathTracing(bool enabled)
+    {
+      pathTracing = enabled;
+    }
+
+    bool isPathTracing() const
+    {
+      return pathTracing;
+    }
+
+    /**
+     * Start rendering the scene graph on the thread pool and return right
+     * away. Any render in progress is cancelled first. The scene graph is
+     * compiled for ray queries on the calling thread, so it must not change
+     * until the render is finished or cancelled
+     * \param scenegraph the scene graph to be rendered
+     * \param camera the camera generating the primary rays
+     * \param modelview the stack whose top is the world-to-view transformation
+     */
+    void start(sgraph::Scenegraph *scenegraph,const Camera& camera,stack<glm::mat4>& modelview)
+    {
+      cancel();
+      TraceStatistics::reset();
+
+      //a path traced image is no use to the raytracer, nor the other way round
+      bool update = (scenegraph==this->scenegraph) && (camera==this->camera) &&
+          (pathTraced==pathTracing);
+      bool moved = update && (modelview.top()!=this->modelview.top());
+      this->scenegraph = scenegraph;
+      this->camera = camera;
+      this->modelview = modelview;
+      if (!update)
+        fb.resize(camera.getWidth(),camera.getHeight());
+      scenegraph->compileRayScene(this->modelview,&pool);
+
+      cancelFlag = false;
+      finished = false;
+      stats = RenderStats();
+      pathStats = PathTraceStats();
+      pathTraced = pathTracing;
+      driver = thread([this,update,moved]()
+      {
+        if (pathTracing)
+          pathStats = pathTracer.render(this->scenegraph,this->camera,this->modelview,fb);
+        else if (moved && raytracer.isReprojecting())
+          stats = raytracer.reproject(this->scenegraph,this->camera,this->modelview,fb);
+        else if (update)
+          stats = raytracer.retrace(this->scenegraph,this->camera,this->modelview,fb);
+        else
+          stats = raytracer.trace(this->scenegraph,this->camera,this->modelview,fb);
+        finished = true;
+      });
+    }
+
+    /**
+     * Stop the current render, if any, and wait for its threads to let go of
+     * the framebuffer. Tiles finished so far stay in the framebuffer
+     */
+    void cancel()
+    {
+      if (driver.joinable())
+        {
+          cancelFlag = true;
+          driver.join();
+        }
+      lock_guard<mutex> lock(tileLock);
+      finishedTiles.clear();
+    }
+
+    /**
+     * Returns true while a render has been started and has neither finished
+     * nor been cancelled
+     */
+    bool isRunning() const
+    {
+      return driver.joinable() && !finished;
+    }
+
+    /**
+     * Returns true once the last render has written every tile, or stopped
+     * because it was cancelled
+     */
+    bool isFinished() const
+    {
+      return finished;
+    }
+
+    /**
+     * Move the tiles written since the last call into the given list. Their
+     * pixels may be read from the framebuffer right away, while the rest of
+     * the image is still being rendered
+     * \param tiles receives the newly finished tiles
+     * \return true if there was at least one
+     */
+    bool takeFinishedTiles(vector<TileRect>& tiles)
+    {
+      tiles.clear();
+      lock_guard<mutex> lock(tileLock);
+      tiles.swap(finishedTiles);
+      return !tiles.empty();
+    }
+
+    /**
+     * The statistics of the last render. Only meaningful once it has finished
+     */
+    RenderStats getStats() const
+    {
+      if (!finished)
+        return RenderStats();
+      return stats;
+    }
+
+    /**
+     * The statistics of the last render if it was path traced. Only
+     * meaningful once it has finished
+     */
+    PathTraceStats getPathTraceStats() const
+    {
+      if (!finished)
+        return PathTraceStats();
+      return pathStats;
+    }
+
+    /**
+     * What the rays of the last render did, counted by every thread. Only
+     * meaningful once it has finished
+     */
+    TraceStatistics getCounters() const
+    {
+      if (!finished)
+        return TraceStatistics();
+      return TraceStatistics::collect();
+    }
+
+    const Framebuffer& getFramebuffer() const
+    {
+      return fb;
+    }
+  };
+}
+
+#endif
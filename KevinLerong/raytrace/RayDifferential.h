@@ -0,0 +1,133 @@
+#ifndef _RAYDIFFERENTIAL_H_
+#define _RAYDIFFERENTIAL_H_
+
+#include <glm/glm.hpp>
+#include <cmath>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * How the origin and direction of a ray change from one pixel to the next,
+ * across (x) and up (y) the image (Igehy, "Tracing Ray Differentials"). Carried
+ * along a ray, it gives the area of a surface that one pixel covers where the
+ * ray hits it, from which raytrace::MipTexture picks the level to sample.
+ *
+ * A differential that is all zeros stands for a single point, and makes the
+ * texture use its full resolution.
+ */
+  class RayDifferential
+  {
+  public:
+    glm::vec3 dOdx,dOdy;
+    glm::vec3 dDdx,dDdy;
+
+    RayDifferential()
+    {
+      dOdx = dOdy = dDdx = dDdy = glm::vec3(0,0,0);
+    }
+
+    /**
+     * The differential of a primary ray made by Camera::getRay. All primary
+     * rays start at the eye, and the (unnormalized) direction moves by
+     * exactly one unit per pixel in x and in y.
+     */
+    static RayDifferential primary()
+    {
+      RayDifferential d;
+      d.dDdx = glm::vec3(1,0,0);
+      d.dDdy = glm::vec3(0,1,0);
+      return d;
+    }
+
+    bool isZero() const
+    {
+      return (dOdx==glm::vec3(0,0,0)) && (dOdy==glm::vec3(0,0,0)) &&
+          (dDdx==glm::vec3(0,0,0)) && (dDdy==glm::vec3(0,0,0));
+    }
+
+    /**
+     * How the hit point moves from one pixel to the next, found by moving the
+     * ray to the plane of the surface it hits
+     * \param dir the direction of the ray, as it was traced
+     * \param t the ray parameter of the hit
+     * \param normal the normal of the surface plane at the hit
+     * \param dPdx receives the change of the hit point across the image
+     * \param dPdy receives the change of the hit point up the image
+     */
+    void transfer(const glm::vec3& dir,float t,const glm::vec3& normal,
+                  glm::vec3& dPdx,glm::vec3& dPdy) const
+    {
+      float dDotN = glm::dot(dir,normal);
+      dPdx = dOdx + t*dDdx;
+      dPdy = dOdy + t*dDdy;
+      if (fabs(dDotN)<1e-12f)
+        return;
+      dPdx -= (glm::dot(dPdx,normal)/dDotN)*dir;
+      dPdy -= (glm::dot(dPdy,normal)/dDotN)*dir;
+    }
+
+    /**
+     * The differential of the ray reflected at a hit. The surface is taken to
+     * be flat around the hit, i.e. the change of the normal is ignored.
+     * \param dir the direction of the incoming ray, as it was traced
+     * \param normal the unit normal at the hit
+     * \param dPdx,dPdy the change of the hit point, from transfer()
+     */
+    RayDifferential reflect(const glm::vec3& dir,const glm::vec3& normal,
+                            const glm::vec3& dPdx,const glm::vec3& dPdy) const
+    {
+      RayDifferential r;
+      r.dOdx = dPdx;
+      r.dOdy = dPdy;
+      r.dDdx = reflectDirection(normalized(dir,dDdx),normal);
+      r.dDdy = reflectDirection(normalized(dir,dDdy),normal);
+      return r;
+    }
+
+    /**
+     * The differential of the ray refracted at a hit, for a flat surface
+     * \param dir the direction of the incoming ray, as it was traced
+     * \param normal the unit normal at the hit, facing the incoming ray
+     * \param eta the ratio of the refractive indices, incoming over outgoing
+     * \param dPdx,dPdy the change of the hit point, from transfer()
+     */
+    RayDifferential refract(const glm::vec3& dir,const glm::vec3& normal,float eta,
+                            const glm::vec3& dPdx,const glm::vec3& dPdy) const
+    {
+      glm::vec3 d = glm::normalize(dir);
+      float cosIn = -glm::dot(d,normal);
+      float k = 1.0f-eta*eta*(1.0f-cosIn*cosIn);
+      //the refracted direction is eta*d + (eta*cosIn - sqrt(k))*normal
+      float mu = (k>0)?eta-eta*eta*cosIn/sqrt(k):eta;
+
+      RayDifferential r;
+      r.dOdx = dPdx;
+      r.dOdy = dPdy;
+      glm::vec3 ddx = normalized(dir,dDdx);
+      glm::vec3 ddy = normalized(dir,dDdy);
+      r.dDdx = eta*ddx - mu*glm::dot(ddx,normal)*normal;
+      r.dDdy = eta*ddy - mu*glm::dot(ddy,normal)*normal;
+      return r;
+    }
+
+  protected:
+    /**
+     * The change of dir/|dir|, given the change dd of dir
+     */
+    static glm::vec3 normalized(const glm::vec3& dir,const glm::vec3& dd)
+    {
+      float len2 = glm::dot(dir,dir);
+      float len = sqrt(len2);
+      return (len2*dd - glm::dot(dir,dd)*dir)/(len2*len);
+    }
+
+    static glm::vec3 reflectDirection(const glm::vec3& dd,const glm::vec3& normal)
+    {
+      return dd - 2.0f*glm::dot(dd,normal)*normal;
+    }
+  };
+}
+
+#endif
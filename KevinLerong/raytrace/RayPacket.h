@@ -0,0 +1,135 @@
+#ifndef _RAYPACKET_H_
+#define _RAYPACKET_H_
+
+#include "SIMD.h"
+#include "Triangle.h"
+#include "_3DRay.h"
+#include <glm/glm.hpp>
+#include <limits>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * Up to SIMD_WIDTH rays traced together, one per SIMD lane. Coherent rays (e.g.
+ * primary rays through neighbouring pixels, or shadow rays from them towards
+ * the same light) visit mostly the same nodes of a hierarchy, so each node and
+ * triangle is fetched once for the whole packet and tested against all of its
+ * rays with one instruction per step.
+ *
+ * Lanes that are not in the active mask are carried along but ignored.
+ */
+  class RayPacket
+  {
+  public:
+    SimdVec3 origin,dir,invDir;
+    SimdFloat tMin,tMax;
+    SimdMask active;
+
+    RayPacket()
+    {
+    }
+
+    /**
+     * Fill the packet with the given rays. Unused lanes repeat the first ray
+     * and are inactive
+     * \param rays the rays
+     * \param n how many rays there are, at most SIMD_WIDTH
+     * \param tMinimum the smallest ray parameter of interest for all rays
+     * \param tMaximum the largest ray parameter of interest for all rays
+     */
+    RayPacket(const _3DRay *rays,int n,
+              float tMinimum=0.0f,float tMaximum=numeric_limits<float>::infinity())
+    {
+      float o[3][SIMD_WIDTH],d[3][SIMD_WIDTH];
+      for (int lane=0;lane<SIMD_WIDTH;lane++)
+        {
+          const _3DRay& ray = rays[lane<n?lane:0];
+          for (int k=0;k<3;k++)
+            {
+              o[k][lane] = ray.pos[k];
+              d[k][lane] = ray.dir[k];
+            }
+        }
+      origin = SimdVec3(SimdFloat::load(o[0]),SimdFloat::load(o[1]),SimdFloat::load(o[2]));
+      dir = SimdVec3(SimdFloat::load(d[0]),SimdFloat::load(d[1]),SimdFloat::load(d[2]));
+      updateInverse();
+      tMin = SimdFloat(tMinimum);
+      tMax = SimdFloat(tMaximum);
+      active = SimdMask::firstLanes(n);
+    }
+
+    /**
+     * The same packet in another coordinate system. The ray parameters stay
+     * valid because m is affine
+     */
+    RayPacket transformed(const glm::mat4& m) const
+    {
+      RayPacket p;
+      p.origin = SimdVec3(SimdFloat(m[0][0])*origin.x + SimdFloat(m[1][0])*origin.y + SimdFloat(m[2][0])*origin.z + SimdFloat(m[3][0]),
+                          SimdFloat(m[0][1])*origin.x + SimdFloat(m[1][1])*origin.y + SimdFloat(m[2][1])*origin.z + SimdFloat(m[3][1]),
+                          SimdFloat(m[0][2])*origin.x + SimdFloat(m[1][2])*origin.y + SimdFloat(m[2][2])*origin.z + SimdFloat(m[3][2]));
+      p.dir = SimdVec3(SimdFloat(m[0][0])*dir.x + SimdFloat(m[1][0])*dir.y + SimdFloat(m[2][0])*dir.z,
+                       SimdFloat(m[0][1])*dir.x + SimdFloat(m[1][1])*dir.y + SimdFloat(m[2][1])*dir.z,
+                       SimdFloat(m[0][2])*dir.x + SimdFloat(m[1][2])*dir.y + SimdFloat(m[2][2])*dir.z);
+      p.updateInverse();
+      p.tMin = tMin;
+      p.tMax = tMax;
+      p.active = active;
+      return p;
+    }
+
+  private:
+    void updateInverse()
+    {
+      SimdFloat one(1.0f);
+      invDir = SimdVec3(one/dir.x,one/dir.y,one/dir.z);
+    }
+  };
+
+  /**
+   * The closest hits of the rays of a raytrace::RayPacket. A lane whose
+   * instance is -1 did not hit anything
+   */
+  class PacketHit
+  {
+  public:
+    int instance[SIMD_WIDTH];
+    TriangleHit hit[SIMD_WIDTH];
+
+    PacketHit()
+    {
+      for (int i=0;i<SIMD_WIDTH;i++)
+        instance[i] = -1;
+    }
+  };
+
+  /**
+   * Intersect every active ray of a packet with the triangle (v0,v1,v2), using
+   * the test of Moller and Trumbore evaluated across lanes
+   * \return the lanes (among mask) that hit the triangle within their (tMin,tMax)
+   */
+  inline SimdMask intersectTriangle(const RayPacket& packet,const SimdMask& mask,
+                                    const glm::vec3& v0,const glm::vec3& v1,const glm::vec3& v2,
+                                    SimdFloat& t,SimdFloat& u,SimdFloat& v)
+  {
+    SimdVec3 e1(v1-v0);
+    SimdVec3 e2(v2-v0);
+    SimdVec3 p = cross(packet.dir,e2);
+    SimdFloat det = dot(e1,p);
+    SimdFloat inv = SimdFloat(1.0f)/det;
+    SimdVec3 s = packet.origin-SimdVec3(v0);
+    u = dot(s,p)*inv;
+    SimdVec3 q = cross(s,e1);
+    v = dot(packet.dir,q)*inv;
+    t = dot(e2,q)*inv;
+
+    SimdFloat zero(0.0f);
+    return mask & (abs(det)>zero)
+        & (u>=zero) & (v>=zero) & ((u+v)<=SimdFloat(1.0f))
+        & (t>packet.tMin) & (t<packet.tMax);
+  }
+}
+
+#endif
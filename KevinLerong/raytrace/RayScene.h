@@ -0,0 +1,647 @@
+#ifndef _RAYSCENE_H_
+#define _RAYSCENE_H_
+
+#include "AABB.h"
+#include "BVH.h"
+#include "Instance.h"
+#include "LightTree.h"
+#include "MipTexture.h"
+#include "Primitive.h"
+#include "RayDifferential.h"
+#include "Triangle.h"
+#include "TriangleMesh.h"
+#include "RayPacket.h"
+#include "SceneLight.h"
+#include "sgraph/INode.h"
+#include "HitRecord.h"
+#include "_3DRay.h"
+#include <glm/glm.hpp>
+#include <limits>
+#include <map>
+#include <stack>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * A snapshot of a scene graph compiled for ray queries, organized as a two-level
+ * hierarchy. All the leaves are flattened into a list of instances with their
+ * view-space bounding boxes, and a raytrace::BVH (the top level) is built over
+ * these boxes so that a ray only visits the instances whose boxes it actually
+ * passes through. The ray is then brought into the coordinate system of the
+ * instance and traced through the triangle hierarchy of its mesh
+ * (raytrace::TriangleMesh, the bottom level), which is shared by all
+ * instances of that mesh.
+ *
+ * Every matrix a ray needs (the instance transformations, their inverses and
+ * normal matrices) is computed while compiling, so a ray query only looks them
+ * up, and so is the texture of every instance.
+ *
+ * Spheres, boxes, cylinders and cones are traced as the exact shapes rather
+ * than as their meshes. The instances of each kind are kept in their own
+ * raytrace::PrimitiveBatch, and the hierarchy refers to every instance by its
+ * kind and its slot in the batch of that kind, so a ray picks the kernel with
+ * a switch over a small enum rather than by looking at the instance itself.
+ * The lights of the scene graph are collected in view coordinates at the same
+ * time, and arranged in a raytrace::LightTree for scenes with many lights.
+ *
+ * The snapshot must be recompiled whenever the scene graph or the camera
+ * changes. If only transformations changed (an animation, or the camera
+ * moving), refit() updates it in place for much less than build().
+ */
+  class RayScene
+  {
+  protected:
+    /**
+     * Where to find an instance: the kind of its primitive, and its slot in the
+     * batch of that kind (its index in instances for meshes)
+     */
+    class PrimitiveRef
+    {
+    public:
+      PrimitiveKind kind;
+      int slot;
+
+      PrimitiveRef(PrimitiveKind kind,int slot)
+      {
+        this->kind = kind;
+        this->slot = slot;
+      }
+    };
+
+    vector<Instance> instances;
+    vector<PrimitiveRef> refs;
+    PrimitiveBatch<PRIMITIVE_SPHERE> spheres;
+    PrimitiveBatch<PRIMITIVE_BOX> boxes;
+    PrimitiveBatch<PRIMITIVE_CYLINDER> cylinders;
+    PrimitiveBatch<PRIMITIVE_CONE> cones;
+    //the view-space bounding box of every instance
+    vector<AABB> instanceBounds;
+    vector<SceneLight> lights;
+    LightTree lightTree;
+    BVH bvh;
+    bool compiled;
+    BVHUpdate lastUpdate;
+    //the leaves the scene was built from, the instance made from each (-1 if
+    //it was left out), and the canonical frame of every instance
+    vector<Instance> leaves;
+    vector<int> leafInstances;
+    vector<glm::mat4> frames;
+
+  public:
+    RayScene()
+    {
+      compiled = false;
+      lastUpdate = BVH_REBUILT;
+    }
+
+    /**
+     * Compile the scene graph rooted at the given node.
+     * \param root the root of the scene graph
+     * \param modelview the stack of modelview matrices, whose top is the
+     * world-to-view transformation
+     * \param meshes the triangles of every mesh, by name. Leaves referring
+     * to meshes not in this map are left out.
+     * \param textures the images of every texture, by name. Leaves whose
+     * texture is not in this map use the texture "white", if there is one.
+     */
+    void build(sgraph::INode *root,stack<glm::mat4>& modelview,
+               const map<string,TriangleMesh>& meshes,
+               const map<string,MipTexture>& textures=map<string,MipTexture>())
+    {
+      //the canonical shape of every mesh that is a primitive, fitted once
+      map<const TriangleMesh *,glm::mat4> meshFrames;
+
+      instances.clear();
+      refs.clear();
+      spheres.clear();
+      boxes.clear();
+      cylinders.clear();
+      cones.clear();
+      instanceBounds.clear();
+      leaves.clear();
+      leafInstances.clear();
+      frames.clear();
+      if (root!=NULL)
+        root->getInstancesInView(leaves,modelview);
+      collectLights(root,modelview);
+
+      for (unsigned int i=0;i<leaves.size();i++)
+        {
+          leafInstances.push_back(-1);
+          map<string,TriangleMesh>::const_iterator it = meshes.find(leaves[i].meshName);
+          if ((it==meshes.end()) || (it->second.getTriangleCount()==0))
+            continue;
+          leafInstances.back() = instances.size();
+          instances.push_back(leaves[i]);
+          Instance& instance = instances.back();
+          instance.mesh = &it->second;
+          map<string,MipTexture>::const_iterator tex = textures.find(leaves[i].textureName);
+          if (tex==textures.end())
+            tex = textures.find("white");
+          if (tex!=textures.end())
+            instance.texture = &tex->second;
+
+          glm::mat4 m(1.0f);
+          if (instance.kind!=PRIMITIVE_MESH)
+            {
+              map<const TriangleMesh *,glm::mat4>::iterator frame = meshFrames.find(instance.mesh);
+              if (frame!=meshFrames.end())
+                m = frame->second;
+              else if (instance.mesh->getPrimitiveFrame(instance.kind,m))
+                meshFrames[instance.mesh] = m;
+              else
+                instance.kind = PRIMITIVE_MESH;
+              if (instance.kind!=PRIMITIVE_MESH)
+                instance.setTransform(instance.transform * m);
+              else
+                m = glm::mat4(1.0f);
+            }
+          frames.push_back(m);
+          refs.push_back(addPrimitive(instance,instances.size()-1));
+          instanceBounds.push_back(getCanonicalBounds(instance).transform(instance.transform));
+        }
+      bvh.build(instanceBounds,1);
+      compiled = true;
+      lastUpdate = BVH_REBUILT;
+    }
+
+    /**
+     * Update the compiled scene to new transformations of the same scene
+     * graph, from the same meshes and textures as the last build(). The
+     * instances keep their indices. Their matrices and boxes are computed
+     * again, in parallel, and the top-level hierarchy is refitted to the new
+     * boxes, or partly or fully rebuilt if refitting made it too slow (see
+     * BVH::refit()).
+     * \param root the root of the scene graph
+     * \param modelview the stack of modelview matrices, whose top is the
+     * world-to-view transformation
+     * \param pool if not NULL, the work is shared out on this pool
+     * \param maxCostRatio how much worse than when it was built the
+     * hierarchy may get before it is rebuilt
+     * \return false, leaving the scene alone, if anything but
+     * transformations and materials changed since the last build(), which
+     * must then be called instead
+     */
+    bool refit(sgraph::INode *root,stack<glm::mat4>& modelview,util::ThreadPool *pool=NULL,
+               float maxCostRatio=1.3f)
+    {
+      if (!compiled || (root==NULL))
+        return false;
+      vector<Instance> current;
+      root->getInstancesInView(current,modelview);
+      if (current.size()!=leaves.size())
+        return false;
+      for (unsigned int i=0;i<current.size();i++)
+        {
+          if ((current[i].node!=leaves[i].node) || (current[i].kind!=leaves[i].kind) ||
+              (current[i].meshName!=leaves[i].meshName) ||
+              (current[i].textureName!=leaves[i].textureName))
+            return false;
+        }
+      leaves.swap(current);
+      collectLights(root,modelview);
+
+      //a few chunks of instances per thread
+      int n = leaves.size();
+      int chunks = (pool!=NULL)?min(n,4*(int)pool->getThreadCount()):1;
+      util::ThreadPool::Batch jobs;
+      for (int c=0;c<chunks;c++)
+        {
+          int first = (int)((long long)n*c/chunks);
+          int last = (int)((long long)n*(c+1)/chunks);
+          if (pool!=NULL)
+            pool->submit(jobs,[this,first,last]() { refitLeaves(first,last); });
+          else
+            refitLeaves(first,last);
+        }
+      if (pool!=NULL)
+        pool->wait(jobs);
+
+      lastUpdate = bvh.refit(instanceBounds,maxCostRatio,pool);
+      return true;
+    }
+
+    /**
+     * What the last build() or refit() did to the top-level hierarchy
+     */
+    BVHUpdate getLastUpdate() const
+    {
+      return lastUpdate;
+    }
+
+    /**
+     * The SAH cost of the top-level hierarchy, see BVH::getCost()
+     */
+    float getCost() const
+    {
+      return bvh.getCost();
+    }
+
+    bool isCompiled() const
+    {
+      return compiled;
+    }
+
+    const vector<Instance>& getInstances() const
+    {
+      return instances;
+    }
+
+    const vector<SceneLight>& getLights() const
+    {
+      return lights;
+    }
+
+    /**
+     * The hierarchy over the lights returned by getLights()
+     */
+    const LightTree& getLightTree() const
+    {
+      return lightTree;
+    }
+
+    /**
+     * The bounding box of an instance in the view coordinate system
+     */
+    const AABB& getInstanceBounds(int i) const
+    {
+      return instanceBounds[i];
+    }
+
+    /**
+     * The bounding box of the whole scene in the view coordinate system
+     */
+    AABB getBounds() const
+    {
+      return bvh.getBounds();
+    }
+
+    /**
+     * Find the closest intersection of the ray with this scene
+     * \param ray the ray in the view coordinate system
+     * \param differential if not NULL, the footprint of the ray, used to filter
+     * the texture
+     * \return the closest hit. If nothing was hit, HitRecord::hit is false
+     */
+    HitRecord intersect(const _3DRay& ray,const RayDifferential *differential=NULL) const
+    {
+      float tMax = numeric_limits<float>::infinity();
+      TriangleHit hit;
+      int hitInstance = -1;
+
+      glm::vec3 origin = glm::vec3(ray.pos);
+      glm::vec3 dir = glm::vec3(ray.dir);
+      bvh.traverse(origin,dir,0.0f,tMax,
+                   [this,&origin,&dir,&hit,&hitInstance](int i,float& tMax)
+      {
+        if (!intersectInstance(i,origin,dir,0.0f,tMax,hit))
+          return false;
+        hitInstance = i;
+        return true;
+      });
+
+      if (hitInstance<0)
+        return HitRecord();
+      return getHitRecord(ray,hitInstance,hit,differential);
+    }
+
+    /**
+     * Find out whether anything lies on a ray between tMin and tMax. This is
+     * meant for shadow rays: it stops at the first blocker found and keeps no
+     * record of where it was hit
+     * \param origin the start of the ray in the view coordinate system
+     * \param dir the direction of the ray in the view coordinate system
+     * \param tMin the smallest ray parameter of interest
+     * \param tMax the largest ray parameter of interest
+     * \return true if the ray is blocked
+     */
+    bool occluded(const glm::vec3& origin,const glm::vec3& dir,float tMin,float tMax) const
+    {
+      return findOccluder(origin,dir,tMin,tMax)>=0;
+    }
+
+    /**
+     * Like occluded(), but also tell which instance blocks the ray
+     * \return the first blocking instance found, which need not be the
+     * closest one, or -1 if the ray is not blocked
+     */
+    int findOccluder(const glm::vec3& origin,const glm::vec3& dir,float tMin,float tMax) const
+    {
+      int blocker = -1;
+      bvh.traverseAny(origin,dir,tMin,tMax,[this,&origin,&dir,&blocker,tMin,tMax](int i)
+      {
+        bool blocked;
+        if (refs[i].kind==PRIMITIVE_MESH)
+          {
+            const glm::mat4& inverse = instances[i].inverseTransform;
+            blocked = instances[i].mesh->occluded(glm::vec3(inverse * glm::vec4(origin,1.0f)),
+                                                  glm::vec3(inverse * glm::vec4(dir,0.0f)),
+                                                  tMin,tMax);
+          }
+        else
+          {
+            float far = tMax;
+            TriangleHit hit;
+            blocked = intersectInstance(i,origin,dir,tMin,far,hit);
+          }
+        if (blocked)
+          blocker = i;
+        return blocked;
+      });
+      return blocker;
+    }
+
+    /**
+     * Find the closest intersection of every active ray of a packet
+     * \param packet the rays in the view coordinate system
+     * \param hits receives the closest hit of each ray
+     */
+    void intersect(RayPacket& packet,PacketHit& hits) const
+    {
+      trace(packet,hits,false);
+    }
+
+    /**
+     * Find which rays of a packet hit anything at all. Each ray stops at the
+     * first hit found rather than the closest one.
+     * \param packet the rays in the view coordinate system
+     * \return the active rays that are blocked
+     */
+    SimdMask occluded(RayPacket& packet) const
+    {
+      PacketHit hits;
+      SimdMask start = packet.active;
+      trace(packet,hits,true);
+      return start.andNot(packet.active);
+    }
+
+    /**
+     * Complete the hit record of a ray from the instance and triangle it hit.
+     * If the instance is textured, the texture is sampled at the hit: with a
+     * differential, over the area of the surface the ray stands for, and
+     * otherwise at full resolution.
+     */
+    HitRecord getHitRecord(const _3DRay& ray,int hitInstance,const TriangleHit& hit,
+                           const RayDifferential *differential=NULL) const
+    {
+      const Instance& instance = instances[hitInstance];
+      if (instance.kind!=PRIMITIVE_MESH)
+        return getPrimitiveHitRecord(ray,hitInstance,hit.t,differential);
+
+      glm::vec3 normal = instance.normalTransform * instance.mesh->getNormal(hit);
+      HitRecord record(hit.t,glm::normalize(normal),&instance.material,hitInstance);
+      if (instance.texture==NULL)
+        return record;
+
+      glm::vec2 uv = instance.mesh->getTexcoord(hit);
+      if ((differential==NULL) || differential->isZero())
+        {
+          record.textureColor = glm::vec3(instance.texture->sample(uv));
+          return record;
+        }
+
+      //move the footprint onto the triangle, then into the mesh to find its texture area
+      glm::vec3 dPdx,dPdy;
+      glm::vec3 face = instance.normalTransform * instance.mesh->getFaceNormal(hit);
+      differential->transfer(glm::vec3(ray.dir),hit.t,face,dPdx,dPdy);
+      glm::mat3 toObject = glm::mat3(instance.inverseTransform);
+      glm::vec2 duvdx,duvdy;
+      instance.mesh->getTexcoordDerivatives(hit,toObject*dPdx,toObject*dPdy,duvdx,duvdy);
+      record.textureColor = glm::vec3(instance.texture->sample(uv,duvdx,duvdy));
+      return record;
+    }
+
+  protected:
+    /**
+     * Collect the lights of the scene graph and arrange them for sampling
+     */
+    void collectLights(sgraph::INode *root,stack<glm::mat4>& modelview)
+    {
+      lights.clear();
+      if (root!=NULL)
+        {
+          vector<util::Light> lightsInView = root->getLightsInView(modelview);
+          for (unsigned int i=0;i<lightsInView.size();i++)
+            lights.push_back(SceneLight(lightsInView[i]));
+        }
+      lightTree.build(lights);
+    }
+
+    /**
+     * Bring the instances made from leaves[first .. last-1] up to date with
+     * their new transformations and materials
+     */
+    void refitLeaves(int first,int last)
+    {
+      for (int i=first;i<last;i++)
+        {
+          int index = leafInstances[i];
+          if (index<0)
+            continue;
+          Instance& instance = instances[index];
+          instance.material = leaves[i].material;
+          instance.setTransform(leaves[i].transform * frames[index]);
+          switch (refs[index].kind)
+            {
+            case PRIMITIVE_SPHERE:
+              spheres.set(refs[index].slot,instance.inverseTransform);
+              break;
+            case PRIMITIVE_BOX:
+              boxes.set(refs[index].slot,instance.inverseTransform);
+              break;
+            case PRIMITIVE_CYLINDER:
+              cylinders.set(refs[index].slot,instance.inverseTransform);
+              break;
+            case PRIMITIVE_CONE:
+              cones.set(refs[index].slot,instance.inverseTransform);
+              break;
+            default:
+              break;
+            }
+          instanceBounds[index] = getCanonicalBounds(instance).transform(instance.transform);
+        }
+    }
+
+    /**
+     * Add an instance to the batch of its kind
+     * \return where the instance can be found
+     */
+    PrimitiveRef addPrimitive(const Instance& instance,int index)
+    {
+      switch (instance.kind)
+        {
+        case PRIMITIVE_SPHERE:
+          return PrimitiveRef(instance.kind,spheres.add(instance.inverseTransform));
+        case PRIMITIVE_BOX:
+          return PrimitiveRef(instance.kind,boxes.add(instance.inverseTransform));
+        case PRIMITIVE_CYLINDER:
+          return PrimitiveRef(instance.kind,cylinders.add(instance.inverseTransform));
+        case PRIMITIVE_CONE:
+          return PrimitiveRef(instance.kind,cones.add(instance.inverseTransform));
+        default:
+          return PrimitiveRef(PRIMITIVE_MESH,index);
+        }
+    }
+
+    /**
+     * The bounding box of an instance in its own coordinate system
+     */
+    static AABB getCanonicalBounds(const Instance& instance)
+    {
+      switch (instance.kind)
+        {
+        case PRIMITIVE_SPHERE:
+        case PRIMITIVE_BOX:
+          return AABB(glm::vec3(-1,-1,-1),glm::vec3(1,1,1));
+        case PRIMITIVE_CYLINDER:
+        case PRIMITIVE_CONE:
+          return AABB(glm::vec3(-1,0,-1),glm::vec3(1,1,1));
+        default:
+          return instance.mesh->getBounds();
+        }
+    }
+
+    /**
+     * Intersect a ray in the view coordinate system with one instance
+     * \param tMax lowered to the hit, if there is one closer than tMax
+     * \param hit receives the hit. Primitives other than meshes only fill in t
+     * \return true if the instance was hit closer than tMax
+     */
+    bool intersectInstance(int i,const glm::vec3& origin,const glm::vec3& dir,
+                           float tMin,float& tMax,TriangleHit& hit) const
+    {
+      const PrimitiveRef& ref = refs[i];
+      bool found;
+      float t;
+      switch (ref.kind)
+        {
+        case PRIMITIVE_SPHERE:
+          found = spheres.intersect(ref.slot,origin,dir,tMin,tMax,t);
+          break;
+        case PRIMITIVE_BOX:
+          found = boxes.intersect(ref.slot,origin,dir,tMin,tMax,t);
+          break;
+        case PRIMITIVE_CYLINDER:
+          found = cylinders.intersect(ref.slot,origin,dir,tMin,tMax,t);
+          break;
+        case PRIMITIVE_CONE:
+          found = cones.intersect(ref.slot,origin,dir,tMin,tMax,t);
+          break;
+        default:
+          {
+            //an affine transformation leaves the ray parameter unchanged
+            const glm::mat4& inverse = instances[i].inverseTransform;
+            return instances[i].mesh->intersect(glm::vec3(inverse * glm::vec4(origin,1.0f)),
+                                                glm::vec3(inverse * glm::vec4(dir,0.0f)),
+                                                tMin,tMax,hit);
+          }
+        }
+      TraceCounters::local().primitiveTests++;
+      if (!found)
+        return false;
+      hit = TriangleHit();
+      hit.t = t;
+      tMax = t;
+      return true;
+    }
+
+    /**
+     * Intersect the rays of a packet with an instance that is not a mesh
+     */
+    SimdMask intersectPrimitive(const PrimitiveRef& ref,const RayPacket& packet,
+                                const SimdMask& mask,SimdFloat& t) const
+    {
+      switch (ref.kind)
+        {
+        case PRIMITIVE_SPHERE:
+          return spheres.intersect(ref.slot,packet,mask,t);
+        case PRIMITIVE_BOX:
+          return boxes.intersect(ref.slot,packet,mask,t);
+        case PRIMITIVE_CYLINDER:
+          return cylinders.intersect(ref.slot,packet,mask,t);
+        case PRIMITIVE_CONE:
+          return cones.intersect(ref.slot,packet,mask,t);
+        default:
+          return SimdMask();
+        }
+    }
+
+    /**
+     * The hit record of a ray that hit an instance that is not a mesh. The
+     * normal and texture coordinates come from the canonical shape
+     */
+    HitRecord getPrimitiveHitRecord(const _3DRay& ray,int hitInstance,float t,
+                                    const RayDifferential *differential) const
+    {
+      const Instance& instance = instances[hitInstance];
+      glm::vec3 p = glm::vec3(instance.inverseTransform * (ray.pos + t * ray.dir));
+      glm::vec3 normal = glm::normalize(instance.normalTransform * getPrimitiveNormal(instance.kind,p));
+      HitRecord record(t,normal,&instance.material,hitInstance);
+      if (instance.texture==NULL)
+        return record;
+
+      glm::vec2 uv = getPrimitiveTexcoord(instance.kind,p);
+      if ((differential==NULL) || differential->isZero())
+        {
+          record.textureColor = glm::vec3(instance.texture->sample(uv));
+          return record;
+        }
+
+      glm::vec3 dPdx,dPdy;
+      differential->transfer(glm::vec3(ray.dir),t,normal,dPdx,dPdy);
+      glm::mat3 toCanonical = glm::mat3(instance.inverseTransform);
+      glm::vec2 duvdx = getPrimitiveTexcoord(instance.kind,p + toCanonical*dPdx) - uv;
+      glm::vec2 duvdy = getPrimitiveTexcoord(instance.kind,p + toCanonical*dPdy) - uv;
+      //the longitude wraps around
+      duvdx.x -= floor(duvdx.x+0.5f);
+      duvdy.x -= floor(duvdy.x+0.5f);
+      record.textureColor = glm::vec3(instance.texture->sample(uv,duvdx,duvdy));
+      return record;
+    }
+
+    void trace(RayPacket& packet,PacketHit& hits,bool anyHit) const
+    {
+      bvh.traversePacket(packet,[this,&hits,anyHit](int i,RayPacket& p,const SimdMask& mask)
+      {
+        if (refs[i].kind!=PRIMITIVE_MESH)
+          {
+            SimdFloat t;
+            SimdMask lanes = mask & p.active;
+            TraceCounters::local().primitiveTests += lanes.count();
+            SimdMask hit = intersectPrimitive(refs[i],p,lanes,t);
+            int bits = hit.bits();
+            if (bits==0)
+              return;
+            p.tMax = select(hit,t,p.tMax);
+            if (anyHit)
+              p.active = p.active.andNot(hit);
+            float ta[SIMD_WIDTH];
+            t.store(ta);
+            for (int lane=0;lane<SIMD_WIDTH;lane++)
+              {
+                if (!((bits>>lane)&1))
+                  continue;
+                hits.instance[lane] = i;
+                hits.hit[lane] = TriangleHit();
+                hits.hit[lane].t = ta[lane];
+              }
+            return;
+          }
+
+        RayPacket local = p.transformed(instances[i].inverseTransform);
+        local.active = mask & p.active;
+        SimdMask tested = local.active;
+        instances[i].mesh->intersect(local,i,hits,anyHit);
+        p.tMax = local.tMax;
+        //rays of an any-hit query that hit are no longer active
+        p.active = p.active.andNot(tested.andNot(local.active));
+      });
+    }
+  };
+}
+
+#endif
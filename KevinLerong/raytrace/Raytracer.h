@@ -0,0 +1,511 @@
+#ifndef _RAYTRACER_H_
+#define _RAYTRACER_H_
+
+#include "AdaptiveSampler.h"
+#include "Camera.h"
+#include "Framebuffer.h"
+#include "ReprojectionCache.h"
+#include "SIMD.h"
+#include "TileRenderer.h"
+#include "ThreadPool.h"
+#include "TileDependencies.h"
+#include "TraceContext.h"
+#include "TraceCounters.h"
+#include "sgraph/Scenegraph.h"
+#include <glm/glm.hpp>
+#include <atomic>
+#include <stack>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * Raytraces a scene graph into a framebuffer. This ties together compiling the
+ * scene graph for ray queries, generating the primary rays of the camera and
+ * tracing them tile by tile on a thread pool, either one ray at a time, as
+ * SIMD packets, or a whole tile at a time through the stages of a
+ * raytrace::WavefrontTracer. With anti-aliasing on, the pixels on edges are then
+ * supersampled by a raytrace::AdaptiveSampler.
+ *
+ * With dependency tracking on, every render also records what the rays of
+ * each tile depended on (see raytrace::TileDependencies). After the scene
+ * graph has changed, retrace() then traces again only the tiles that the
+ * change can have affected.
+ *
+ * With reprojection on, every render is also kept in a
+ * raytrace::ReprojectionCache, and reproject() makes the next frame of a
+ * moving camera from it, tracing only the pixels that cannot be reused.
+ *
+ * It is used both by the interactive view and by the command-line raytracer.
+ */
+  class Raytracer
+  {
+  protected:
+    util::ThreadPool& pool;
+    int tileSize;
+    bool packetTracing;
+    bool wavefront;
+    bool antialiasing;
+    AdaptiveSampler sampler;
+    const atomic<bool> *cancelFlag;
+    TileRenderer::TileListener tileListener;
+    bool trackDependencies;
+    TileDependencies dependencies;
+    //the last image before anti-aliasing, the pixels that were refined in it,
+    //and whether anti-aliasing was on
+    Framebuffer unrefined;
+    vector<char> refined;
+    bool refinedImage;
+    //the buffers of findEdges, kept from one render to the next
+    vector<int> edges,chosen;
+    vector<char> edge;
+    bool reprojecting;
+    ReprojectionCache cache;
+
+  public:
+    Raytracer(util::ThreadPool& pool)
+      :pool(pool),sampler(pool)
+    {
+      tileSize = 32;
+      packetTracing = true;
+      wavefront = false;
+      antialiasing = false;
+      cancelFlag = NULL;
+      trackDependencies = false;
+      refinedImage = false;
+      reprojecting = false;
+    }
+
+    void setTileSize(int size)
+    {
+      tileSize = size>0?size:1;
+    }
+
+    int getTileSize() const
+    {
+      return tileSize;
+    }
+
+    /**
+     * Choose whether primary rays are traced in SIMD packets (the default) or
+     * one at a time
+     */
+    void setPacketTracing(bool enabled)
+    {
+      packetTracing = enabled;
+    }
+
+    bool isPacketTracing() const
+    {
+      return packetTracing;
+    }
+
+    /**
+     * Choose whether the rays of each tile are traced together through the
+     * stages of a raytrace::WavefrontTracer, rather than a pixel (or a packet)
+     * at a time. This takes precedence over packet tracing. The tile size is
+     * then the number of rays per batch along each side
+     */
+    void setWavefront(bool enabled)
+    {
+      wavefront = enabled;
+    }
+
+    bool isWavefront() const
+    {
+      return wavefront;
+    }
+
+    /**
+     * Choose whether the pixels on edges are supersampled after the image has
+     * been traced with one ray per pixel
+     */
+    void setAntialiasing(bool enabled)
+    {
+      antialiasing = enabled;
+    }
+
+    bool isAntialiasing() const
+    {
+      return antialiasing;
+    }
+
+    /**
+     * The sampler used for anti-aliasing, e.g. to change its thresholds or
+     * number of samples
+     */
+    AdaptiveSampler& getSampler()
+    {
+      return sampler;
+    }
+
+    /**
+     * Set the flag that stops a render early, see TileRenderer::setCancelFlag
+     */
+    void setCancelFlag(const atomic<bool> *flag)
+    {
+      cancelFlag = flag;
+    }
+
+    /**
+     * Set the function told about every finished tile, see
+     * TileRenderer::setTileListener
+     */
+    void setTileListener(const TileRenderer::TileListener& listener)
+    {
+      tileListener = listener;
+    }
+
+    /**
+     * Choose whether renders record what the rays of every tile depended on,
+     * which retrace() needs. It is off by default, since recording makes
+     * secondary and shadow rays a little slower
+     */
+    void setDependencyTracking(bool enabled)
+    {
+      trackDependencies = enabled;
+    }
+
+    bool isDependencyTracking() const
+    {
+      return trackDependencies;
+    }
+
+    /**
+     * Choose whether renders are kept for reproject()
+     */
+    void setReprojection(bool enabled)
+    {
+      reprojecting = enabled;
+      if (!enabled)
+        cache.invalidate();
+    }
+
+    bool isReprojecting() const
+    {
+      return reprojecting;
+    }
+
+    /**
+     * The cache used by reproject(), e.g. to change how often pixels are
+     * refreshed
+     */
+    ReprojectionCache& getReprojectionCache()
+    {
+      return cache;
+    }
+
+    /**
+     * Compile the scene graph and render it into the framebuffer, which is
+     * resized to the camera's image
+     * \param scenegraph the scene graph to be rendered
+     * \param camera the camera generating the primary rays
+     * \param modelview the stack whose top is the world-to-view transformation
+     * \param fb the framebuffer to be written into
+     * \return the number of rays and time taken
+     */
+    RenderStats render(sgraph::Scenegraph *scenegraph,const Camera& camera,
+                       stack<glm::mat4>& modelview,Framebuffer& fb)
+    {
+      fb.resize(camera.getWidth(),camera.getHeight());
+      scenegraph->compileRayScene(modelview,&pool);
+      return trace(scenegraph,camera,modelview,fb);
+    }
+
+    /**
+     * Render a scene graph whose ray scene has already been compiled into a
+     * framebuffer of the camera's size. Nothing in the scene graph is
+     * modified, so this may run on another thread than the one that owns it
+     * \param scenegraph the compiled scene graph
+     * \param camera the camera generating the primary rays
+     * \param modelview the stack whose top is the world-to-view transformation
+     * \param fb the framebuffer to be written into
+     * \return the number of rays and time taken
+     */
+    RenderStats trace(sgraph::Scenegraph *scenegraph,const Camera& camera,
+                      stack<glm::mat4>& modelview,Framebuffer& fb)
+    {
+      if (trackDependencies)
+        dependencies.begin(scenegraph->getRayScene(),camera,tileSize);
+      return traceTiles(scenegraph,camera,modelview,fb,NULL);
+    }
+
+    /**
+     * Update the image last rendered into a framebuffer after its scene graph
+     * has changed (e.g. by INode::setAnimationTransform) and been compiled
+     * again. Only the tiles that the changed instances can have affected are
+     * traced again; the whole image is if the last render did not track
+     * dependencies or was cancelled, or if the change is not one of
+     * transformations or materials (see TileDependencies). The camera and
+     * every setting must be the same as for the last render.
+     * \param scenegraph the compiled scene graph
+     * \param camera the camera generating the primary rays
+     * \param modelview the stack whose top is the world-to-view transformation
+     * \param fb the framebuffer holding the last image
+     * \return the number of rays and time taken, and the number of tiles
+     * traced again
+     */
+    RenderStats retrace(sgraph::Scenegraph *scenegraph,const Camera& camera,
+                        stack<glm::mat4>& modelview,Framebuffer& fb)
+    {
+      vector<char> dirty;
+      if (!trackDependencies || (antialiasing!=refinedImage) ||
+          (fb.getWidth()!=camera.getWidth()) || (fb.getHeight()!=camera.getHeight()) ||
+          !dependencies.findDirtyTiles(scenegraph->getRayScene(),camera,tileSize,dirty))
+        return trace(scenegraph,camera,modelview,fb);
+
+      dependencies.retrace(scenegraph->getRayScene(),dirty);
+      return traceTiles(scenegraph,camera,modelview,fb,&dirty);
+    }
+
+    /**
+     * Render a new frame after the camera moved (or instances moved a
+     * little), reusing the pixels of the last frame rendered into the
+     * framebuffer where they can be (see ReprojectionCache). Only the other
+     * pixels are traced, one ray at a time and without anti-aliasing. The
+     * whole frame is traced if reprojection is off, or the last frame was
+     * cancelled or cannot be reused
+     * \param scenegraph the compiled scene graph
+     * \param camera the camera generating the primary rays
+     * \param modelview the stack whose top is the world-to-view transformation
+     * \param fb the framebuffer holding the last frame
+     * \return the number of rays and time taken
+     */
+    RenderStats reproject(sgraph::Scenegraph *scenegraph,const Camera& camera,
+                          stack<glm::mat4>& modelview,Framebuffer& fb)
+    {
+      const RayScene& scene = scenegraph->getRayScene();
+      glm::mat4 worldToView = modelview.top();
+      vector<char> pixels;
+      if (!reprojecting || !cache.reproject(scene,worldToView,camera,fb,pixels))
+        return trace(scenegraph,camera,modelview,fb);
+
+      //the frame is no longer one that retrace() can update
+      dependencies.finish(false);
+      if (tileListener)
+        tileListener(0,0,fb.getWidth(),fb.getHeight());
+
+      TileRenderer tiles(pool,tileSize);
+      tiles.setCancelFlag(cancelFlag);
+      tiles.setTileListener(tileListener);
+      tiles.setPixelMask(&pixels);
+      TraceCounters before = TraceStatistics::getTotal();
+      RenderStats stats = tiles.render(fb,[scenegraph,&camera,&worldToView,&fb](int x,int y)
+      {
+        float depth;
+        int object;
+        TraceContext& context = TraceContext::local(worldToView);
+        glm::vec3 color = scenegraph->raycast(camera.getRay(x,y),context,&depth,&object);
+        fb.setHit(x,y,depth,object);
+        return color;
+      });
+      if (stats.cancelled)
+        cache.invalidate();
+      else
+        cache.store(fb,scene,worldToView,camera,&pixels);
+      stats.raysPerDepth = TraceStatistics::getTotal().getRaysPerDepth(before);
+      return stats;
+    }
+
+  protected:
+    /**
+     * The rays of a wavefront tile and what they hit. Every thread keeps its
+     * own, so that a tile needs no memory of its own once the first tile of
+     * the thread has sized them
+     */
+    class WavefrontTile
+    {
+    public:
+      vector<_3DRay> rays;
+      vector<float> depths;
+      vector<int> objects;
+
+      /**
+       * The buffers of the calling thread, sized for n rays
+       */
+      static WavefrontTile& local(int n)
+      {
+        static thread_local WavefrontTile tile;
+        tile.rays.resize(n);
+        tile.depths.resize(n);
+        tile.objects.resize(n);
+        return tile;
+      }
+    };
+
+    /**
+     * Render the chosen tiles of the image, and anti-alias them
+     * \param tileMask one flag per tile, or NULL for all tiles
+     */
+    RenderStats traceTiles(sgraph::Scenegraph *scenegraph,const Camera& camera,
+                           stack<glm::mat4>& modelview,Framebuffer& fb,
+                           const vector<char> *tileMask)
+    {
+      TileRenderer tiles(pool,tileSize);
+      tiles.setCancelFlag(cancelFlag);
+      tiles.setTileListener(tileListener);
+      tiles.setTileMask(tileMask);
+      TileDependencies *recorder = trackDependencies?&dependencies:NULL;
+      TraceCounters before = TraceStatistics::getTotal();
+      //every ray starts from this on its thread's TraceContext
+      glm::mat4 worldToView = modelview.top();
+      RenderStats stats;
+      if (wavefront)
+        {
+          stats = tiles.renderTiles(fb,[scenegraph,&camera,&worldToView,&fb,recorder](int x,int y,int w,int h,glm::vec3 *colors)
+          {
+            WavefrontTile& tile = WavefrontTile::local(w*h);
+            vector<_3DRay>& rays = tile.rays;
+            vector<float>& depths = tile.depths;
+            vector<int>& objects = tile.objects;
+            for (int j=0;j<h;j++)
+              for (int i=0;i<w;i++)
+                rays[j*w+i] = camera.getRay(x+i,y+j);
+            TraceContext& context = TraceContext::local(worldToView);
+            if (recorder!=NULL)
+              context.record(recorder,recorder->getTile(x,y));
+            scenegraph->raycastWavefront(&rays[0],w*h,context,colors,&depths[0],&objects[0]);
+            for (int j=0;j<h;j++)
+              for (int i=0;i<w;i++)
+                fb.setHit(x+i,y+j,depths[j*w+i],objects[j*w+i]);
+          });
+        }
+      else if (!packetTracing)
+        {
+          stats = tiles.render(fb,[scenegraph,&camera,&worldToView,&fb,recorder](int x,int y)
+          {
+            float depth;
+            int object;
+            TraceContext& context = TraceContext::local(worldToView);
+            if (recorder!=NULL)
+              context.record(recorder,recorder->getTile(x,y));
+            glm::vec3 color = scenegraph->raycast(camera.getRay(x,y),context,&depth,&object);
+            fb.setHit(x,y,depth,object);
+            return color;
+          });
+        }
+      else
+        {
+          int blockWidth = (SIMD_WIDTH>=8)?4:2;
+          int blockHeight = SIMD_WIDTH/blockWidth;
+          stats = tiles.renderBlocks(fb,blockWidth,blockHeight,
+                                     [scenegraph,&camera,&worldToView,&fb,recorder](int x,int y,int w,int h,glm::vec3 *colors)
+          {
+            //the rays through this block of pixels, traced together
+            _3DRay rays[SIMD_WIDTH];
+            float depths[SIMD_WIDTH];
+            int objects[SIMD_WIDTH];
+            for (int j=0;j<h;j++)
+              for (int i=0;i<w;i++)
+                rays[j*w+i] = camera.getRay(x+i,y+j);
+            TraceContext& context = TraceContext::local(worldToView);
+            if (recorder!=NULL)
+              context.record(recorder,recorder->getTile(x,y));
+            scenegraph->raycastPacket(rays,w*h,context,colors,depths,objects);
+            for (int j=0;j<h;j++)
+              for (int i=0;i<w;i++)
+                fb.setHit(x+i,y+j,depths[j*w+i],objects[j*w+i]);
+          });
+        }
+
+      if (antialiasing && !stats.cancelled)
+        {
+          sampler.setTileSize(tileSize);
+          sampler.setCancelFlag(cancelFlag);
+          sampler.setTileListener(tileListener);
+          const vector<int>& pixels = findEdges(fb,tileMask);
+          RenderStats more = sampler.refine(fb,pixels,
+                                            [&camera](float x,float y)
+          {
+            return camera.getRay(x,y);
+          },
+                                            [scenegraph,&worldToView,recorder](int x,int y,const _3DRay *rays,int n,glm::vec3 *colors)
+          {
+            TraceContext& context = TraceContext::local(worldToView);
+            if (recorder!=NULL)
+              context.record(recorder,recorder->getTile(x,y));
+            scenegraph->raycastPacket(rays,n,context,colors);
+          });
+          stats.rays += more.rays;
+          stats.seconds += more.seconds;
+          stats.cancelled = more.cancelled;
+          stats.refinedPixels = pixels.size();
+        }
+      refinedImage = antialiasing;
+      if (trackDependencies)
+        dependencies.finish(!stats.cancelled);
+      if (reprojecting && !stats.cancelled)
+        cache.store(fb,scenegraph->getRayScene(),worldToView,camera,NULL);
+      else
+        cache.invalidate();
+      stats.raysPerDepth = TraceStatistics::getTotal().getRaysPerDepth(before);
+      return stats;
+    }
+
+    /**
+     * Find the edge pixels to be anti-aliased. Edges are found in the image as
+     * it was before any pixel was refined, which is kept for that. When only
+     * some tiles were traced, these are the edges in those tiles and the
+     * pixels elsewhere that have just become edges, and the pixels elsewhere
+     * that are no longer edges get their unrefined color back
+     * \param fb the image, just traced
+     * \param tileMask the tiles that were traced, or NULL for all
+     * \return the pixels to be refined, grouped by tile, until the next call
+     */
+    const vector<int>& findEdges(Framebuffer& fb,const vector<char> *tileMask)
+    {
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+      int tilesPerRow = (w+tileSize-1)/tileSize;
+      if (tileMask==NULL)
+        {
+          unrefined = fb;
+          refined.assign((size_t)w*h,0);
+        }
+      else
+        {
+          for (int y=0;y<h;y++)
+            for (int x=0;x<w;x++)
+              if ((*tileMask)[(y/tileSize)*tilesPerRow+x/tileSize])
+                {
+                  unrefined.setColor(x,y,fb.getColor(x,y));
+                  unrefined.setHit(x,y,fb.getDepth(x,y),fb.getObject(x,y));
+                }
+        }
+
+      sampler.findEdges(unrefined,edges);
+      edge.assign((size_t)w*h,0);
+      for (unsigned int i=0;i<edges.size();i++)
+        edge[edges[i]] = 1;
+      if (tileMask==NULL)
+        {
+          refined.swap(edge);
+          return edges;
+        }
+
+      chosen.clear();
+      for (unsigned int i=0;i<edges.size();i++)
+        {
+          int p = edges[i];
+          if ((*tileMask)[((p/w)/tileSize)*tilesPerRow+(p%w)/tileSize] || !refined[p])
+            chosen.push_back(p);
+        }
+      for (int y=0;y<h;y++)
+        for (int x=0;x<w;x++)
+          {
+            size_t p = (size_t)y*w+x;
+            if (refined[p] && !edge[p] && !(*tileMask)[(y/tileSize)*tilesPerRow+x/tileSize])
+              {
+                fb.setColor(x,y,unrefined.getColor(x,y));
+                if (tileListener)
+                  tileListener(x,y,1,1);
+              }
+          }
+      refined.swap(edge);
+      return chosen;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef _REPROJECTIONCACHE_H_
+#define _REPROJECTIONCACHE_H_
+
+#include "AABB.h"
+#include "Camera.h"
+#include "Framebuffer.h"
+#include "Instance.h"
+#include "RayScene.h"
+#include "SceneLight.h"
+#include "TileDependencies.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * Keeps the pixels of the last raytraced frame so that the next frame, seen
+ * from a camera that has moved a little, can reuse most of them instead of
+ * tracing every pixel again.
+ *
+ * Every pixel remembers the point its primary ray hit, in the coordinate
+ * system of the instance it hit, with its color. Pixels that show the
+ * background remember the direction of their ray in world coordinates
+ * instead. For a new frame, these points are carried through the instance
+ * transformations (which include the new camera) onto the new image, nearest
+ * first. Points do not land on pixels one to one, so single pixels that
+ * nothing landed on, amid pixels that all show the same thing at about the
+ * same depth, are filled from their neighbours. A pixel of the new image is
+ * then traced again if:
+ * - nothing landed on it (it was uncovered),
+ * - a neighbour is such a hole, or it is much farther than its nearest
+ *   neighbour (a surface hidden in the last frame may belong there),
+ * - it is within the image of an instance that has moved since, or whose
+ *   material or texture changed, whose old points are not reused,
+ * - or its color is older than 1/refreshFraction frames. Colors carry view
+ *   dependent shading (highlights, reflections, shadows of moved instances)
+ *   along as they were, so this bounds how long they can stay wrong. Pixels
+ *   are refreshed at staggered times, so that roughly refreshFraction of them
+ *   are traced in every frame.
+ *
+ * If the lights, the set of instances or the camera's image change, the
+ * whole frame is traced again.
+ */
+  class ReprojectionCache
+  {
+  public:
+    /**
+     * The fraction of the reused pixels that is traced again in every frame
+     */
+    float refreshFraction;
+    /**
+     * A pixel farther than its nearest neighbour by more than this fraction
+     * of the neighbour's depth is traced again
+     */
+    float depthThreshold;
+
+  protected:
+    /**
+     * What a pixel saw: its color and the point its ray hit, in the
+     * coordinate system of the instance hit, or the direction of the ray in
+     * world coordinates if it hit nothing (instance -1), and the frame its
+     * color was traced in
+     */
+    class Sample
+    {
+    public:
+      glm::vec3 color;
+      glm::vec3 position;
+      int instance;
+      int birth;
+    };
+
+    Camera camera;
+    vector<Sample> samples;
+    //the instances and lights the samples were seen with, in world coordinates
+    vector<sgraph::INode *> nodes;
+    vector<glm::mat4> objectToWorld;
+    vector<const MipTexture *> textures;
+    vector<util::Material> materials;
+    vector<glm::vec4> lightPositions;
+    vector<glm::vec3> lightDirections;
+    //the colors and cutoffs of the lights; their view coordinates are not used
+    vector<SceneLight> lights;
+    int frame;
+    bool valid;
+
+  public:
+    ReprojectionCache()
+      :camera(0,0)
+    {
+      refreshFraction = 0.1f;
+      depthThreshold = 0.05f;
+      frame = 0;
+      valid = false;
+    }
+
+    /**
+     * Forget the last frame, so that the next one is traced in full
+     */
+    void invalidate()
+    {
+      valid = false;
+    }
+
+    /**
+     * Make a new frame from the last one, and find the pixels that must be
+     * traced in it
+     * \param scene the scene compiled for the new frame
+     * \param worldToView the world-to-view transformation of the new frame
+     * \param camera the camera of the new frame
+     * \param fb receives the pixels that could be reused, with their hits
+     * \param trace receives one flag per pixel, row by row, telling whether
+     * the pixel must be traced
+     * \return false if nothing can be reused and the whole frame must be
+     * traced, in which case fb is left alone
+     */
+    bool reproject(const RayScene& scene,const glm::mat4& worldToView,const Camera& camera,
+                   Framebuffer& fb,vector<char>& trace)
+    {
+      const vector<Instance>& instances = scene.getInstances();
+      glm::mat4 viewToWorld = glm::inverse(worldToView);
+      if (!valid || !(camera==this->camera) || (fb.getWidth()!=camera.getWidth()) ||
+          (fb.getHeight()!=camera.getHeight()) || (instances.size()!=nodes.size()) ||
+          !sameLights(scene.getLights(),viewToWorld))
+        return false;
+
+      //the points of instances that moved, or now look different, are not reused
+      vector<char> still(instances.size());
+      for (unsigned int i=0;i<instances.size();i++)
+        {
+          still[i] = (instances[i].node==nodes[i]) &&
+              (instances[i].texture==textures[i]) &&
+              TileDependencies::sameMaterial(instances[i].material,materials[i]) &&
+              isClose(viewToWorld*instances[i].transform,objectToWorld[i]);
+        }
+
+      frame++;
+      int w = camera.getWidth();
+      int h = camera.getHeight();
+      float f = camera.getFocalLength();
+      glm::mat3 worldToViewDir(worldToView);
+      fb.clear();
+      vector<Sample> moved((size_t)w*h);
+      vector<char> covered((size_t)w*h,0);
+      for (unsigned int p=0;p<samples.size();p++)
+        {
+          const Sample& s = samples[p];
+          glm::vec3 q;
+          if (s.instance<0)
+            q = worldToViewDir*s.position;
+          else if (still[s.instance])
+            q = glm::vec3(instances[s.instance].transform*glm::vec4(s.position,1.0f));
+          else
+            continue;
+          if (q.z>=0)
+            continue;
+          //the ray through pixel (x,y) has the direction (x-w/2,y-h/2,-f)
+          int x = (int)floor(f*q.x/-q.z+w/2+0.5f);
+          int y = (int)floor(f*q.y/-q.z+h/2+0.5f);
+          if ((x<0) || (x>=w) || (y<0) || (y>=h))
+            continue;
+          size_t to = (size_t)y*w+x;
+          if (s.instance<0)
+            {
+              //the background is behind everything
+              if (covered[to])
+                continue;
+              fb.setColor(x,y,s.color);
+            }
+          else
+            {
+              float t = -q.z/f;
+              if (t>=fb.getDepth(x,y))
+                continue;
+              fb.setColor(x,y,s.color);
+              fb.setHit(x,y,t,s.instance);
+            }
+          covered[to] = 1;
+          moved[to] = s;
+        }
+      samples.swap(moved);
+      fillCracks(instances,camera,viewToWorld,fb,covered);
+
+      int period = getRefreshPeriod();
+      trace.assign((size_t)w*h,0);
+      for (int y=0;y<h;y++)
+        for (int x=0;x<w;x++)
+          {
+            size_t p = (size_t)y*w+x;
+            if (!covered[p] || (frame-samples[p].birth>=period))
+              {
+                trace[p] = 1;
+                continue;
+              }
+            float depth = fb.getDepth(x,y);
+            for (int j=max(y-1,0);(j<=min(y+1,h-1)) && !trace[p];j++)
+              for (int i=max(x-1,0);(i<=min(x+1,w-1)) && !trace[p];i++)
+                {
+                  if (!covered[(size_t)j*w+i] ||
+                      (depth>(1.0f+depthThreshold)*fb.getDepth(i,j)))
+                    trace[p] = 1;
+                }
+          }
+
+      //where moved instances are now, anything may show up
+      for (unsigned int i=0;i<instances.size();i++)
+        {
+          if (still[i])
+            continue;
+          int x0,y0,x1,y1;
+          camera.getPixelBounds(scene.getInstanceBounds(i),x0,y0,x1,y1);
+          for (int y=y0;y<y1;y++)
+            for (int x=x0;x<x1;x++)
+              trace[(size_t)y*w+x] = 1;
+        }
+      return true;
+    }
+
+    /**
+     * Remember a finished frame for the next one
+     * \param fb the frame, with the hits of its pixels
+     * \param scene the scene it was traced from
+     * \param worldToView the world-to-view transformation of the frame
+     * \param camera the camera of the frame
+     * \param traced the pixels that were traced, as made by reproject(), or
+     * NULL if all were
+     */
+    void store(const Framebuffer& fb,const RayScene& scene,const glm::mat4& worldToView,
+               const Camera& camera,const vector<char> *traced)
+    {
+      const vector<Instance>& instances = scene.getInstances();
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+      int period = getRefreshPeriod();
+      glm::mat4 viewToWorld = glm::inverse(worldToView);
+      samples.resize((size_t)w*h);
+      for (int y=0;y<h;y++)
+        for (int x=0;x<w;x++)
+          {
+            size_t p = (size_t)y*w+x;
+            Sample& s = samples[p];
+            if ((traced!=NULL) && !(*traced)[p])
+              continue;
+            s.color = fb.getColor(x,y);
+            s.instance = fb.getObject(x,y);
+            glm::vec3 dir = glm::vec3(camera.getRay(x,y).dir);
+            if ((s.instance<0) || (s.instance>=(int)instances.size()))
+              {
+                s.instance = -1;
+                s.position = glm::mat3(viewToWorld)*dir;
+              }
+            else
+              {
+                glm::vec3 hit = fb.getDepth(x,y)*dir;
+                s.position = glm::vec3(instances[s.instance].inverseTransform*glm::vec4(hit,1.0f));
+              }
+            //pretend pixels are of different ages, so that they are not all
+            //refreshed in the same frame
+            s.birth = frame-(int)((p*2654435761u)%(unsigned int)period);
+          }
+
+      nodes.clear();
+      objectToWorld.clear();
+      textures.clear();
+      materials.clear();
+      for (unsigned int i=0;i<instances.size();i++)
+        {
+          nodes.push_back(instances[i].node);
+          objectToWorld.push_back(viewToWorld*instances[i].transform);
+          textures.push_back(instances[i].texture);
+          materials.push_back(instances[i].material);
+        }
+      lightPositions.clear();
+      lightDirections.clear();
+      lights = scene.getLights();
+      for (unsigned int i=0;i<lights.size();i++)
+        {
+          lightPositions.push_back(viewToWorld*lights[i].position);
+          lightDirections.push_back(glm::mat3(viewToWorld)*lights[i].spotDirection);
+        }
+      this->camera = camera;
+      valid = true;
+    }
+
+  protected:
+    /**
+     * Fill the pixels nothing landed on that are surrounded by pixels showing
+     * the same instance (or the background) at about the same depth. They are
+     * given the average of their neighbours, and a point of their own on the
+     * surface, so that the gaps do not grow from frame to frame
+     */
+    void fillCracks(const vector<Instance>& instances,const Camera& camera,
+                    const glm::mat4& viewToWorld,Framebuffer& fb,vector<char>& covered)
+    {
+      int w = camera.getWidth();
+      int h = camera.getHeight();
+      for (int y=1;y<h-1;y++)
+        for (int x=1;x<w-1;x++)
+          {
+            size_t p = (size_t)y*w+x;
+            if (covered[p])
+              continue;
+            int count = 0;
+            int instance = -2;
+            int birth = frame;
+            float nearest = numeric_limits<float>::infinity();
+            float farthest = 0;
+            glm::vec3 color(0,0,0);
+            bool same = true;
+            for (int j=y-1;(j<=y+1) && same;j++)
+              for (int i=x-1;i<=x+1;i++)
+                {
+                  size_t q = (size_t)j*w+i;
+                  //only what landed counts, so that fills do not spread
+                  if (covered[q]!=1)
+                    continue;
+                  if ((instance!=-2) && (samples[q].instance!=instance))
+                    {
+                      same = false;
+                      break;
+                    }
+                  instance = samples[q].instance;
+                  birth = min(birth,samples[q].birth);
+                  nearest = min(nearest,fb.getDepth(i,j));
+                  farthest = max(farthest,fb.getDepth(i,j));
+                  color = color + fb.getColor(i,j);
+                  count++;
+                }
+            if (!same || (count<6) ||
+                ((instance>=0) && (farthest>(1.0f+depthThreshold)*nearest)))
+              continue;
+
+            Sample& s = samples[p];
+            glm::vec3 dir = glm::vec3(camera.getRay(x,y).dir);
+            s.color = color/(float)count;
+            s.instance = instance;
+            s.birth = birth;
+            if (instance<0)
+              s.position = glm::mat3(viewToWorld)*dir;
+            else
+              {
+                float t = 0.5f*(nearest+farthest);
+                s.position = glm::vec3(instances[instance].inverseTransform*glm::vec4(t*dir,1.0f));
+                fb.setHit(x,y,t,instance);
+              }
+            fb.setColor(x,y,s.color);
+            covered[p] = 2;
+          }
+    }
+
+    int getRefreshPeriod() const
+    {
+      if (refreshFraction<=0)
+        return 1<<30;
+      return max(1,(int)ceil(1.0f/refreshFraction));
+    }
+
+    /**
+     * Returns true if the lights are where they were in the last frame, with
+     * the same colors and cutoffs. Positions are compared in world
+     * coordinates, so that the comparison is not fooled by the camera
+     */
+    bool sameLights(const vector<SceneLight>& now,const glm::mat4& viewToWorld) const
+    {
+      if (now.size()!=lights.size())
+        return false;
+      for (unsigned int i=0;i<now.size();i++)
+        {
+          if ((now[i].ambient!=lights[i].ambient) ||
+              (now[i].diffuse!=lights[i].diffuse) ||
+              (now[i].specular!=lights[i].specular) ||
+              (now[i].cosSpotCutoff!=lights[i].cosSpotCutoff) ||
+              (now[i].spot!=lights[i].spot))
+            return false;
+          if (!isClose(viewToWorld*now[i].position,lightPositions[i]) ||
+              !isClose(glm::vec4(glm::mat3(viewToWorld)*now[i].spotDirection,0.0f),
+                       glm::vec4(lightDirections[i],0.0f)))
+            return false;
+        }
+      return true;
+    }
+
+    /**
+     * Compare matrices that went through different chains of floating point
+     * operations
+     */
+    static bool isClose(const glm::mat4& a,const glm::mat4& b)
+    {
+      for (int i=0;i<4;i++)
+        {
+          if (!isClose(a[i],b[i]))
+            return false;
+        }
+      return true;
+    }
+
+    static bool isClose(const glm::vec4& a,const glm::vec4& b)
+    {
+      for (int i=0;i<4;i++)
+        {
+          if (fabs(a[i]-b[i])>1e-4f*(1.0f+fabs(b[i])))
+            return false;
+        }
+      return true;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <glm/glm.hpp>
+#include <cmath>
+
+/*
+ * Small wrappers around SIMD registers for tracing packets of rays. The
+ * instruction set is the one GLM detected for this build (GLM_ARCH, see
+ * glm/detail/setup.hpp): 8 lanes with AVX, 4 lanes with SSE2, and a plain
+ * 4-lane scalar fallback otherwise (or when GLM_FORCE_PURE is defined).
+ */
+
+#if (GLM_ARCH & GLM_ARCH_AVX)
+#include <immintrin.h>
+#define RAYTRACE_SIMD_AVX
+#define RAYTRACE_SIMD_WIDTH 8
+#elif (GLM_ARCH & GLM_ARCH_SSE2)
+#include <emmintrin.h>
+#define RAYTRACE_SIMD_SSE
+#define RAYTRACE_SIMD_WIDTH 4
+#else
+#define RAYTRACE_SIMD_WIDTH 4
+#endif
+
+namespace raytrace
+{
+  const int SIMD_WIDTH = RAYTRACE_SIMD_WIDTH;
+
+  /**
+   * One boolean per lane, as produced by comparing two raytrace::SimdFloat
+   */
+  class SimdMask
+  {
+  public:
+#if defined(RAYTRACE_SIMD_AVX)
+    __m256 m;
+    SimdMask() { m = _mm256_setzero_ps(); }
+    SimdMask(__m256 m) { this->m = m; }
+    int bits() const { return _mm256_movemask_ps(m); }
+    SimdMask operator&(const SimdMask& o) const { return SimdMask(_mm256_and_ps(m,o.m)); }
+    SimdMask operator|(const SimdMask& o) const { return SimdMask(_mm256_or_ps(m,o.m)); }
+    /** this and not o */
+    SimdMask andNot(const SimdMask& o) const { return SimdMask(_mm256_andnot_ps(o.m,m)); }
+#elif defined(RAYTRACE_SIMD_SSE)
+    __m128 m;
+    SimdMask() { m = _mm_setzero_ps(); }
+    SimdMask(__m128 m) { this->m = m; }
+    int bits() const { return _mm_movemask_ps(m); }
+    SimdMask operator&(const SimdMask& o) const { return SimdMask(_mm_and_ps(m,o.m)); }
+    SimdMask operator|(const SimdMask& o) const { return SimdMask(_mm_or_ps(m,o.m)); }
+    SimdMask andNot(const SimdMask& o) const { return SimdMask(_mm_andnot_ps(o.m,m)); }
+#else
+    int m;
+    SimdMask() { m = 0; }
+    explicit SimdMask(int bits) { m = bits; }
+    int bits() const { return m; }
+    SimdMask operator&(const SimdMask& o) const { return SimdMask(m & o.m); }
+    SimdMask operator|(const SimdMask& o) const { return SimdMask(m | o.m); }
+    SimdMask andNot(const SimdMask& o) const { return SimdMask(m & ~o.m); }
+#endif
+
+    /**
+     * A mask with the first n lanes set
+     */
+    static SimdMask firstLanes(int n);
+
+    bool any() const { return bits()!=0; }
+    bool none() const { return bits()==0; }
+    bool all() const { return bits()==(1<<SIMD_WIDTH)-1; }
+    bool get(int lane) const { return (bits()>>lane)&1; }
+    /** the number of lanes set */
+    int count() const
+    {
+      int b = bits(),n = 0;
+      for (;b!=0;b &= b-1)
+        n++;
+      return n;
+    }
+  };
+
+  /**
+   * SIMD_WIDTH floats, operated on in parallel
+   */
+  class SimdFloat
+  {
+  public:
+#if defined(RAYTRACE_SIMD_AVX)
+    __m256 v;
+    SimdFloat() { v = _mm256_setzero_ps(); }
+    SimdFloat(__m256 v) { this->v = v; }
+    SimdFloat(float f) { v = _mm256_set1_ps(f); }
+    static SimdFloat load(const float *p) { return SimdFloat(_mm256_loadu_ps(p)); }
+    void store(float *p) const { _mm256_storeu_ps(p,v); }
+    SimdFloat operator+(const SimdFloat& o) const { return SimdFloat(_mm256_add_ps(v,o.v)); }
+    SimdFloat operator-(const SimdFloat& o) const { return SimdFloat(_mm256_sub_ps(v,o.v)); }
+    SimdFloat operator*(const SimdFloat& o) const { return SimdFloat(_mm256_mul_ps(v,o.v)); }
+    SimdFloat operator/(const SimdFloat& o) const { return SimdFloat(_mm256_div_ps(v,o.v)); }
+    SimdMask operator<(const SimdFloat& o) const { return SimdMask(_mm256_cmp_ps(v,o.v,_CMP_LT_OQ)); }
+    SimdMask operator<=(const SimdFloat& o) const { return SimdMask(_mm256_cmp_ps(v,o.v,_CMP_LE_OQ)); }
+    SimdMask operator>(const SimdFloat& o) const { return SimdMask(_mm256_cmp_ps(v,o.v,_CMP_GT_OQ)); }
+    SimdMask operator>=(const SimdFloat& o) const { return SimdMask(_mm256_cmp_ps(v,o.v,_CMP_GE_OQ)); }
+    friend SimdFloat min(const SimdFloat& a,const SimdFloat& b) { return SimdFloat(_mm256_min_ps(a.v,b.v)); }
+    friend SimdFloat max(const SimdFloat& a,const SimdFloat& b) { return SimdFloat(_mm256_max_ps(a.v,b.v)); }
+    friend SimdFloat abs(const SimdFloat& a) { return SimdFloat(_mm256_andnot_ps(_mm256_set1_ps(-0.0f),a.v)); }
+    friend SimdFloat sqrt(const SimdFloat& a) { return SimdFloat(_mm256_sqrt_ps(a.v)); }
+    /** a where the mask is set, b elsewhere */
+    friend SimdFloat select(const SimdMask& m,const SimdFloat& a,const SimdFloat& b) { return SimdFloat(_mm256_blendv_ps(b.v,a.v,m.m)); }
+#elif defined(RAYTRACE_SIMD_SSE)
+    __m128 v;
+    SimdFloat() { v = _mm_setzero_ps(); }
+    SimdFloat(__m128 v) { this->v = v; }
+    SimdFloat(float f) { v = _mm_set1_ps(f); }
+    static SimdFloat load(const float *p) { return SimdFloat(_mm_loadu_ps(p)); }
+    void store(float *p) const { _mm_storeu_ps(p,v); }
+    SimdFloat operator+(const SimdFloat& o) const { return SimdFloat(_mm_add_ps(v,o.v)); }
+    SimdFloat operator-(const SimdFloat& o) const { return SimdFloat(_mm_sub_ps(v,o.v)); }
+    SimdFloat operator*(const SimdFloat& o) const { return SimdFloat(_mm_mul_ps(v,o.v)); }
+    SimdFloat operator/(const SimdFloat& o) const { return SimdFloat(_mm_div_ps(v,o.v)); }
+    SimdMask operator<(const SimdFloat& o) const { return SimdMask(_mm_cmplt_ps(v,o.v)); }
+    SimdMask operator<=(const SimdFloat& o) const { return SimdMask(_mm_cmple_ps(v,o.v)); }
+    SimdMask operator>(const SimdFloat& o) const { return SimdMask(_mm_cmpgt_ps(v,o.v)); }
+    SimdMask operator>=(const SimdFloat& o) const { return SimdMask(_mm_cmpge_ps(v,o.v)); }
+    friend SimdFloat min(const SimdFloat& a,const SimdFloat& b) { return SimdFloat(_mm_min_ps(a.v,b.v)); }
+    friend SimdFloat max(const SimdFloat& a,const SimdFloat& b) { return SimdFloat(_mm_max_ps(a.v,b.v)); }
+    friend SimdFloat abs(const SimdFloat& a) { return SimdFloat(_mm_andnot_ps(_mm_set1_ps(-0.0f),a.v)); }
+    friend SimdFloat sqrt(const SimdFloat& a) { return SimdFloat(_mm_sqrt_ps(a.v)); }
+    friend SimdFloat select(const SimdMask& m,const SimdFloat& a,const SimdFloat& b) { return SimdFloat(_mm_or_ps(_mm_and_ps(m.m,a.v),_mm_andnot_ps(m.m,b.v))); }
+#else
+    float v[SIMD_WIDTH];
+    SimdFloat() { for (int i=0;i<SIMD_WIDTH;i++) v[i] = 0; }
+    SimdFloat(float f) { for (int i=0;i<SIMD_WIDTH;i++) v[i] = f; }
+    static SimdFloat load(const float *p) { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = p[i]; return r; }
+    void store(float *p) const { for (int i=0;i<SIMD_WIDTH;i++) p[i] = v[i]; }
+    SimdFloat operator+(const SimdFloat& o) const { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = v[i]+o.v[i]; return r; }
+    SimdFloat operator-(const SimdFloat& o) const { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = v[i]-o.v[i]; return r; }
+    SimdFloat operator*(const SimdFloat& o) const { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = v[i]*o.v[i]; return r; }
+    SimdFloat operator/(const SimdFloat& o) const { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = v[i]/o.v[i]; return r; }
+    SimdMask operator<(const SimdFloat& o) const { int b = 0; for (int i=0;i<SIMD_WIDTH;i++) b |= (v[i]<o.v[i])<<i; return SimdMask(b); }
+    SimdMask operator<=(const SimdFloat& o) const { int b = 0; for (int i=0;i<SIMD_WIDTH;i++) b |= (v[i]<=o.v[i])<<i; return SimdMask(b); }
+    SimdMask operator>(const SimdFloat& o) const { int b = 0; for (int i=0;i<SIMD_WIDTH;i++) b |= (v[i]>o.v[i])<<i; return SimdMask(b); }
+    SimdMask operator>=(const SimdFloat& o) const { int b = 0; for (int i=0;i<SIMD_WIDTH;i++) b |= (v[i]>=o.v[i])<<i; return SimdMask(b); }
+    friend SimdFloat min(const SimdFloat& a,const SimdFloat& b) { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = a.v[i]<b.v[i]?a.v[i]:b.v[i]; return r; }
+    friend SimdFloat max(const SimdFloat& a,const SimdFloat& b) { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = a.v[i]>b.v[i]?a.v[i]:b.v[i]; return r; }
+    friend SimdFloat abs(const SimdFloat& a) { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = a.v[i]<0?-a.v[i]:a.v[i]; return r; }
+    friend SimdFloat sqrt(const SimdFloat& a) { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = std::sqrt(a.v[i]); return r; }
+    friend SimdFloat select(const SimdMask& m,const SimdFloat& a,const SimdFloat& b) { SimdFloat r; for (int i=0;i<SIMD_WIDTH;i++) r.v[i] = m.get(i)?a.v[i]:b.v[i]; return r; }
+#endif
+
+    /**
+     * The value in one lane. This is slow, and meant for reading results out
+     */
+    float get(int lane) const
+    {
+      float f[SIMD_WIDTH];
+      store(f);
+      return f[lane];
+    }
+  };
+
+  inline SimdMask SimdMask::firstLanes(int n)
+  {
+    float lanes[SIMD_WIDTH];
+    for (int i=0;i<SIMD_WIDTH;i++)
+      lanes[i] = (float)i;
+    return SimdFloat::load(lanes)<SimdFloat((float)n);
+  }
+
+  /**
+   * Three SimdFloat, i.e. SIMD_WIDTH 3D vectors in structure-of-arrays form
+   */
+  class SimdVec3
+  {
+  public:
+    SimdFloat x,y,z;
+
+    SimdVec3()
+    {
+    }
+
+    SimdVec3(const SimdFloat& x,const SimdFloat& y,const SimdFloat& z)
+    {
+      this->x = x;
+      this->y = y;
+      this->z = z;
+    }
+
+    /**
+     * The same vector in every lane
+     */
+    SimdVec3(const glm::vec3& v)
+    {
+      x = SimdFloat(v.x);
+      y = SimdFloat(v.y);
+      z = SimdFloat(v.z);
+    }
+
+    SimdVec3 operator+(const SimdVec3& o) const { return SimdVec3(x+o.x,y+o.y,z+o.z); }
+    SimdVec3 operator-(const SimdVec3& o) const { return SimdVec3(x-o.x,y-o.y,z-o.z); }
+    SimdVec3 operator*(const SimdFloat& f) const { return SimdVec3(x*f,y*f,z*f); }
+
+    glm::vec3 get(int lane) const
+    {
+      return glm::vec3(x.get(lane),y.get(lane),z.get(lane));
+    }
+  };
+
+  inline SimdFloat dot(const SimdVec3& a,const SimdVec3& b)
+  {
+    return a.x*b.x + a.y*b.y + a.z*b.z;
+  }
+
+  inline SimdVec3 cross(const SimdVec3& a,const SimdVec3& b)
+  {
+    return SimdVec3(a.y*b.z - a.z*b.y,
+                    a.z*b.x - a.x*b.z,
+                    a.x*b.y - a.y*b.x);
+  }
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef _SCENELIGHT_H_
+#define _SCENELIGHT_H_
+
+#include "Light.h"
+#include "Material.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * A light of the scene graph in the view coordinate system, with everything
+ * that does not depend on the point being shaded worked out once when the
+ * scene is compiled: the normalized spot direction and the cosine of the spot
+ * cutoff, exactly as GLScenegraphRenderer hands them to the shader.
+ */
+  class SceneLight
+  {
+  public:
+    glm::vec3 ambient,diffuse,specular;
+    //w is 0 for a directional light, 1 for a point light
+    glm::vec4 position;
+    glm::vec3 spotDirection;
+    float cosSpotCutoff;
+    //false if the light has no spot direction, and so shines everywhere
+    bool spot;
+
+    SceneLight(const util::Light& light)
+    {
+      ambient = light.getAmbient();
+      diffuse = light.getDiffuse();
+      specular = light.getSpecular();
+      position = light.getPosition();
+      cosSpotCutoff = cos(glm::radians(light.getSpotCutoff()));
+
+      glm::vec3 dir = glm::vec3(light.getSpotDirection());
+      spot = glm::dot(dir,dir)>0;
+      spotDirection = spot?glm::normalize(dir):dir;
+    }
+
+    bool isDirectional() const
+    {
+      return position.w==0;
+    }
+
+    /**
+     * The normalized direction from a point towards this light
+     */
+    glm::vec3 getDirectionFrom(const glm::vec3& point) const
+    {
+      if (isDirectional())
+        return glm::normalize(-glm::vec3(position));
+      return glm::normalize(glm::vec3(position)-point);
+    }
+
+    /**
+     * Returns true if a point in the given direction from this light lies
+     * outside its spot cone, and so gets no light at all from it
+     * \param lightVec the normalized direction from the point to the light
+     */
+    bool isOutsideSpot(const glm::vec3& lightVec) const
+    {
+      return spot && (glm::dot(-lightVec,spotDirection)<cosSpotCutoff);
+    }
+
+    /**
+     * The Phong color this light gives a point, in two parts: the ambient
+     * part, which the point gets even in shadow, and the diffuse and specular
+     * part, which it gets only if nothing blocks the light
+     * \param material the material at the point
+     * \param position the point
+     * \param normal the normal at the point
+     * \param viewVec the normalized direction from the point to the eye
+     * \param ambientColor set to the ambient part
+     * \param litColor set to the diffuse and specular part
+     * \return false if the point does not face the light (or is outside its
+     * spot cone), so that it gets only the ambient part and no shadow ray is
+     * needed
+     */
+    bool getColor(const util::Material& material,const glm::vec3& position,
+                  const glm::vec3& normal,const glm::vec3& viewVec,
+                  glm::vec3& ambientColor,glm::vec3& litColor) const
+    {
+      litColor = glm::vec3(0,0,0);
+      glm::vec3 lightVec = getDirectionFrom(position);
+      if (isOutsideSpot(lightVec))
+        {
+          ambientColor = glm::vec3(0,0,0);
+          return false;
+        }
+      ambientColor = glm::vec3(material.getAmbient())*ambient;
+
+      float nDotL = glm::dot(normal,lightVec);
+      if (nDotL<=0)
+        return false;
+
+      glm::vec3 reflectVec = glm::normalize(glm::reflect(-lightVec,normal));
+      float rDotV = max(glm::dot(reflectVec,viewVec),0.0f);
+      litColor = glm::vec3(material.getDiffuse())*diffuse*nDotL;
+      litColor += glm::vec3(material.getSpecular())*specular*pow(rDotV,material.getShininess());
+      return true;
+    }
+
+    /**
+     * The shadow ray from a point towards this light
+     * \param origin where the ray starts, a little off the surface
+     * \param dir set to the direction of the ray, which reaches a point light
+     * at ray parameter 1
+     * \param far set to the ray parameter of the light, infinity for a
+     * directional light
+     */
+    void getShadowRay(const glm::vec3& origin,glm::vec3& dir,float& far) const
+    {
+      if (isDirectional())
+        {
+          dir = getDirectionFrom(origin);
+          far = numeric_limits<float>::infinity();
+          return;
+        }
+      dir = glm::vec3(position)-origin;
+      far = 1.0f;
+    }
+  };
+}
+
+#endif
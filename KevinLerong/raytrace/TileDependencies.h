@@ -0,0 +1,406 @@
+#ifndef _TILEDEPENDENCIES_H_
+#define _TILEDEPENDENCIES_H_
+
+#include "AABB.h"
+#include "Camera.h"
+#include "Instance.h"
+#include "RayScene.h"
+#include "SceneLight.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * What the rays of every tile of a raytraced image depended on, so that when
+ * the scene changes (e.g. a transformation is animated) only the tiles the
+ * change can have affected are traced again.
+ *
+ * Every tile keeps two sets of bits:
+ * - the instances its rays hit, including whatever blocked its shadow rays,
+ * - and the cells of a coarse grid over the scene that its reflected,
+ *   refracted and shadow rays passed through.
+ * An instance that changed makes a tile dirty if the tile hit it, if one of
+ * its secondary rays passed through a cell that the instance overlaps before
+ * or after the change, or if the instance covers the tile on the screen
+ * before or after the change. The last test stands in for the primary rays,
+ * which therefore only record what they hit.
+ *
+ * Bits are set with atomic operations, so any number of threads may record
+ * rays of the same tile at once.
+ *
+ * The state of the instances and lights the tiles were recorded from is kept
+ * too. Changes that cannot be narrowed down to tiles (another camera,
+ * instances added or removed, lights that changed, an instance moving out of
+ * the grid) need the whole image to be traced again.
+ */
+  class TileDependencies
+  {
+  public:
+    /**
+     * The number of cells of the grid along each axis
+     */
+    static const int GRID = 16;
+
+  protected:
+    static const int CELLS = GRID*GRID*GRID;
+    static const int CELL_WORDS = CELLS/64;
+
+    int tileSize,tilesX,tilesY;
+    //a tile is CELL_WORDS words of cells followed by its instances
+    int wordsPerTile;
+    size_t wordCount;
+    unique_ptr<atomic<uint64_t>[]> bits;
+    AABB grid;
+    glm::vec3 cellSize;
+
+    //what the tiles were recorded from
+    Camera camera;
+    vector<Instance> instances;
+    vector<AABB> bounds;
+    vector<SceneLight> lights;
+    //false until every tile has been recorded
+    bool complete;
+
+  public:
+    TileDependencies()
+      :camera(0,0)
+    {
+      tileSize = 1;
+      tilesX = tilesY = 0;
+      wordsPerTile = CELL_WORDS;
+      wordCount = 0;
+      complete = false;
+    }
+
+    /**
+     * Start recording an image of a compiled scene from scratch
+     * \param scene the scene the image is traced from
+     * \param camera the camera generating its primary rays
+     * \param tileSize the size of the square tiles
+     */
+    void begin(const RayScene& scene,const Camera& camera,int tileSize)
+    {
+      this->tileSize = max(tileSize,1);
+      tilesX = (camera.getWidth()+this->tileSize-1)/this->tileSize;
+      tilesY = (camera.getHeight()+this->tileSize-1)/this->tileSize;
+      wordsPerTile = CELL_WORDS+(int)(scene.getInstances().size()+63)/64;
+
+      size_t n = (size_t)tilesX*tilesY*wordsPerTile;
+      if (n!=wordCount)
+        {
+          bits.reset(new atomic<uint64_t>[n]);
+          wordCount = n;
+        }
+      for (size_t i=0;i<n;i++)
+        bits[i].store(0,memory_order_relaxed);
+
+      //a little larger than the scene, so that nothing lies on its border
+      grid = scene.getBounds();
+      if (!grid.isEmpty())
+        {
+          glm::vec3 margin = 0.01f*grid.getExtent()+glm::vec3(1e-4f);
+          grid = AABB(grid.min-margin,grid.max+margin);
+          cellSize = grid.getExtent()/(float)GRID;
+        }
+
+      this->camera = camera;
+      remember(scene);
+      complete = false;
+    }
+
+    /**
+     * Find the tiles that must be traced again after the scene changed
+     * \param scene the scene compiled again after the change
+     * \param camera the camera of the new image
+     * \param tileSize the size of the tiles of the new image
+     * \param dirty receives one flag per tile, row by row from the bottom
+     * \return false if the whole image must be traced again instead
+     */
+    bool findDirtyTiles(const RayScene& scene,const Camera& camera,int tileSize,
+                        vector<char>& dirty) const
+    {
+      const vector<Instance>& now = scene.getInstances();
+      if (!complete || !(camera==this->camera) || (tileSize!=this->tileSize) ||
+          (now.size()!=instances.size()) || !sameLights(scene.getLights(),lights))
+        return false;
+
+      dirty.assign(getTileCount(),0);
+      vector<int> changed;
+      uint64_t cells[CELL_WORDS] = {0};
+      for (unsigned int i=0;i<now.size();i++)
+        {
+          const Instance& before = instances[i];
+          const Instance& after = now[i];
+          if ((before.node!=after.node) || (before.mesh!=after.mesh) ||
+              (before.kind!=after.kind))
+            return false;
+          if ((before.transform==after.transform) && (before.texture==after.texture) &&
+              sameMaterial(before.material,after.material))
+            continue;
+
+          const AABB& box = scene.getInstanceBounds(i);
+          if (!contains(box))
+            return false;
+          changed.push_back(i);
+          markCells(bounds[i],cells);
+          markCells(box,cells);
+          markPixels(bounds[i],dirty);
+          markPixels(box,dirty);
+        }
+      if (changed.empty())
+        return true;
+
+      for (int tile=0;tile<getTileCount();tile++)
+        {
+          if (dirty[tile])
+            continue;
+          const atomic<uint64_t> *words = &bits[(size_t)tile*wordsPerTile];
+          for (int w=0;(w<CELL_WORDS) && !dirty[tile];w++)
+            {
+              if (words[w].load(memory_order_relaxed) & cells[w])
+                dirty[tile] = 1;
+            }
+          for (unsigned int c=0;(c<changed.size()) && !dirty[tile];c++)
+            {
+              if (isSet(tile,CELLS+changed[c]))
+                dirty[tile] = 1;
+            }
+        }
+      return true;
+    }
+
+    /**
+     * Forget what the given tiles depended on, before they are traced again
+     * from the scene as it is now
+     * \param scene the scene the tiles are traced from
+     * \param dirty one flag per tile, as made by findDirtyTiles
+     */
+    void retrace(const RayScene& scene,const vector<char>& dirty)
+    {
+      for (int tile=0;tile<getTileCount();tile++)
+        {
+          if (!dirty[tile])
+            continue;
+          for (int w=0;w<wordsPerTile;w++)
+            bits[(size_t)tile*wordsPerTile+w].store(0,memory_order_relaxed);
+        }
+      remember(scene);
+      complete = false;
+    }
+
+    /**
+     * Say whether every tile was recorded, i.e. the render was not cancelled.
+     * Until a recording is complete, findDirtyTiles asks for a whole image
+     */
+    void finish(bool complete)
+    {
+      this->complete = complete;
+    }
+
+    int getTileCount() const
+    {
+      return tilesX*tilesY;
+    }
+
+    /**
+     * The tile that pixel (x,y) lies in
+     */
+    int getTile(int x,int y) const
+    {
+      return (y/tileSize)*tilesX+x/tileSize;
+    }
+
+    /**
+     * Returns true if two lists of lights light a scene the same way
+     */
+    static bool sameLights(const vector<SceneLight>& a,const vector<SceneLight>& b)
+    {
+      if (a.size()!=b.size())
+        return false;
+      for (unsigned int i=0;i<a.size();i++)
+        {
+          if ((a[i].position!=b[i].position) ||
+              (a[i].spotDirection!=b[i].spotDirection) ||
+              (a[i].cosSpotCutoff!=b[i].cosSpotCutoff) ||
+              (a[i].ambient!=b[i].ambient) ||
+              (a[i].diffuse!=b[i].diffuse) ||
+              (a[i].specular!=b[i].specular))
+            return false;
+        }
+      return true;
+    }
+
+    /**
+     * Returns true if two materials shade a point the same way
+     */
+    static bool sameMaterial(const util::Material& a,const util::Material& b)
+    {
+      return (a.getAmbient()==b.getAmbient()) && (a.getDiffuse()==b.getDiffuse()) &&
+          (a.getSpecular()==b.getSpecular()) && (a.getShininess()==b.getShininess()) &&
+          (a.getAbsorption()==b.getAbsorption()) && (a.getReflection()==b.getReflection()) &&
+          (a.getTransparency()==b.getTransparency()) &&
+          (a.getRefractiveIndex()==b.getRefractiveIndex());
+    }
+
+    /**
+     * Record that a ray of a tile hit an instance
+     * \param instance the instance, or -1 if the ray hit nothing
+     */
+    void addInstance(int tile,int instance)
+    {
+      if (instance>=0)
+        set(tile,CELLS+instance);
+    }
+
+    /**
+     * Record that a secondary ray of a tile went through the scene, and what
+     * it hit
+     * \param origin the start of the ray in the view coordinate system
+     * \param dir the direction of the ray in the view coordinate system
+     * \param tMin the ray parameter where the ray starts to matter
+     * \param tMax the ray parameter where it stops mattering, which may be
+     * infinity
+     * \param instance the instance the ray hit, or -1
+     */
+    void addRay(int tile,const glm::vec3& origin,const glm::vec3& dir,
+                float tMin,float tMax,int instance)
+    {
+      addInstance(tile,instance);
+      if (grid.isEmpty())
+        return;
+
+      //only the part of the ray inside the grid passes through cells
+      glm::vec3 invDir = 1.0f/dir;
+      glm::vec3 t0 = (grid.min-origin)*invDir;
+      glm::vec3 t1 = (grid.max-origin)*invDir;
+      glm::vec3 tNear = glm::min(t0,t1);
+      glm::vec3 tFar = glm::max(t0,t1);
+      float enter = std::max(std::max(tNear.x,tNear.y),std::max(tNear.z,tMin));
+      float exit = std::min(std::min(tFar.x,tFar.y),std::min(tFar.z,tMax));
+      if (!(enter<=exit))
+        return;
+
+      //walk the cells along the ray (Amanatides and Woo)
+      float inf = numeric_limits<float>::infinity();
+      glm::vec3 start = origin+enter*dir;
+      int cell[3],step[3];
+      float tNext[3],tDelta[3];
+      for (int a=0;a<3;a++)
+        {
+          cell[a] = min(max((int)floor((start[a]-grid.min[a])/cellSize[a]),0),GRID-1);
+          if (dir[a]>0)
+            {
+              step[a] = 1;
+              tNext[a] = (grid.min[a]+(cell[a]+1)*cellSize[a]-origin[a])*invDir[a];
+              tDelta[a] = cellSize[a]*invDir[a];
+            }
+          else if (dir[a]<0)
+            {
+              step[a] = -1;
+              tNext[a] = (grid.min[a]+cell[a]*cellSize[a]-origin[a])*invDir[a];
+              tDelta[a] = -cellSize[a]*invDir[a];
+            }
+          else
+            {
+              step[a] = 0;
+              tNext[a] = inf;
+              tDelta[a] = inf;
+            }
+        }
+      while (true)
+        {
+          set(tile,(cell[2]*GRID+cell[1])*GRID+cell[0]);
+          int a = (tNext[0]<tNext[1])?((tNext[0]<tNext[2])?0:2):((tNext[1]<tNext[2])?1:2);
+          if (tNext[a]>exit)
+            break;
+          cell[a] += step[a];
+          if ((cell[a]<0) || (cell[a]>=GRID))
+            break;
+          tNext[a] += tDelta[a];
+        }
+    }
+
+  protected:
+    void set(int tile,int bit)
+    {
+      atomic<uint64_t>& word = bits[(size_t)tile*wordsPerTile+(bit>>6)];
+      uint64_t mask = (uint64_t)1<<(bit&63);
+      //most bits are set by the first few rays of a tile
+      if (!(word.load(memory_order_relaxed) & mask))
+        word.fetch_or(mask,memory_order_relaxed);
+    }
+
+    bool isSet(int tile,int bit) const
+    {
+      const atomic<uint64_t>& word = bits[(size_t)tile*wordsPerTile+(bit>>6)];
+      return (word.load(memory_order_relaxed)>>(bit&63)) & 1;
+    }
+
+    void remember(const RayScene& scene)
+    {
+      instances = scene.getInstances();
+      bounds.clear();
+      for (unsigned int i=0;i<instances.size();i++)
+        bounds.push_back(scene.getInstanceBounds(i));
+      lights = scene.getLights();
+    }
+
+    /**
+     * Returns true if a box lies inside the grid
+     */
+    bool contains(const AABB& box) const
+    {
+      return !grid.isEmpty() && !box.isEmpty() &&
+          glm::all(glm::greaterThanEqual(box.min,grid.min)) &&
+          glm::all(glm::lessThanEqual(box.max,grid.max));
+    }
+
+    /**
+     * Set the bits of the cells that a box overlaps. The box is grown by a
+     * sliver so that rays running along the border of two cells, which may
+     * have been recorded in either, are caught
+     */
+    void markCells(const AABB& box,uint64_t *cells) const
+    {
+      if (box.isEmpty() || grid.isEmpty())
+        return;
+      glm::vec3 margin = 1e-3f*cellSize;
+      glm::ivec3 low = glm::ivec3(glm::floor((box.min-margin-grid.min)/cellSize));
+      glm::ivec3 high = glm::ivec3(glm::floor((box.max+margin-grid.min)/cellSize));
+      low = glm::clamp(low,glm::ivec3(0),glm::ivec3(GRID-1));
+      high = glm::clamp(high,glm::ivec3(0),glm::ivec3(GRID-1));
+      for (int z=low.z;z<=high.z;z++)
+        for (int y=low.y;y<=high.y;y++)
+          for (int x=low.x;x<=high.x;x++)
+            {
+              int bit = (z*GRID+y)*GRID+x;
+              cells[bit>>6] |= (uint64_t)1<<(bit&63);
+            }
+    }
+
+    /**
+     * Set the flags of the tiles whose primary rays may see a box
+     */
+    void markPixels(const AABB& box,vector<char>& dirty) const
+    {
+      int x0,y0,x1,y1;
+      camera.getPixelBounds(box,x0,y0,x1,y1);
+      if ((x0>=x1) || (y0>=y1))
+        return;
+      for (int ty=y0/tileSize;ty<=(y1-1)/tileSize;ty++)
+        for (int tx=x0/tileSize;tx<=(x1-1)/tileSize;tx++)
+          dirty[ty*tilesX+tx] = 1;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,416 @@
+#ifndef _TILERENDERER_H_
+#define _TILERENDERER_H_
+
+#include "Framebuffer.h"
+#include "ThreadPool.h"
+#include "TraceCounters.h"
+#include <glm/glm.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+   * Statistics about one call to raytrace::TileRenderer::render
+   */
+  class RenderStats
+  {
+  public:
+    RenderStats()
+    {
+      rays = 0;
+      seconds = 0;
+      threads = 0;
+      tiles = 0;
+      cancelled = false;
+      refinedPixels = 0;
+    }
+
+    long long rays;
+    double seconds;
+    unsigned int threads;
+    int tiles;
+    //whether the render was stopped before every tile was done
+    bool cancelled;
+    //the rays traced at every depth, starting with the primary rays, if the
+    //renderer counts them
+    vector<long long> raysPerDepth;
+    //the pixels that were supersampled by anti-aliasing
+    int refinedPixels;
+
+    double getRaysPerSecond() const
+    {
+      if (seconds<=0)
+        return 0;
+      return rays/seconds;
+    }
+
+    /**
+     * Print how many rays were traced at every depth, one line per depth
+     */
+    void printRaysPerDepth() const
+    {
+      for (unsigned int i=0;i<raysPerDepth.size();i++)
+        {
+          printf("  depth %u: %lld rays\n",i,raysPerDepth[i]);
+        }
+    }
+  };
+
+  /**
+ * Renders an image by cutting it into square tiles and handing each tile to a
+ * util::ThreadPool as a separate job. Work stealing in the pool takes care of
+ * balancing tiles that are more expensive than others (e.g. ones that cover
+ * a lot of geometry).
+ *
+ * The actual color of a pixel is computed by a function supplied by the caller,
+ * which must be safe to call from several threads at once.
+ *
+ * A render may be watched while it runs by a listener that is told about every
+ * tile as soon as it is written, and stopped early through a cancel flag that
+ * tiles check before and while they are traced.
+ */
+  class TileRenderer
+  {
+  public:
+    typedef function<void(int x,int y,int width,int height)> TileListener;
+    //the largest block renderBlocks() accepts; its colors live on the stack
+    static const int MAX_BLOCK_PIXELS = 64;
+
+  protected:
+    util::ThreadPool& pool;
+    int tileSize;
+    const atomic<bool> *cancelFlag;
+    TileListener tileListener;
+    const vector<char> *tileMask;
+    const vector<char> *pixelMask;
+
+  public:
+    TileRenderer(util::ThreadPool& pool,int tileSize=32)
+      :pool(pool)
+    {
+      setTileSize(tileSize);
+      cancelFlag = NULL;
+      tileMask = NULL;
+      pixelMask = NULL;
+    }
+
+    /**
+     * Set the flag that stops a render when it becomes true. Tiles that have
+     * not started are skipped, and tiles in progress stop after the current
+     * row. Pass NULL for renders that cannot be cancelled
+     */
+    void setCancelFlag(const atomic<bool> *flag)
+    {
+      cancelFlag = flag;
+    }
+
+    /**
+     * Set a function (int x,int y,int width,int height) that is called on the
+     * worker thread right after the pixels of a tile have been written. Tiles
+     * that were cancelled part way are not reported
+     */
+    void setTileListener(const TileListener& listener)
+    {
+      tileListener = listener;
+    }
+
+    /**
+     * Choose which tiles are rendered, e.g. to update only part of an image.
+     * The pixels of the other tiles are left alone
+     * \param mask one flag per tile, row by row starting at the bottom, or
+     * NULL to render every tile
+     */
+    void setTileMask(const vector<char> *mask)
+    {
+      tileMask = mask;
+    }
+
+    /**
+     * Choose which pixels render() traces, e.g. the few of an image that could
+     * not be reused from the last one. The other pixels are left alone, and
+     * tiles with none of the chosen pixels are skipped
+     * \param mask one flag per pixel, row by row starting at the bottom, or
+     * NULL to trace every pixel
+     */
+    void setPixelMask(const vector<char> *mask)
+    {
+      pixelMask = mask;
+    }
+
+    void setTileSize(int size)
+    {
+      tileSize = size>0?size:1;
+    }
+
+    int getTileSize() const
+    {
+      return tileSize;
+    }
+
+    /**
+     * Render every pixel of the framebuffer (or of the tiles chosen by
+     * setTileMask), and block until all tiles are done.
+     * \param fb the framebuffer to be written into
+     * \param pixelColor a function (int x,int y)->glm::vec3 that traces the
+     * primary ray through pixel (x,y)
+     * \return the number of rays and time taken
+     */
+    template <class PixelFunction>
+    RenderStats render(Framebuffer& fb,PixelFunction pixelColor)
+    {
+      RenderStats stats;
+      atomic<long long> rays(0);
+      util::ThreadPool::Batch jobs;
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+      long long pixels = 0;
+      for (int ty=0;ty<h;ty+=tileSize)
+        {
+          for (int tx=0;tx<w;tx+=tileSize)
+            {
+              if (!isChosen(tx,ty,w))
+                continue;
+              int x1 = min(tx+tileSize,w);
+              int y1 = min(ty+tileSize,h);
+              int chosen = countChosen(tx,ty,x1,y1,w);
+              if (chosen==0)
+                continue;
+              pixels += chosen;
+              pool.submit(jobs,[this,&fb,&pixelColor,&rays,tx,ty,x1,y1,w]()
+              {
+                TraceCounters& counters = TraceCounters::local();
+                StageTimer timer(STAGE_TILES,counters);
+                counters.tiles++;
+                for (int y=ty;y<y1;y++)
+                  {
+                    if (isCancelled())
+                      return;
+                    int traced = 0;
+                    for (int x=tx;x<x1;x++)
+                      {
+                        if ((pixelMask!=NULL) && !(*pixelMask)[(size_t)y*w+x])
+                          continue;
+                        fb.setColor(x,y,pixelColor(x,y));
+                        traced++;
+                      }
+                    rays += traced;
+                  }
+                tileDone(tx,ty,x1,y1);
+              });
+              stats.tiles++;
+            }
+        }
+      pool.wait(jobs);
+
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      stats.seconds = elapsed.count();
+      stats.rays = rays;
+      stats.threads = pool.getThreadCount();
+      stats.cancelled = stats.rays<pixels;
+      return stats;
+    }
+
+    /**
+     * Render every pixel of the framebuffer a small block at a time, e.g. so
+     * that the rays through a block can be traced together as one packet. Blocks
+     * at the right and top edges of a tile may be smaller than requested. As
+     * with render(), only the tiles chosen by setTileMask are rendered.
+     * \param fb the framebuffer to be written into
+     * \param blockWidth the width of a block in pixels
+     * \param blockHeight the height of a block in pixels
+     * \param blockColors a function (int x,int y,int w,int h,glm::vec3 *colors)
+     * that traces the w*h pixels whose bottom-left is (x,y) and writes their
+     * colors row by row
+     * \return the number of rays and time taken
+     * \throws runtime_error if a block has more than MAX_BLOCK_PIXELS pixels
+     */
+    template <class BlockFunction>
+    RenderStats renderBlocks(Framebuffer& fb,int blockWidth,int blockHeight,BlockFunction blockColors)
+    {
+      if (blockWidth*blockHeight>MAX_BLOCK_PIXELS)
+        throw runtime_error("Block too large to render");
+      RenderStats stats;
+      atomic<long long> rays(0);
+      util::ThreadPool::Batch jobs;
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+      long long pixels = 0;
+      for (int ty=0;ty<h;ty+=tileSize)
+        {
+          for (int tx=0;tx<w;tx+=tileSize)
+            {
+              if (!isChosen(tx,ty,w))
+                continue;
+              int x1 = min(tx+tileSize,w);
+              int y1 = min(ty+tileSize,h);
+              pixels += (long long)(x1-tx)*(y1-ty);
+              pool.submit(jobs,[this,&fb,&blockColors,&rays,blockWidth,blockHeight,tx,ty,x1,y1]()
+              {
+                TraceCounters& counters = TraceCounters::local();
+                StageTimer timer(STAGE_TILES,counters);
+                counters.tiles++;
+                glm::vec3 colors[MAX_BLOCK_PIXELS];
+                for (int by=ty;by<y1;by+=blockHeight)
+                  {
+                    if (isCancelled())
+                      return;
+                    for (int bx=tx;bx<x1;bx+=blockWidth)
+                      {
+                        int bw = min(blockWidth,x1-bx);
+                        int bh = min(blockHeight,y1-by);
+                        blockColors(bx,by,bw,bh,colors);
+                        for (int y=0;y<bh;y++)
+                          {
+                            for (int x=0;x<bw;x++)
+                              {
+                                fb.setColor(bx+x,by+y,colors[y*bw+x]);
+                              }
+                          }
+                      }
+                    rays += (long long)(x1-tx)*min(blockHeight,y1-by);
+                  }
+                tileDone(tx,ty,x1,y1);
+              });
+              stats.tiles++;
+            }
+        }
+      pool.wait(jobs);
+
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      stats.seconds = elapsed.count();
+      stats.rays = rays;
+      stats.threads = pool.getThreadCount();
+      stats.cancelled = stats.rays<pixels;
+      return stats;
+    }
+
+    /**
+     * Render every pixel of the framebuffer a whole tile at a time, e.g. so
+     * that all the rays of a tile can go through a pipeline of stages
+     * together. As with render(), only the tiles chosen by setTileMask are
+     * rendered. A tile is only cancelled before it starts
+     * \param fb the framebuffer to be written into
+     * \param tileColors a function (int x,int y,int w,int h,glm::vec3 *colors)
+     * that traces the w*h pixels of the tile whose bottom-left is (x,y) and
+     * writes their colors row by row
+     * \return the number of rays and time taken
+     */
+    template <class TileFunction>
+    RenderStats renderTiles(Framebuffer& fb,TileFunction tileColors)
+    {
+      RenderStats stats;
+      atomic<long long> rays(0);
+      util::ThreadPool::Batch jobs;
+      int w = fb.getWidth();
+      int h = fb.getHeight();
+
+      chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+      long long pixels = 0;
+      for (int ty=0;ty<h;ty+=tileSize)
+        {
+          for (int tx=0;tx<w;tx+=tileSize)
+            {
+              if (!isChosen(tx,ty,w))
+                continue;
+              int x1 = min(tx+tileSize,w);
+              int y1 = min(ty+tileSize,h);
+              pixels += (long long)(x1-tx)*(y1-ty);
+              pool.submit(jobs,[this,&fb,&tileColors,&rays,tx,ty,x1,y1]()
+              {
+                if (isCancelled())
+                  return;
+                TraceCounters& counters = TraceCounters::local();
+                StageTimer timer(STAGE_TILES,counters);
+                counters.tiles++;
+                int tw = x1-tx;
+                int th = y1-ty;
+                vector<glm::vec3>& colors = getTileColors();
+                colors.resize((size_t)tw*th);
+                tileColors(tx,ty,tw,th,&colors[0]);
+                for (int y=0;y<th;y++)
+                  {
+                    for (int x=0;x<tw;x++)
+                      {
+                        fb.setColor(tx+x,ty+y,colors[y*tw+x]);
+                      }
+                  }
+                rays += (long long)tw*th;
+                tileDone(tx,ty,x1,y1);
+              });
+              stats.tiles++;
+            }
+        }
+      pool.wait(jobs);
+
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      stats.seconds = elapsed.count();
+      stats.rays = rays;
+      stats.threads = pool.getThreadCount();
+      stats.cancelled = stats.rays<pixels;
+      return stats;
+    }
+
+  protected:
+    /**
+     * The colors of a tile being rendered by renderTiles. Every thread keeps
+     * its own, so that a tile needs no memory of its own
+     */
+    static vector<glm::vec3>& getTileColors()
+    {
+      static thread_local vector<glm::vec3> colors;
+      return colors;
+    }
+
+    bool isCancelled() const
+    {
+      return (cancelFlag!=NULL) && (*cancelFlag);
+    }
+
+    /**
+     * Returns true if the tile whose bottom-left pixel is (x,y) is to be rendered
+     */
+    bool isChosen(int x,int y,int w) const
+    {
+      if (tileMask==NULL)
+        return true;
+      int tilesPerRow = (w+tileSize-1)/tileSize;
+      return (*tileMask)[(y/tileSize)*tilesPerRow+x/tileSize]!=0;
+    }
+
+    /**
+     * The number of pixels of a tile chosen by the pixel mask
+     */
+    int countChosen(int x0,int y0,int x1,int y1,int w) const
+    {
+      if (pixelMask==NULL)
+        return (x1-x0)*(y1-y0);
+      int count = 0;
+      for (int y=y0;y<y1;y++)
+        for (int x=x0;x<x1;x++)
+          count += (*pixelMask)[(size_t)y*w+x]!=0;
+      return count;
+    }
+
+    void tileDone(int x0,int y0,int x1,int y1)
+    {
+      if (tileListener)
+        tileListener(x0,y0,x1-x0,y1-y0);
+    }
+  };
+}
+
+#endif
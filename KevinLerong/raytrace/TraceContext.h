@@ -0,0 +1,132 @@
+#ifndef _TRACECONTEXT_H_
+#define _TRACECONTEXT_H_
+
+#include <glm/glm.hpp>
+#include <stdexcept>
+using namespace std;
+
+namespace raytrace
+{
+  class TileDependencies;
+
+  /**
+ * A stack of matrices of fixed capacity, kept in place. Unlike
+ * stack<glm::mat4>, pushing and popping never allocates memory.
+ */
+  class MatrixStack
+  {
+  public:
+    static const int CAPACITY = 64;
+
+  protected:
+    glm::mat4 matrices[CAPACITY];
+    int count;
+
+  public:
+    MatrixStack()
+    {
+      reset(glm::mat4(1.0f));
+    }
+
+    /**
+     * Empty the stack, leaving only the given matrix on it
+     */
+    void reset(const glm::mat4& m)
+    {
+      matrices[0] = m;
+      count = 1;
+    }
+
+    /**
+     * Push a copy of the top matrix
+     * \throws runtime_error if the stack is full, i.e. the scene graph is
+     * deeper than CAPACITY
+     */
+    void push() throw(runtime_error)
+    {
+      if (count>=CAPACITY)
+        throw runtime_error("Scene graph too deep for raytracing");
+      matrices[count] = matrices[count-1];
+      count++;
+    }
+
+    void pop()
+    {
+      if (count>1)
+        count--;
+    }
+
+    glm::mat4& top()
+    {
+      return matrices[count-1];
+    }
+
+    const glm::mat4& top() const
+    {
+      return matrices[count-1];
+    }
+
+    int size() const
+    {
+      return count;
+    }
+  };
+
+  /**
+ * Everything a thread needs to trace rays that would otherwise be allocated per
+ * ray. Each thread has its own context (see local()), which it reuses for all
+ * the rays it traces, so that tracing a ray allocates nothing on the heap.
+ *
+ * The context is aligned to a cache line so that the contexts of different
+ * threads never share one.
+ */
+  class alignas(64) TraceContext
+  {
+  public:
+    /**
+     * The modelview matrices while a ray walks down the scene graph. Its
+     * bottom is the world-to-view transformation
+     */
+    MatrixStack modelview;
+
+    /**
+     * Where the rays record what they depend on, or NULL if they record
+     * nothing, and the tile of the image they belong to
+     */
+    TileDependencies *dependencies;
+    int tile;
+
+    TraceContext()
+    {
+      dependencies = NULL;
+      tile = -1;
+    }
+
+    /**
+     * The context of the calling thread, made ready for a ray that records
+     * nothing
+     * \param worldToView the world-to-view transformation, left alone on the
+     * matrix stack
+     */
+    static TraceContext& local(const glm::mat4& worldToView)
+    {
+      static thread_local TraceContext context;
+      context.modelview.reset(worldToView);
+      context.dependencies = NULL;
+      return context;
+    }
+
+    /**
+     * Make the rays traced next record what they depend on
+     * \param dependencies where to record, or NULL
+     * \param tile the tile the rays belong to
+     */
+    void record(TileDependencies *dependencies,int tile)
+    {
+      this->dependencies = dependencies;
+      this->tile = tile;
+    }
+  };
+}
+
+#endif
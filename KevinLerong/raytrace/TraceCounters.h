@@ -0,0 +1,449 @@
+#ifndef _TRACECOUNTERS_H_
+#define _TRACECOUNTERS_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+   * The kinds of rays that raytrace::TraceCounters tells apart
+   */
+  enum RayKind
+  {
+    RAY_PRIMARY,
+    RAY_SECONDARY,
+    RAY_SHADOW,
+    RAY_KINDS
+  };
+
+  /**
+   * The stages of a render that raytrace::TraceCounters times. The wavefront
+   * stages are parts of the tiles of a wavefront render
+   */
+  enum TraceStage
+  {
+    STAGE_COMPILE,
+    STAGE_TILES,
+    STAGE_ANTIALIAS,
+    STAGE_TRAVERSAL,
+    STAGE_SHADING,
+    STAGE_SHADOWS,
+    TRACE_STAGES
+  };
+
+  /**
+   * The deepest bounce that raytrace::TraceCounters counts the rays of, and so
+   * the deepest any ray is ever traced (see raytrace::TraceSettings::MAX_DEPTH)
+   */
+  static const int MAX_COUNTED_DEPTH = 16;
+
+  /**
+ * Counts what the rays traced by one thread did: how many rays of every kind
+ * it traced and how many of them hit something (for shadow rays, were
+ * blocked), how many primary and secondary rays it traced at every depth, how
+ * many hierarchy nodes they visited and how many triangles and
+ * other primitives they were tested against, and how long the thread spent
+ * in every stage of a render.
+ *
+ * Every thread counts into its own counters (see local()), so nothing is
+ * shared or atomic while rays are traced, and the hot loops count into local
+ * variables and add them up once per ray or packet. The counters of all
+ * threads are gathered by raytrace::TraceStatistics once the threads are
+ * idle.
+ *
+ * The counters are plain numbers that start at zero without a constructor,
+ * as thread_local objects with trivial construction cost nothing to reach.
+ * The only check on the way to them is whether the thread has enrolled its
+ * counters with raytrace::TraceStatistics yet, a predictable branch.
+ */
+  class TraceCounters
+  {
+  public:
+    long long rays[RAY_KINDS];
+    long long hits[RAY_KINDS];
+    //the primary and secondary rays at every depth, 0 for primary rays
+    long long depthRays[MAX_COUNTED_DEPTH+1];
+    //the nodes visited by single rays, and by packets of rays
+    long long nodes;
+    long long packetNodes;
+    //the primitives (triangles included) tested, one per ray even in a packet
+    long long primitiveTests;
+    long long tiles;
+    double seconds[TRACE_STAGES];
+    //the number of the thread, in the order threads first counted anything
+    int thread;
+    bool enrolled;
+
+    /**
+     * The counters of the calling thread
+     */
+    static TraceCounters& local()
+    {
+      static thread_local TraceCounters counters;
+      if (!counters.enrolled)
+        counters.enroll();
+      return counters;
+    }
+
+    /**
+     * Set every count of these counters to zero
+     */
+    void clear()
+    {
+      for (int k=0;k<RAY_KINDS;k++)
+        rays[k] = hits[k] = 0;
+      for (int d=0;d<=MAX_COUNTED_DEPTH;d++)
+        depthRays[d] = 0;
+      nodes = packetNodes = 0;
+      primitiveTests = 0;
+      tiles = 0;
+      for (int s=0;s<TRACE_STAGES;s++)
+        seconds[s] = 0;
+    }
+
+    /**
+     * Add the counts of other counters to these
+     */
+    void add(const TraceCounters& other)
+    {
+      for (int k=0;k<RAY_KINDS;k++)
+        {
+          rays[k] += other.rays[k];
+          hits[k] += other.hits[k];
+        }
+      for (int d=0;d<=MAX_COUNTED_DEPTH;d++)
+        depthRays[d] += other.depthRays[d];
+      nodes += other.nodes;
+      packetNodes += other.packetNodes;
+      primitiveTests += other.primitiveTests;
+      tiles += other.tiles;
+      for (int s=0;s<TRACE_STAGES;s++)
+        seconds[s] += other.seconds[s];
+    }
+
+    /**
+     * Count rays of a kind, and how many of them hit something
+     */
+    void addRays(RayKind kind,long long count,long long hitCount)
+    {
+      rays[kind] += count;
+      hits[kind] += hitCount;
+    }
+
+    long long getRays() const
+    {
+      long long n = 0;
+      for (int k=0;k<RAY_KINDS;k++)
+        n += rays[k];
+      return n;
+    }
+
+    /**
+     * The rays counted at every depth since the given copy of these counters
+     * was taken, up to the deepest one reached
+     */
+    vector<long long> getRaysPerDepth(const TraceCounters& since) const
+    {
+      int deepest = MAX_COUNTED_DEPTH;
+      while ((deepest>=0) && (depthRays[deepest]==since.depthRays[deepest]))
+        deepest--;
+      vector<long long> counts(deepest+1);
+      for (int d=0;d<=deepest;d++)
+        counts[d] = depthRays[d]-since.depthRays[d];
+      return counts;
+    }
+
+    /**
+     * The time spent in the stages that trace rays, i.e. how busy the thread was
+     */
+    double getBusySeconds() const
+    {
+      return seconds[STAGE_TILES]+seconds[STAGE_ANTIALIAS];
+    }
+
+    static const char *getKindName(int kind)
+    {
+      static const char *names[RAY_KINDS] = {"primary","secondary","shadow"};
+      return names[kind];
+    }
+
+    static const char *getStageName(int stage)
+    {
+      static const char *names[TRACE_STAGES] = {"compile","tiles","antialias",
+                                                "traversal","shading","shadows"};
+      return names[stage];
+    }
+
+  protected:
+    /**
+     * The counters of the threads that are running, and the sum of the
+     * counters of the threads that have finished, guarded by getLock()
+     */
+    static vector<TraceCounters *>& getThreads()
+    {
+      static vector<TraceCounters *> threads;
+      return threads;
+    }
+
+    static TraceCounters& getRetired()
+    {
+      static TraceCounters retired;
+      return retired;
+    }
+
+    static mutex& getLock()
+    {
+      static mutex lock;
+      return lock;
+    }
+
+    /**
+     * Lets go of the counters of a thread when the thread finishes, keeping
+     * their counts
+     */
+    class Enrollment
+    {
+    public:
+      TraceCounters *counters;
+
+      Enrollment(TraceCounters *counters)
+      {
+        this->counters = counters;
+      }
+
+      ~Enrollment()
+      {
+        lock_guard<mutex> lock(getLock());
+        vector<TraceCounters *>& threads = getThreads();
+        for (unsigned int i=0;i<threads.size();i++)
+          {
+            if (threads[i]==counters)
+              {
+                threads.erase(threads.begin()+i);
+                break;
+              }
+          }
+        getRetired().add(*counters);
+      }
+    };
+
+    /**
+     * Make the counters of the calling thread known to
+     * raytrace::TraceStatistics, the first time the thread counts anything
+     */
+    void enroll()
+    {
+      static int threadCount = 0;
+      static thread_local Enrollment enrollment(this);
+      lock_guard<mutex> lock(getLock());
+      thread = threadCount++;
+      enrolled = true;
+      getThreads().push_back(this);
+    }
+
+    friend class TraceStatistics;
+  };
+
+  /**
+   * Times a stage of a render on the calling thread, from when it is made
+   * until it goes out of scope
+   */
+  class StageTimer
+  {
+  protected:
+    TraceStage stage;
+    TraceCounters& counters;
+    chrono::steady_clock::time_point start;
+
+  public:
+    StageTimer(TraceStage stage,TraceCounters& counters=TraceCounters::local())
+      :stage(stage),counters(counters),start(chrono::steady_clock::now())
+    {
+    }
+
+    ~StageTimer()
+    {
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      counters.seconds[stage] += elapsed.count();
+    }
+  };
+
+  /**
+ * The counters of every thread that has traced rays, gathered together, with
+ * a summary that can be printed or written as JSON. Gathering and clearing
+ * counters must only be done while no thread is tracing rays, e.g. between
+ * renders.
+ */
+  class TraceStatistics
+  {
+  public:
+    //the counters of every thread that counted anything, and their sum
+    vector<TraceCounters> threads;
+    TraceCounters total;
+
+    TraceStatistics()
+    {
+      total.clear();
+      total.thread = -1;
+      total.enrolled = false;
+    }
+
+    /**
+     * Gather the counters of all threads as they are now
+     */
+    static TraceStatistics collect()
+    {
+      TraceStatistics stats;
+      lock_guard<mutex> lock(TraceCounters::getLock());
+      vector<TraceCounters *>& running = TraceCounters::getThreads();
+      for (unsigned int i=0;i<running.size();i++)
+        {
+          if ((running[i]->getRays()==0) && (running[i]->tiles==0) &&
+              (running[i]->seconds[STAGE_COMPILE]==0))
+            continue;
+          stats.threads.push_back(*running[i]);
+          stats.total.add(*running[i]);
+        }
+      stats.total.add(TraceCounters::getRetired());
+      return stats;
+    }
+
+    /**
+     * The sum of the counters of all threads as they are now. Unlike
+     * collect(), this copies no counters of single threads, so it makes no
+     * heap allocations and may be taken around a render whose allocations
+     * are counted
+     */
+    static TraceCounters getTotal()
+    {
+      TraceCounters total;
+      total.clear();
+      total.thread = -1;
+      total.enrolled = false;
+      lock_guard<mutex> lock(TraceCounters::getLock());
+      vector<TraceCounters *>& running = TraceCounters::getThreads();
+      for (unsigned int i=0;i<running.size();i++)
+        total.add(*running[i]);
+      total.add(TraceCounters::getRetired());
+      return total;
+    }
+
+    /**
+     * Set the counters of all threads to zero, e.g. before a render
+     */
+    static void reset()
+    {
+      lock_guard<mutex> lock(TraceCounters::getLock());
+      vector<TraceCounters *>& running = TraceCounters::getThreads();
+      for (unsigned int i=0;i<running.size();i++)
+        running[i]->clear();
+      TraceCounters::getRetired().clear();
+    }
+
+    /**
+     * Print the totals, and one line per thread
+     */
+    void print() const
+    {
+      long long rays = total.getRays();
+      printf("rays:");
+      for (int k=0;k<RAY_KINDS;k++)
+        printf(" %lld %s (%.1f%% %s)",total.rays[k],TraceCounters::getKindName(k),
+               getRate(total.hits[k],total.rays[k]),(k==RAY_SHADOW)?"blocked":"hit");
+      printf("\n");
+      printf("per ray: %.1f nodes, %.1f primitive tests; %lld packet nodes\n",
+             (double)total.nodes/max(rays,1LL),(double)total.primitiveTests/max(rays,1LL),
+             total.packetNodes);
+      printf("time:");
+      for (int s=0;s<TRACE_STAGES;s++)
+        {
+          if (total.seconds[s]>0)
+            printf(" %s %.3f s",TraceCounters::getStageName(s),total.seconds[s]);
+        }
+      printf("\n");
+      for (unsigned int i=0;i<threads.size();i++)
+        {
+          const TraceCounters& t = threads[i];
+          printf("  thread %d: %lld tiles, %lld rays, busy %.3f s\n",
+                 t.thread,t.tiles,t.getRays(),t.getBusySeconds());
+        }
+    }
+
+    /**
+     * The totals and the counters of every thread as a JSON object
+     */
+    string toJSON() const
+    {
+      ostringstream out;
+      out << "{\n  \"total\": ";
+      writeCounters(out,total,"  ");
+      out << ",\n  \"threads\": [";
+      for (unsigned int i=0;i<threads.size();i++)
+        {
+          out << (i>0?",":"") << "\n    ";
+          writeCounters(out,threads[i],"    ");
+        }
+      out << "\n  ]\n}\n";
+      return out.str();
+    }
+
+    /**
+     * Write toJSON() into a file
+     * \throws runtime_error if the file cannot be written
+     */
+    void writeJSON(const string& filename) const throw(runtime_error)
+    {
+      FILE *f = fopen(filename.c_str(),"w");
+      if (f==NULL)
+        throw runtime_error("Cannot write "+filename);
+      string json = toJSON();
+      bool written = fwrite(json.data(),1,json.size(),f)==json.size();
+      if ((fclose(f)!=0) || !written)
+        throw runtime_error("Cannot write "+filename);
+    }
+
+  protected:
+    static double getRate(long long part,long long whole)
+    {
+      return (whole>0)?100.0*part/whole:0.0;
+    }
+
+    static void writeCounters(ostringstream& out,const TraceCounters& c,const string& indent)
+    {
+      out << "{";
+      if (c.thread>=0)
+        out << "\n" << indent << "  \"thread\": " << c.thread << ",";
+      out << "\n" << indent << "  \"rays\": {";
+      for (int k=0;k<RAY_KINDS;k++)
+        out << (k>0?", ":"") << "\"" << TraceCounters::getKindName(k) << "\": " << c.rays[k];
+      out << "},\n" << indent << "  \"hits\": {";
+      for (int k=0;k<RAY_KINDS;k++)
+        out << (k>0?", ":"") << "\"" << TraceCounters::getKindName(k) << "\": " << c.hits[k];
+      out << "},\n" << indent << "  \"raysPerDepth\": [";
+      int deepest = MAX_COUNTED_DEPTH;
+      while ((deepest>=0) && (c.depthRays[deepest]==0))
+        deepest--;
+      for (int d=0;d<=deepest;d++)
+        out << (d>0?", ":"") << c.depthRays[d];
+      out << "],\n" << indent << "  \"nodes\": " << c.nodes;
+      out << ",\n" << indent << "  \"packetNodes\": " << c.packetNodes;
+      out << ",\n" << indent << "  \"primitiveTests\": " << c.primitiveTests;
+      out << ",\n" << indent << "  \"tiles\": " << c.tiles;
+      out << ",\n" << indent << "  \"seconds\": {";
+      for (int s=0;s<TRACE_STAGES;s++)
+        out << (s>0?", ":"") << "\"" << TraceCounters::getStageName(s) << "\": " << c.seconds[s];
+      out << "}\n" << indent << "}";
+    }
+  };
+}
+
+#endif
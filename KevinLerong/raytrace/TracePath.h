@@ -0,0 +1,194 @@
+#ifndef _TRACEPATH_H_
+#define _TRACEPATH_H_
+
+#include "TraceCounters.h"
+#include <glm/glm.hpp>
+#include <cstring>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+  class TileDependencies;
+
+  /**
+ * Limits on how far reflected and refracted rays are followed.
+ *
+ * A secondary ray is traced only if the fraction of the pixel's color it
+ * stands for (its weight, the product of the reflection or transparency
+ * coefficients along its path) is worth it:
+ * - rays weighing less than minContribution are dropped,
+ * - rays weighing less than rouletteThreshold survive Russian roulette with a
+ *   probability proportional to their weight, and the survivors are scaled up
+ *   so that the image stays unbiased on average,
+ * - every pixel may trace at most rayBudget secondary rays in all,
+ * - and no path gets deeper than maxDepth.
+ */
+  class TraceSettings
+  {
+  public:
+    /**
+     * The most bounces that can ever be counted
+     */
+    static const int MAX_DEPTH = MAX_COUNTED_DEPTH;
+
+    int maxDepth;
+    int rayBudget;
+    float minContribution;
+    float rouletteThreshold;
+    /**
+     * The number of point lights picked at random from the raytrace::LightTree
+     * to light each point, or 0 to light every point with every light
+     */
+    int lightSamples;
+
+    TraceSettings()
+    {
+      maxDepth = 8;
+      rayBudget = 32;
+      minContribution = 0.002f;
+      rouletteThreshold = 0.1f;
+      lightSamples = 0;
+    }
+  };
+
+  /**
+ * The state of tracing one pixel's tree of rays: how much of its budget of
+ * secondary rays is left, the random numbers for Russian roulette and light
+ * sampling, and how many rays it traced at every depth and how many of them
+ * hit something, shadow rays included. Each pixel has its
+ * own, so nothing in it is shared between threads.
+ */
+  class TracePath
+  {
+  protected:
+    const TraceSettings& settings;
+    int budget;
+    unsigned int rng;
+
+  public:
+    long long rays[TraceSettings::MAX_DEPTH+1];
+    long long primaryHits,secondaryHits;
+    long long shadowRays,shadowsBlocked;
+    /**
+     * Where the rays of the pixel record what they depend on, or NULL, and
+     * the tile of the pixel
+     */
+    TileDependencies *dependencies;
+    int tile;
+
+    /**
+     * \param settings the limits on secondary rays
+     * \param seed seeds the random numbers, e.g. from the pixel, so that an
+     * image comes out the same every time it is rendered
+     */
+    TracePath(const TraceSettings& settings,unsigned int seed)
+      :settings(settings)
+    {
+      budget = settings.rayBudget;
+      //scramble the seed, and keep the xorshift state away from 0
+      rng = (seed*2654435761u) ^ 0x9e3779b9u;
+      if (rng==0)
+        rng = 1;
+      memset(rays,0,sizeof(rays));
+      primaryHits = secondaryHits = 0;
+      shadowRays = shadowsBlocked = 0;
+      dependencies = NULL;
+      tile = -1;
+    }
+
+    /**
+     * A seed for the random numbers of a pixel, from the direction of its
+     * primary ray. Different pixels get different seeds, and the same pixel
+     * the same one in every image of the same view.
+     */
+    static unsigned int getSeed(const glm::vec3& dir)
+    {
+      unsigned int bits[3];
+      memcpy(bits,&dir[0],sizeof(bits));
+      return bits[0] ^ (bits[1]*0x85ebca6bu) ^ (bits[2]*0xc2b2ae35u);
+    }
+
+    /**
+     * Record that a ray is traced at the given depth
+     */
+    void count(int depth)
+    {
+      rays[depth]++;
+    }
+
+    /**
+     * Record that a ray traced at the given depth hit something
+     */
+    void hit(int depth)
+    {
+      if (depth==0)
+        primaryHits++;
+      else
+        secondaryHits++;
+    }
+
+    /**
+     * Record that a shadow ray is traced
+     */
+    void shadow(bool blocked)
+    {
+      shadowRays++;
+      if (blocked)
+        shadowsBlocked++;
+    }
+
+    /**
+     * Add the rays of the pixel to the counters of the calling thread
+     */
+    void countInto(TraceCounters& counters) const
+    {
+      long long secondary = 0;
+      for (int i=1;i<=TraceSettings::MAX_DEPTH;i++)
+        secondary += rays[i];
+      for (int i=0;i<=TraceSettings::MAX_DEPTH;i++)
+        counters.depthRays[i] += rays[i];
+      counters.addRays(RAY_PRIMARY,rays[0],primaryHits);
+      counters.addRays(RAY_SECONDARY,secondary,secondaryHits);
+      counters.addRays(RAY_SHADOW,shadowRays,shadowsBlocked);
+    }
+
+    /**
+     * Decide whether a secondary ray is traced
+     * \param depth the depth the ray would have
+     * \param weight the fraction of the pixel's color the ray stands for
+     * \param scale set to the factor that the color of the ray must be
+     * multiplied by if it is traced (more than 1 if it survived roulette)
+     * \return true if the ray should be traced
+     */
+    bool spawn(int depth,float weight,float& scale)
+    {
+      scale = 1.0f;
+      if ((depth>settings.maxDepth) || (depth>TraceSettings::MAX_DEPTH) ||
+          (budget<=0) || (weight<settings.minContribution))
+        return false;
+      if (weight<settings.rouletteThreshold)
+        {
+          float survive = weight/settings.rouletteThreshold;
+          if (random()>=survive)
+            return false;
+          scale = 1.0f/survive;
+        }
+      budget--;
+      return true;
+    }
+
+    /**
+     * A random number in [0,1) from a xorshift generator
+     */
+    float random()
+    {
+      rng ^= rng<<13;
+      rng ^= rng>>17;
+      rng ^= rng<<5;
+      return (rng>>8)*(1.0f/16777216.0f);
+    }
+  };
+}
+
+#endif
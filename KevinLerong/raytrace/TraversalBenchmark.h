@@ -0,0 +1,85 @@
+#ifndef _TRAVERSALBENCHMARK_H_
+#define _TRAVERSALBENCHMARK_H_
+
+#include "Camera.h"
+#include "Framebuffer.h"
+#include "RayPacket.h"
+#include "RayScene.h"
+#include "TileRenderer.h"
+#include "ThreadPool.h"
+#include <cstdio>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * Measures how fast the primary rays of an image can be traced through a
+ * raytrace::RayScene, once one ray at a time and once as SIMD packets. Only
+ * the closest hit is searched for; nothing is shaded, so the numbers reflect
+ * traversal and intersection alone.
+ */
+  class TraversalBenchmark
+  {
+  public:
+    RenderStats single,packets;
+
+    /**
+     * Trace the image repeatedly with both methods
+     * \param scene the compiled scene
+     * \param camera the camera generating the primary rays
+     * \param pool the threads to trace on
+     * \param repeats how many times each method traces the whole image
+     */
+    void run(const RayScene& scene,const Camera& camera,util::ThreadPool& pool,int repeats=5)
+    {
+      Framebuffer fb(camera.getWidth(),camera.getHeight());
+      TileRenderer tiles(pool);
+      int blockWidth = (SIMD_WIDTH>=8)?4:2;
+      int blockHeight = SIMD_WIDTH/blockWidth;
+
+      single = RenderStats();
+      packets = RenderStats();
+      for (int r=0;r<repeats;r++)
+        {
+          add(single,tiles.render(fb,[&scene,&camera](int x,int y)
+          {
+            HitRecord hit = scene.intersect(camera.getRay(x,y));
+            return hit.hit?glm::vec3(1,1,1):glm::vec3(0,0,0);
+          }));
+
+          add(packets,tiles.renderBlocks(fb,blockWidth,blockHeight,
+                                         [&scene,&camera](int x,int y,int w,int h,glm::vec3 *colors)
+          {
+            _3DRay rays[SIMD_WIDTH];
+            for (int j=0;j<h;j++)
+              for (int i=0;i<w;i++)
+                rays[j*w+i] = camera.getRay(x+i,y+j);
+            RayPacket packet(rays,w*h);
+            PacketHit hits;
+            scene.intersect(packet,hits);
+            for (int i=0;i<w*h;i++)
+              colors[i] = (hits.instance[i]>=0)?glm::vec3(1,1,1):glm::vec3(0,0,0);
+          }));
+        }
+    }
+
+    void print() const
+    {
+      printf("single rays: %.0f rays/s\n",single.getRaysPerSecond());
+      printf("%d-wide packets: %.0f rays/s (%.2fx)\n",SIMD_WIDTH,packets.getRaysPerSecond(),
+             (single.getRaysPerSecond()>0)?packets.getRaysPerSecond()/single.getRaysPerSecond():0.0);
+    }
+
+  private:
+    static void add(RenderStats& total,const RenderStats& s)
+    {
+      total.rays += s.rays;
+      total.seconds += s.seconds;
+      total.threads = s.threads;
+      total.tiles += s.tiles;
+    }
+  };
+}
+
+#endif
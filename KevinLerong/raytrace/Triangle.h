@@ -0,0 +1,128 @@
+#ifndef _TRIANGLE_H_
+#define _TRIANGLE_H_
+
+#include <glm/glm.hpp>
+#include <cmath>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * A ray prepared for the watertight ray/triangle test of Woop, Benthin and Wald
+ * ("Watertight Ray/Triangle Intersection", JCGT 2013). The ray is sheared so
+ * that it points down the +z axis, after which a triangle test is a 2D edge
+ * function test at the origin. Rays that pass exactly through a shared edge or
+ * vertex hit exactly one of the triangles, so meshes have no cracks.
+ *
+ * This preparation is done once per ray, and reused for every triangle.
+ */
+  class WatertightRay
+  {
+  public:
+    glm::vec3 origin,dir;
+    int kx,ky,kz;
+    float sx,sy,sz;
+
+    WatertightRay(const glm::vec3& origin,const glm::vec3& dir)
+    {
+      this->origin = origin;
+      this->dir = dir;
+
+      //the dimension where the ray direction is largest becomes z
+      glm::vec3 a = glm::abs(dir);
+      kz = (a.x>a.y)?((a.x>a.z)?0:2):((a.y>a.z)?1:2);
+      kx = (kz+1)%3;
+      ky = (kx+1)%3;
+      //preserve the winding of the triangles
+      if (dir[kz]<0)
+        {
+          int temp = kx;
+          kx = ky;
+          ky = temp;
+        }
+      sx = dir[kx]/dir[kz];
+      sy = dir[ky]/dir[kz];
+      sz = 1.0f/dir[kz];
+    }
+  };
+
+  /**
+   * Where a ray hits a triangle. The point is u*v0 + v*v1 + w*v2
+   */
+  class TriangleHit
+  {
+  public:
+    float t,u,v,w;
+    int triangle;
+
+    TriangleHit()
+    {
+      t = u = v = w = 0;
+      triangle = -1;
+    }
+  };
+
+  /**
+   * Intersect a prepared ray with the triangle (v0,v1,v2). Both sides of the
+   * triangle can be hit.
+   * \param ray the prepared ray
+   * \param v0,v1,v2 the corners of the triangle
+   * \param tMin the smallest ray parameter of interest
+   * \param tMax the largest ray parameter of interest
+   * \param hit receives the ray parameter and barycentric coordinates on a hit
+   * \return true if the ray hits the triangle strictly between tMin and tMax
+   */
+  inline bool intersectTriangle(const WatertightRay& ray,
+                                const glm::vec3& v0,const glm::vec3& v1,const glm::vec3& v2,
+                                float tMin,float tMax,TriangleHit& hit)
+  {
+    glm::vec3 A = v0-ray.origin;
+    glm::vec3 B = v1-ray.origin;
+    glm::vec3 C = v2-ray.origin;
+
+    float ax = A[ray.kx]-ray.sx*A[ray.kz];
+    float ay = A[ray.ky]-ray.sy*A[ray.kz];
+    float bx = B[ray.kx]-ray.sx*B[ray.kz];
+    float by = B[ray.ky]-ray.sy*B[ray.kz];
+    float cx = C[ray.kx]-ray.sx*C[ray.kz];
+    float cy = C[ray.ky]-ray.sy*C[ray.kz];
+
+    float U = cx*by-cy*bx;
+    float V = ax*cy-ay*cx;
+    float W = bx*ay-by*ax;
+
+    //on an edge, fall back to double precision to decide consistently
+    if ((U==0.0f) || (V==0.0f) || (W==0.0f))
+      {
+        U = (float)((double)cx*(double)by-(double)cy*(double)bx);
+        V = (float)((double)ax*(double)cy-(double)ay*(double)cx);
+        W = (float)((double)bx*(double)ay-(double)by*(double)ax);
+      }
+
+    if (((U<0) || (V<0) || (W<0)) && ((U>0) || (V>0) || (W>0)))
+      return false;
+
+    float det = U+V+W;
+    if (det==0.0f)
+      return false;
+
+    float az = ray.sz*A[ray.kz];
+    float bz = ray.sz*B[ray.kz];
+    float cz = ray.sz*C[ray.kz];
+    float T = U*az+V*bz+W*cz;
+
+    float rcpDet = 1.0f/det;
+    float t = T*rcpDet;
+    if ((t<=tMin) || (t>=tMax))
+      return false;
+
+    hit.t = t;
+    hit.u = U*rcpDet;
+    hit.v = V*rcpDet;
+    hit.w = W*rcpDet;
+    return true;
+  }
+}
+
+#endif
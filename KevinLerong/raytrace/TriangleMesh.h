@@ -0,0 +1,363 @@
+#ifndef _TRIANGLEMESH_H_
+#define _TRIANGLEMESH_H_
+
+#include "AABB.h"
+#include "BVH.h"
+#include "Triangle.h"
+#include "RayPacket.h"
+#include "Primitive.h"
+#include "PolygonMesh.h"
+#include <glm/glm.hpp>
+#include <cmath>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+ * The triangles of one util::PolygonMesh, in the mesh's own coordinate system,
+ * together with a raytrace::BVH over them (the "bottom level" of the two-level
+ * hierarchy used by raytrace::RayScene).
+ *
+ * A mesh is built once, no matter how many leaves of the scene graph use it.
+ * Each of those leaves is an instance that refers to this mesh through its own
+ * transformation.
+ */
+  class TriangleMesh
+  {
+  protected:
+    vector<glm::vec3> positions;
+    vector<glm::vec3> normals;
+    vector<glm::vec2> texcoords;
+    //three vertex indices per triangle
+    vector<unsigned int> triangles;
+    BVH bvh;
+
+  public:
+    TriangleMesh()
+    {
+    }
+
+    /**
+     * Copy the vertex data out of a polygon mesh and build the hierarchy over
+     * its triangles. Polygons with more than 3 sides are split into fans.
+     * \param mesh the mesh, which must have "position" data
+     */
+    template <class VertexType>
+    void init(const util::PolygonMesh<VertexType>& mesh)
+    {
+      positions.clear();
+      normals.clear();
+      texcoords.clear();
+      triangles.clear();
+
+      vector<VertexType> vertexData = mesh.getVertexAttributes();
+      if ((vertexData.size()<=0) || !vertexData[0].hasData("position"))
+        {
+          bvh.build(vector<AABB>());
+          return;
+        }
+      bool hasNormals = vertexData[0].hasData("normal");
+      bool hasTexcoords = vertexData[0].hasData("texcoord");
+
+      for (unsigned int i=0;i<vertexData.size();i++)
+        {
+          positions.push_back(toVec3(vertexData[i].getData("position")));
+          if (hasNormals)
+            normals.push_back(toVec3(vertexData[i].getData("normal")));
+          if (hasTexcoords)
+            {
+              glm::vec3 t = toVec3(vertexData[i].getData("texcoord"));
+              texcoords.push_back(glm::vec2(t.x,t.y));
+            }
+        }
+
+      vector<unsigned int> primitives = mesh.getPrimitives();
+      int size = mesh.getPrimitiveSize();
+      if (size>=3)
+        {
+          for (unsigned int i=0;i+size<=primitives.size();i+=size)
+            {
+              for (int k=2;k<size;k++)
+                {
+                  triangles.push_back(primitives[i]);
+                  triangles.push_back(primitives[i+k-1]);
+                  triangles.push_back(primitives[i+k]);
+                }
+            }
+        }
+
+      vector<AABB> bounds(getTriangleCount());
+      for (int i=0;i<getTriangleCount();i++)
+        {
+          bounds[i].expand(positions[triangles[3*i]]);
+          bounds[i].expand(positions[triangles[3*i+1]]);
+          bounds[i].expand(positions[triangles[3*i+2]]);
+        }
+      bvh.build(bounds,4);
+    }
+
+    int getTriangleCount() const
+    {
+      return triangles.size()/3;
+    }
+
+    /**
+     * The bounding box of this mesh in its own coordinate system
+     */
+    AABB getBounds() const
+    {
+      return bvh.getBounds();
+    }
+
+    /**
+     * Find the closest triangle hit by a ray given in the coordinate system of
+     * this mesh
+     * \param origin the start of the ray
+     * \param dir the direction of the ray
+     * \param tMin the smallest ray parameter of interest
+     * \param tMax the largest ray parameter of interest. Lowered on a hit
+     * \param hit receives the closest hit
+     * \return true if a triangle closer than tMax was hit
+     */
+    bool intersect(const glm::vec3& origin,const glm::vec3& dir,
+                   float tMin,float& tMax,TriangleHit& hit) const
+    {
+      WatertightRay ray(origin,dir);
+      int tests = 0;
+      bool found = bvh.traverse(origin,dir,tMin,tMax,[this,&ray,tMin,&hit,&tests](int tri,float& tMax)
+      {
+        TriangleHit candidate;
+        tests++;
+        if (!intersectTriangle(ray,
+                               positions[triangles[3*tri]],
+                               positions[triangles[3*tri+1]],
+                               positions[triangles[3*tri+2]],
+                               tMin,tMax,candidate))
+          return false;
+        candidate.triangle = tri;
+        hit = candidate;
+        tMax = candidate.t;
+        return true;
+      });
+      TraceCounters::local().primitiveTests += tests;
+      return found;
+    }
+
+    /**
+     * Find out whether a ray given in the coordinate system of this mesh hits
+     * any triangle between tMin and tMax, stopping at the first one found
+     */
+    bool occluded(const glm::vec3& origin,const glm::vec3& dir,float tMin,float tMax) const
+    {
+      WatertightRay ray(origin,dir);
+      int tests = 0;
+      bool found = bvh.traverseAny(origin,dir,tMin,tMax,[this,&ray,tMin,tMax,&tests](int tri)
+      {
+        TriangleHit candidate;
+        tests++;
+        return intersectTriangle(ray,
+                                 positions[triangles[3*tri]],
+                                 positions[triangles[3*tri+1]],
+                                 positions[triangles[3*tri+2]],
+                                 tMin,tMax,candidate);
+      });
+      TraceCounters::local().primitiveTests += tests;
+      return found;
+    }
+
+    /**
+     * Intersect a packet of rays given in the coordinate system of this mesh.
+     * \param packet the rays. tMax of rays that hit is lowered to the hit
+     * \param instance the instance to be recorded for rays that hit
+     * \param hits receives the hits of rays that hit closer than before
+     * \param anyHit if true, rays are deactivated at their first hit instead
+     * of searching for the closest one (for shadow rays)
+     */
+    void intersect(RayPacket& packet,int instance,PacketHit& hits,bool anyHit) const
+    {
+      int tests = 0;
+      bvh.traversePacket(packet,[this,instance,&hits,anyHit,&tests](int tri,RayPacket& p,const SimdMask& mask)
+      {
+        SimdFloat t,u,v;
+        SimdMask lanes = mask & p.active;
+        tests += lanes.count();
+        SimdMask hit = intersectTriangle(p,lanes,
+                                         positions[triangles[3*tri]],
+                                         positions[triangles[3*tri+1]],
+                                         positions[triangles[3*tri+2]],
+                                         t,u,v);
+        int bits = hit.bits();
+        if (bits==0)
+          return;
+        p.tMax = select(hit,t,p.tMax);
+        if (anyHit)
+          p.active = p.active.andNot(hit);
+
+        float ta[SIMD_WIDTH],ua[SIMD_WIDTH],va[SIMD_WIDTH];
+        t.store(ta);
+        u.store(ua);
+        v.store(va);
+        for (int lane=0;lane<SIMD_WIDTH;lane++)
+          {
+            if (!((bits>>lane)&1))
+              continue;
+            hits.instance[lane] = instance;
+            hits.hit[lane].t = ta[lane];
+            hits.hit[lane].u = 1.0f-ua[lane]-va[lane];
+            hits.hit[lane].v = ua[lane];
+            hits.hit[lane].w = va[lane];
+            hits.hit[lane].triangle = tri;
+          }
+      });
+      TraceCounters::local().primitiveTests += tests;
+    }
+
+    /**
+     * The normal at a hit point, in the coordinate system of this mesh. Vertex
+     * normals are interpolated if the mesh has them, otherwise the normal of
+     * the triangle itself is returned. The result is not normalized.
+     */
+    glm::vec3 getNormal(const TriangleHit& hit) const
+    {
+      unsigned int i0 = triangles[3*hit.triangle];
+      unsigned int i1 = triangles[3*hit.triangle+1];
+      unsigned int i2 = triangles[3*hit.triangle+2];
+      if (normals.size()==positions.size())
+        {
+          glm::vec3 n = hit.u*normals[i0] + hit.v*normals[i1] + hit.w*normals[i2];
+          if (glm::dot(n,n)>0)
+            return n;
+        }
+      return getFaceNormal(hit);
+    }
+
+    /**
+     * The normal of the triangle that was hit, in the coordinate system of this
+     * mesh. The result is not normalized.
+     */
+    glm::vec3 getFaceNormal(const TriangleHit& hit) const
+    {
+      const glm::vec3& p0 = positions[triangles[3*hit.triangle]];
+      return glm::cross(positions[triangles[3*hit.triangle+1]]-p0,
+                        positions[triangles[3*hit.triangle+2]]-p0);
+    }
+
+    /**
+     * Fit the canonical shape of a kind of primitive (see
+     * raytrace::PrimitiveKernel) to this mesh, which is taken to approximate
+     * it. The shape is scaled to the bounds of the mesh. The cylinder and cone
+     * stand along the y axis, and a cone is turned upside down if its widest
+     * vertices are at the top of the mesh.
+     * \param kind the kind of primitive
+     * \param frame receives the transformation from the canonical shape to the
+     * coordinate system of this mesh
+     * \return false if the mesh is flat or empty, and so fits no shape
+     */
+    bool getPrimitiveFrame(PrimitiveKind kind,glm::mat4& frame) const
+    {
+      AABB bounds = getBounds();
+      if (bounds.isEmpty() || (kind==PRIMITIVE_MESH))
+        return false;
+      glm::vec3 size = bounds.max-bounds.min;
+      if ((size.x<=0) || (size.y<=0) || (size.z<=0))
+        return false;
+      glm::vec3 center = 0.5f*(bounds.min+bounds.max);
+
+      frame = glm::mat4(1.0f);
+      if ((kind==PRIMITIVE_SPHERE) || (kind==PRIMITIVE_BOX))
+        {
+          frame[0][0] = 0.5f*size.x;
+          frame[1][1] = 0.5f*size.y;
+          frame[2][2] = 0.5f*size.z;
+          frame[3] = glm::vec4(center,1.0f);
+          return true;
+        }
+
+      bool flipped = false;
+      if (kind==PRIMITIVE_CONE)
+        {
+          //compare how far the vertices at the bottom and at the top are from the axis
+          float bottom = 0,top = 0;
+          float eps = 1e-3f*size.y;
+          for (unsigned int i=0;i<positions.size();i++)
+            {
+              float r = glm::length(glm::vec2(positions[i].x-center.x,positions[i].z-center.z));
+              if (positions[i].y<=bounds.min.y+eps)
+                bottom = max(bottom,r);
+              if (positions[i].y>=bounds.max.y-eps)
+                top = max(top,r);
+            }
+          flipped = top>bottom;
+        }
+      frame[0][0] = 0.5f*size.x;
+      frame[1][1] = flipped?-size.y:size.y;
+      frame[2][2] = 0.5f*size.z;
+      frame[3] = glm::vec4(center.x,flipped?bounds.max.y:bounds.min.y,center.z,1.0f);
+      return true;
+    }
+
+    /**
+     * The interpolated texture coordinates at a hit point, (0,0) if the mesh
+     * has none
+     */
+    glm::vec2 getTexcoord(const TriangleHit& hit) const
+    {
+      if (texcoords.size()!=positions.size())
+        return glm::vec2(0,0);
+      return hit.u*texcoords[triangles[3*hit.triangle]]
+          + hit.v*texcoords[triangles[3*hit.triangle+1]]
+          + hit.w*texcoords[triangles[3*hit.triangle+2]];
+    }
+
+    /**
+     * How the texture coordinates change when the hit point moves within the
+     * triangle that was hit. Each change of the point is expressed in the two
+     * edges of the triangle leaving its first corner, and the same combination
+     * of the edges in texture space is the change of the coordinates.
+     * \param hit the hit
+     * \param dPdx,dPdy two changes of the hit point, in the coordinate system
+     * of this mesh
+     * \param duvdx,duvdy receive the corresponding changes of the texture
+     * coordinates, (0,0) if the mesh has none
+     */
+    void getTexcoordDerivatives(const TriangleHit& hit,
+                                const glm::vec3& dPdx,const glm::vec3& dPdy,
+                                glm::vec2& duvdx,glm::vec2& duvdy) const
+    {
+      duvdx = duvdy = glm::vec2(0,0);
+      if (texcoords.size()!=positions.size())
+        return;
+      unsigned int i0 = triangles[3*hit.triangle];
+      unsigned int i1 = triangles[3*hit.triangle+1];
+      unsigned int i2 = triangles[3*hit.triangle+2];
+      glm::vec3 e1 = positions[i1]-positions[i0];
+      glm::vec3 e2 = positions[i2]-positions[i0];
+
+      //least squares: solve the 2x2 system of dot products with the edges
+      float a = glm::dot(e1,e1),b = glm::dot(e1,e2),c = glm::dot(e2,e2);
+      float det = a*c-b*b;
+      if (fabs(det)<=1e-12f*a*c)
+        return;
+      glm::vec2 t1 = texcoords[i1]-texcoords[i0];
+      glm::vec2 t2 = texcoords[i2]-texcoords[i0];
+
+      float px = glm::dot(dPdx,e1),qx = glm::dot(dPdx,e2);
+      float py = glm::dot(dPdy,e1),qy = glm::dot(dPdy,e2);
+      duvdx = ((c*px-b*qx)*t1 + (a*qx-b*px)*t2)/det;
+      duvdy = ((c*py-b*qy)*t1 + (a*qy-b*py)*t2)/det;
+    }
+
+  private:
+    static glm::vec3 toVec3(const vector<float>& data)
+    {
+      glm::vec3 v(0,0,0);
+      for (unsigned int i=0;(i<data.size()) && (i<3);i++)
+        v[i] = data[i];
+      return v;
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,468 @@
+#ifndef _WAVEFRONT_H_
+#define _WAVEFRONT_H_
+
+#include "HitRecord.h"
+#include "RayDifferential.h"
+#include "RayPacket.h"
+#include "RayScene.h"
+#include "SIMD.h"
+#include "TileDependencies.h"
+#include "TraceContext.h"
+#include "TraceCounters.h"
+#include "TracePath.h"
+#include "_3DRay.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+using namespace std;
+
+namespace raytrace
+{
+
+  /**
+   * A ray waiting in a queue of raytrace::WavefrontTracer, with what the
+   * recursion would have kept on the stack for it
+   */
+  class WavefrontRay
+  {
+  public:
+    _3DRay ray;
+    RayDifferential differential;
+    //the fraction of the pixel's color the ray stands for
+    float weight;
+    int pixel;
+
+    WavefrontRay(const _3DRay& ray,const RayDifferential& differential,float weight,int pixel)
+      :ray(ray),differential(differential)
+    {
+      this->weight = weight;
+      this->pixel = pixel;
+    }
+  };
+
+  /**
+   * A ray of raytrace::WavefrontTracer that hit something, waiting to be
+   * shaded. Hits are shaded in the order of their key, which groups them by
+   * the kind of primitive and the instance (and so the material) they hit
+   */
+  class WavefrontHit
+  {
+  public:
+    int key;
+    int ray;
+    int instance;
+    TriangleHit hit;
+
+    WavefrontHit(int key,int ray,int instance,const TriangleHit& hit)
+      :hit(hit)
+    {
+      this->key = key;
+      this->ray = ray;
+      this->instance = instance;
+    }
+
+    bool operator<(const WavefrontHit& other) const
+    {
+      if (key!=other.key)
+        return key<other.key;
+      return ray<other.ray;
+    }
+  };
+
+  /**
+   * A shadow ray of raytrace::WavefrontTracer towards a light, with the color
+   * its pixel gets if nothing blocks it
+   */
+  class ShadowRay
+  {
+  public:
+    //the light first, then the direction octant
+    int key;
+    glm::vec3 origin,dir;
+    float far;
+    glm::vec3 color;
+    int pixel;
+
+    ShadowRay(int key,const glm::vec3& origin,const glm::vec3& dir,float far,
+              const glm::vec3& color,int pixel)
+      :origin(origin),dir(dir),color(color)
+    {
+      this->key = key;
+      this->far = far;
+      this->pixel = pixel;
+    }
+
+    bool operator<(const ShadowRay& other) const
+    {
+      if (key!=other.key)
+        return key<other.key;
+      return pixel<other.pixel;
+    }
+  };
+
+  /**
+ * Traces a batch of primary rays (e.g. a whole tile) breadth first, as a
+ * pipeline of stages each of which works on every ray of the batch before the
+ * next one starts, instead of following each pixel's tree of rays to the end
+ * before starting the next pixel:
+ * - the rays of one depth are sorted by the octant of their direction, and
+ *   traversed SIMD_WIDTH at a time as raytrace::RayPacket,
+ * - the hits are sorted by the kind of primitive and the instance they hit,
+ *   and shaded in that order, so that the points on one mesh (its triangles,
+ *   texture and material) are shaded together,
+ * - shading adds the ambient light to the pixels right away, queues a shadow
+ *   ray for every light a point faces, and queues the reflected and refracted
+ *   rays as the rays of the next depth,
+ * - and the shadow rays are sorted by light and direction octant, and tested
+ *   a packet at a time.
+ *
+ * Once rays diverge after a bounce or two, sorting them brings back most of
+ * the coherence that primary rays have, and each stage keeps its own small
+ * working set in the cache.
+ *
+ * Each pixel keeps its own raytrace::TracePath, so the limits on secondary
+ * rays and light sampling are the same as when the scene graph traces rays
+ * one by one. The image is the same too, except that the random numbers of a
+ * pixel (for Russian roulette and light sampling) and its budget of rays are
+ * used up breadth first rather than depth first, which changes which rays
+ * survive but not what the image is on average.
+ *
+ * Each thread has its own tracer (see local()), whose queues keep their
+ * memory from one batch to the next.
+ */
+  class WavefrontTracer
+  {
+  protected:
+    vector<TracePath> paths;
+    vector<WavefrontRay> rays,spawned;
+    vector<WavefrontHit> hits;
+    vector<ShadowRay> shadows;
+    //the rays of the current depth in the order they are traversed
+    vector<int> order;
+
+  public:
+    /**
+     * The tracer of the calling thread
+     */
+    static WavefrontTracer& local()
+    {
+      static thread_local WavefrontTracer tracer;
+      return tracer;
+    }
+
+    /**
+     * Trace a batch of primary rays, and all the rays they lead to
+     * \param scene the compiled scene
+     * \param settings the limits on secondary rays, and the number of light
+     * samples
+     * \param primary the primary rays in the view coordinate system
+     * \param n the number of primary rays
+     * \param context the context of the calling thread, whose recorder (if
+     * any) the rays record what they depend on into
+     * \param colors receives the color of each primary ray
+     * \param depths if not NULL, receives the ray parameter of each hit, or
+     * infinity for rays that hit nothing
+     * \param objects if not NULL, receives the instance each ray hit, or -1
+     */
+    void trace(const RayScene& scene,const TraceSettings& settings,
+               const _3DRay *primary,int n,TraceContext& context,
+               glm::vec3 *colors,
+               float *depths=NULL,int *objects=NULL)
+    {
+      paths.clear();
+      rays.clear();
+      for (int i=0;i<n;i++)
+        {
+          paths.emplace_back(settings,TracePath::getSeed(glm::vec3(primary[i].dir)));
+          rays.push_back(WavefrontRay(primary[i],RayDifferential::primary(),1.0f,i));
+          colors[i] = glm::vec3(0,0,0);
+        }
+
+      TraceCounters& counters = TraceCounters::local();
+      for (int depth=0;!rays.empty();depth++)
+        {
+          counters.depthRays[depth] += rays.size();
+          {
+            StageTimer timer(STAGE_TRAVERSAL,counters);
+            sortByOctant();
+            traverse(scene,depth,context,depths,objects);
+          }
+          counters.addRays((depth==0)?RAY_PRIMARY:RAY_SECONDARY,rays.size(),hits.size());
+          {
+            StageTimer timer(STAGE_SHADING,counters);
+            sort(hits.begin(),hits.end());
+            spawned.clear();
+            shadows.clear();
+            shade(scene,settings,depth,colors);
+          }
+          {
+            StageTimer timer(STAGE_SHADOWS,counters);
+            sort(shadows.begin(),shadows.end());
+            int blocked = occlude(scene,context,colors);
+            counters.addRays(RAY_SHADOW,shadows.size(),blocked);
+          }
+          rays.swap(spawned);
+        }
+    }
+
+  protected:
+    /**
+     * The octant of a direction, from the signs of its coordinates
+     */
+    static int getOctant(const glm::vec3& dir)
+    {
+      return (dir.x<0?1:0) | (dir.y<0?2:0) | (dir.z<0?4:0);
+    }
+
+    /**
+     * Order the rays by the octant of their direction, keeping the order of
+     * the rays within an octant
+     */
+    void sortByOctant()
+    {
+      int start[9];
+      memset(start,0,sizeof(start));
+      for (unsigned int i=0;i<rays.size();i++)
+        start[getOctant(glm::vec3(rays[i].ray.dir))+1]++;
+      for (int o=0;o<8;o++)
+        start[o+1] += start[o];
+      order.resize(rays.size());
+      for (unsigned int i=0;i<rays.size();i++)
+        order[start[getOctant(glm::vec3(rays[i].ray.dir))]++] = i;
+    }
+
+    /**
+     * Find the closest hit of every ray, SIMD_WIDTH rays of the same octant at
+     * a time, and queue the rays that hit something for shading
+     */
+    void traverse(const RayScene& scene,int depth,TraceContext& context,
+                  float *depths,int *objects)
+    {
+      const vector<Instance>& instances = scene.getInstances();
+      int instanceCount = instances.size();
+      hits.clear();
+      unsigned int first = 0;
+      while (first<order.size())
+        {
+          //a packet never mixes octants, so that it heads one way
+          int octant = getOctant(glm::vec3(rays[order[first]].ray.dir));
+          _3DRay batch[SIMD_WIDTH];
+          int count = 0;
+          while ((count<SIMD_WIDTH) && (first+count<order.size()) &&
+                 (getOctant(glm::vec3(rays[order[first+count]].ray.dir))==octant))
+            {
+              batch[count] = rays[order[first+count]].ray;
+              count++;
+            }
+
+          RayPacket packet(batch,count);
+          PacketHit packetHits;
+          scene.intersect(packet,packetHits);
+          for (int lane=0;lane<count;lane++)
+            {
+              int r = order[first+lane];
+              int instance = packetHits.instance[lane];
+              float t = (instance>=0)?packetHits.hit[lane].t:numeric_limits<float>::infinity();
+              if (depth==0)
+                {
+                  if (depths!=NULL)
+                    depths[rays[r].pixel] = t;
+                  if (objects!=NULL)
+                    objects[rays[r].pixel] = instance;
+                  if (context.dependencies!=NULL)
+                    context.dependencies->addInstance(context.tile,instance);
+                }
+              else if (context.dependencies!=NULL)
+                context.dependencies->addRay(context.tile,glm::vec3(batch[lane].pos),
+                                             glm::vec3(batch[lane].dir),0.0f,t,instance);
+              if (instance>=0)
+                hits.push_back(WavefrontHit(instances[instance].kind*instanceCount+instance,
+                                            r,instance,packetHits.hit[lane]));
+            }
+          first += count;
+        }
+    }
+
+    /**
+     * Shade every hit in turn: light it, queuing its shadow rays, and queue
+     * its reflected and refracted rays, as Scenegraph::shade does
+     */
+    void shade(const RayScene& scene,const TraceSettings& settings,int depth,glm::vec3 *colors)
+    {
+      for (unsigned int h=0;h<hits.size();h++)
+        {
+          const WavefrontRay& r = rays[hits[h].ray];
+          const _3DRay& ray = r.ray;
+          TracePath& path = paths[r.pixel];
+          HitRecord hitRecord = scene.getHitRecord(ray,hits[h].instance,hits[h].hit,&r.differential);
+          const util::Material& material = *hitRecord.material;
+
+          light(scene,settings,ray,hitRecord,r.weight*material.getAbsorption(),r.pixel,path,colors);
+
+          float reflection = material.getReflection();
+          float transparency = material.getTransparency();
+          if ((reflection<=0) && (transparency<=0))
+            continue;
+
+          glm::vec3 position = glm::vec3(ray.pos+hitRecord.t*ray.dir);
+          glm::vec3 dir = glm::normalize(glm::vec3(ray.dir));
+          glm::vec3 normal = hitRecord.normal;
+          //make the normal face the ray, remembering whether the ray leaves the object
+          float cosIn = glm::dot(dir,normal);
+          float eta = 1.0f/material.getRefractiveIndex();
+          if (cosIn>0)
+            {
+              normal = -normal;
+              eta = material.getRefractiveIndex();
+            }
+          else
+            cosIn = -cosIn;
+          float offset = 1e-4f*max(1.0f,glm::length(position));
+          float scale;
+
+          glm::vec3 dPdx,dPdy;
+          r.differential.transfer(glm::vec3(ray.dir),hitRecord.t,normal,dPdx,dPdy);
+
+          if (transparency>0)
+            {
+              float k = 1.0f-eta*eta*(1.0f-cosIn*cosIn);
+              if (k<0)
+                {
+                  //total internal reflection: the transmitted light is reflected too
+                  reflection += transparency;
+                }
+              else if (path.spawn(depth+1,r.weight*transparency,scale))
+                {
+                  glm::vec3 refracted = eta*dir+(eta*cosIn-sqrt(k))*normal;
+                  spawned.push_back(WavefrontRay(_3DRay(glm::vec4(position-offset*normal,1.0f),
+                                                        glm::vec4(glm::normalize(refracted),0.0f)),
+                                                 r.differential.refract(glm::vec3(ray.dir),normal,eta,dPdx,dPdy),
+                                                 r.weight*transparency*scale,r.pixel));
+                }
+            }
+
+          if ((reflection>0) && path.spawn(depth+1,r.weight*reflection,scale))
+            {
+              spawned.push_back(WavefrontRay(_3DRay(glm::vec4(position+offset*normal,1.0f),
+                                                    glm::vec4(glm::reflect(dir,normal),0.0f)),
+                                             r.differential.reflect(glm::vec3(ray.dir),normal,dPdx,dPdy),
+                                             r.weight*reflection*scale,r.pixel));
+            }
+        }
+    }
+
+    /**
+     * Light a point hit by a ray with the lights of the scene, chosen as
+     * Scenegraph::shade chooses them. The ambient light goes straight into
+     * the pixel, and the rest is queued with a shadow ray
+     * \param weight what the color of the point counts for in its pixel
+     */
+    void light(const RayScene& scene,const TraceSettings& settings,const _3DRay& ray,
+               const HitRecord& hitRecord,float weight,int pixel,TracePath& path,
+               glm::vec3 *colors)
+    {
+      const vector<SceneLight>& lights = scene.getLights();
+      const LightTree& lightTree = scene.getLightTree();
+      glm::vec3 position = glm::vec3(ray.pos+hitRecord.t*ray.dir);
+      glm::vec3 viewVec = glm::normalize(-glm::vec3(ray.dir));
+      glm::vec3 origin = position+1e-4f*max(1.0f,glm::length(position))*hitRecord.normal;
+      glm::vec3 tint = weight*hitRecord.textureColor;
+
+      int samples = settings.lightSamples;
+      if ((samples<=0) || (samples>=lightTree.getLightCount()))
+        {
+          for (unsigned int i=0;i<lights.size();i++)
+            light(lights,i,*hitRecord.material,position,origin,hitRecord.normal,viewVec,tint,pixel,colors);
+          return;
+        }
+      const vector<int>& directional = lightTree.getDirectionalLights();
+      for (unsigned int i=0;i<directional.size();i++)
+        light(lights,directional[i],*hitRecord.material,position,origin,hitRecord.normal,viewVec,tint,pixel,colors);
+      for (int s=0;s<samples;s++)
+        {
+          float probability;
+          int i = lightTree.sample(position,hitRecord.normal,path.random(),probability);
+          if (i<0)
+            continue;
+          light(lights,i,*hitRecord.material,position,origin,hitRecord.normal,viewVec,
+                tint/(probability*samples),pixel,colors);
+        }
+    }
+
+    /**
+     * Light a point with one light
+     * \param tint what the color the light gives the point is multiplied by
+     * before it is added to the pixel
+     */
+    void light(const vector<SceneLight>& lights,int i,const util::Material& material,
+               const glm::vec3& position,const glm::vec3& origin,const glm::vec3& normal,
+               const glm::vec3& viewVec,const glm::vec3& tint,int pixel,glm::vec3 *colors)
+    {
+      glm::vec3 ambient,lit;
+      bool faces = lights[i].getColor(material,position,normal,viewVec,ambient,lit);
+      colors[pixel] += tint*ambient;
+      if (!faces)
+        return;
+      glm::vec3 dir;
+      float far;
+      lights[i].getShadowRay(origin,dir,far);
+      shadows.push_back(ShadowRay(i*8+getOctant(dir),origin,dir,far,tint*lit,pixel));
+    }
+
+    /**
+     * Cast the queued shadow rays, SIMD_WIDTH rays towards the same light at a
+     * time, and add the light of those that are not blocked to their pixels.
+     * If the rays record what they depend on, they are cast one by one to
+     * find what blocks them
+     * \return the number of shadow rays that were blocked
+     */
+    int occlude(const RayScene& scene,TraceContext& context,glm::vec3 *colors)
+    {
+      int blockedCount = 0;
+      if (context.dependencies!=NULL)
+        {
+          for (unsigned int i=0;i<shadows.size();i++)
+            {
+              const ShadowRay& s = shadows[i];
+              int blocker = scene.findOccluder(s.origin,s.dir,0.0f,s.far);
+              context.dependencies->addRay(context.tile,s.origin,s.dir,0.0f,s.far,blocker);
+              if (blocker<0)
+                colors[s.pixel] += s.color;
+              else
+                blockedCount++;
+            }
+          return blockedCount;
+        }
+
+      unsigned int first = 0;
+      while (first<shadows.size())
+        {
+          int key = shadows[first].key;
+          _3DRay batch[SIMD_WIDTH];
+          int count = 0;
+          while ((count<SIMD_WIDTH) && (first+count<shadows.size()) &&
+                 (shadows[first+count].key==key))
+            {
+              const ShadowRay& s = shadows[first+count];
+              batch[count] = _3DRay(glm::vec4(s.origin,1.0f),glm::vec4(s.dir,0.0f));
+              count++;
+            }
+          RayPacket packet(batch,count,0.0f,shadows[first].far);
+          SimdMask blocked = scene.occluded(packet);
+          blockedCount += blocked.count();
+          for (int lane=0;lane<count;lane++)
+            {
+              if (!blocked.get(lane))
+                colors[shadows[first+lane].pixel] += shadows[first+lane].color;
+            }
+          first += count;
+        }
+      return blockedCount;
+    }
+  };
+}
+
+#endif
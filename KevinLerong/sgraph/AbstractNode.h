@@ -2,6 +2,7 @@
 #define _ABSTRACTNODE_H_
 
 #include "INode.h"
+#include "FlatScenegraph.h"
 #include "glm/glm.hpp"
 #include <string>
 using namespace std;
@@ -151,6 +152,8 @@ namespace sgraph
     void addLight(const util::Light& l) throw(runtime_error)
     {
       lights.push_back(l);
+      if (scenegraph!=NULL)
+        scenegraph->invalidateRenderQueue();
     }
 
 
@@ -164,11 +167,30 @@ namespace sgraph
           glm::vec4 pos = lnew.getPosition();
           pos = modelview.top() * pos;
           lnew.setPosition(pos);
+          //the spot direction turns with the light
+          glm::vec4 spotDir = modelview.top() * lnew.getSpotDirection();
+          lnew.setSpotDirection(spotDir.x,spotDir.y,spotDir.z);
           listLights.push_back(lnew);
         }
       return listLights;
     }
 
+    /**
+     * By default, a node has no geometry of its own to contribute
+     */
+    void getInstancesInView(vector<raytrace::Instance>& instances,stack<glm::mat4>& modelview)
+    {
+    }
+
+    /**
+     * By default, a node adds only itself and its own lights
+     */
+    void addToFlatScenegraph(FlatScenegraph& scene,int parent)
+    {
+      int own = scene.addNode(this,parent,NULL);
+      scene.addLights(own,lights);
+    }
+
   };
 }
 #endif
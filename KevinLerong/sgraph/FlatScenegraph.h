@@ -0,0 +1,432 @@
+#ifndef _FLATSCENEGRAPH_H_
+#define _FLATSCENEGRAPH_H_
+
+#include "INode.h"
+#include "glm/glm.hpp"
+#include "Light.h"
+#include "Material.h"
+#include "ThreadPool.h"
+#include "raytrace/AABB.h"
+#include "raytrace/Frustum.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace sgraph
+{
+
+  /**
+ * The scene graph stored as arrays rather than as a tree of nodes: one entry
+ * per node in a set of parallel arrays (structure of arrays), every node after
+ * its parent, with the index of its parent in place of a pointer. The leaves
+ * that draw something have parallel arrays of their own, holding the mesh,
+ * texture and material of each, with meshes and textures as small integer ids.
+ *
+ * Since a parent always comes before its children, update() computes the
+ * world transformations of all nodes (to the coordinate system of the root)
+ * in one linear pass over the arrays, touching only the nodes whose own
+ * transformation or one above them changed. Given a thread pool, it splits
+ * the arrays into subtrees instead and updates them in parallel, with the
+ * same result.
+ *
+ * Every node also has a box bounding all that is drawn below it, in world
+ * coordinates, so that whole subtrees can be culled against a view frustum
+ * (see cull()). The box of a leaf comes from the bounds of its mesh, which
+ * the owner of the meshes must give (see setLeafBounds()), and the boxes are
+ * merged upward in the same update.
+ *
+ * The nodes stay the way the scene graph is built and edited (e.g. by
+ * sgraph::SceneXMLReader): build() flattens them through
+ * INode::addToFlatScenegraph, and update() reads the transformation of every
+ * transformation node straight from the node, so changing a transformation
+ * needs no build(). Anything else that changes (nodes, materials, textures or
+ * lights) does.
+ */
+  class FlatScenegraph
+  {
+  public:
+    //one entry per node, every node after its parent
+    vector<INode *> nodes;
+    //the index of the parent of each node, or -1 for the root
+    vector<int> parents;
+    //one past the last node of the subtree rooted at each node
+    vector<int> ends;
+    //where the transformation of a transformation node lives in the node,
+    //or NULL for other nodes, whose transformation is the identity
+    vector<const glm::mat4 *> sources;
+    //the transformation of each node as last read, and its world transformation
+    vector<glm::mat4> locals;
+    vector<glm::mat4> worlds;
+    //whether the world transformation of each node changed in the last update
+    vector<char> changed;
+    //the index among the leaves of each node, or -1 if it draws nothing
+    vector<int> nodeLeaves;
+    //a box bounding all that is drawn in the subtree of each node, in world
+    //coordinates
+    vector<raytrace::AABB> bounds;
+
+    //one entry per leaf that draws a mesh
+    vector<int> leafNodes;
+    vector<int> meshes;
+    vector<int> textures;
+    vector<util::Material> materials;
+    //the bounds of the mesh of each leaf in its own coordinate system, and
+    //in world coordinates
+    vector<raytrace::AABB> leafBounds;
+    vector<raytrace::AABB> worldLeafBounds;
+
+    //the names of the meshes and textures, by id
+    vector<string> meshNames;
+    vector<string> textureNames;
+
+    //the lights, and the node in whose coordinate system each is given
+    vector<util::Light> lights;
+    vector<int> lightNodes;
+
+  protected:
+    map<string,int> meshIds,textureIds;
+    //false until the first update() after build()
+    bool updated;
+    //true if the bounds of a leaf were set since the last update()
+    bool boundsChanged;
+    //how update() splits the nodes for a pool, for batchedFor batches
+    vector<int> topNodes;
+    vector<vector<int> > batches;
+    unsigned int batchedFor;
+
+  public:
+    FlatScenegraph()
+    {
+      updated = false;
+      boundsChanged = false;
+      batchedFor = 0;
+    }
+
+    /**
+     * Flatten the scene graph rooted at the given node
+     */
+    void build(INode *root)
+    {
+      clear();
+      if (root!=NULL)
+        root->addToFlatScenegraph(*this,-1);
+      //a subtree ends where the last subtree of its children ends
+      for (int i=nodes.size()-1;i>0;i--)
+        ends[parents[i]] = max(ends[parents[i]],ends[i]);
+      meshIds.clear();
+      textureIds.clear();
+    }
+
+    void clear()
+    {
+      nodes.clear();
+      parents.clear();
+      ends.clear();
+      sources.clear();
+      locals.clear();
+      worlds.clear();
+      changed.clear();
+      nodeLeaves.clear();
+      bounds.clear();
+      leafNodes.clear();
+      meshes.clear();
+      textures.clear();
+      materials.clear();
+      leafBounds.clear();
+      worldLeafBounds.clear();
+      meshNames.clear();
+      textureNames.clear();
+      lights.clear();
+      lightNodes.clear();
+      meshIds.clear();
+      textureIds.clear();
+      topNodes.clear();
+      batches.clear();
+      batchedFor = 0;
+      updated = false;
+      boundsChanged = false;
+    }
+
+    /**
+     * Add a node, after its parent
+     * \param node the node
+     * \param parent the index of its parent, or -1 for the root
+     * \param local where the transformation of the node lives, or NULL if it
+     * has none
+     * \return the index of the node
+     */
+    int addNode(INode *node,int parent,const glm::mat4 *local)
+    {
+      nodes.push_back(node);
+      parents.push_back(parent);
+      ends.push_back(nodes.size());
+      sources.push_back(local);
+      locals.push_back(glm::mat4(1.0f));
+      worlds.push_back(glm::mat4(1.0f));
+      changed.push_back(0);
+      nodeLeaves.push_back(-1);
+      bounds.push_back(raytrace::AABB());
+      return nodes.size()-1;
+    }
+
+    /**
+     * Add what a leaf node draws. Until its bounds are set, it is taken to
+     * draw nothing
+     * \param node the index of the leaf node
+     */
+    void addLeaf(int node,const string& meshName,const util::Material& material,
+                 const string& textureName)
+    {
+      nodeLeaves[node] = leafNodes.size();
+      leafNodes.push_back(node);
+      leafBounds.push_back(raytrace::AABB());
+      worldLeafBounds.push_back(raytrace::AABB());
+      meshes.push_back(getId(meshIds,meshNames,meshName));
+      textures.push_back(getId(textureIds,textureNames,textureName));
+      materials.push_back(material);
+    }
+
+    /**
+     * Set the bounds of the mesh of a leaf, in the coordinate system of the
+     * leaf. They are taken to world coordinates by the next update()
+     */
+    void setLeafBounds(int leaf,const raytrace::AABB& box)
+    {
+      leafBounds[leaf] = box;
+      boundsChanged = true;
+    }
+
+    /**
+     * Add lights given in the coordinate system of a node
+     */
+    void addLights(int node,const vector<util::Light>& nodeLights)
+    {
+      for (unsigned int i=0;i<nodeLights.size();i++)
+        {
+          lights.push_back(nodeLights[i]);
+          lightNodes.push_back(node);
+        }
+    }
+
+    /**
+     * Read the transformations of the transformation nodes, and bring the
+     * world transformations of all nodes up to date with them.
+     *
+     * With a pool, the nodes are split into a few subtrees per thread, found
+     * level by level from the root, and gathered into batches of about equal
+     * size. The nodes above the subtrees are updated first, and then the
+     * batches in parallel. Every node is computed from its parent exactly as
+     * in one pass, so the result does not depend on the number of threads.
+     * The boxes are then merged upward from the leaves in one pass backwards.
+     * \param pool if not NULL and the scene graph is large enough, the
+     * subtrees are updated on this pool
+     * \return the number of nodes whose world transformation changed
+     */
+    int update(util::ThreadPool *pool=NULL)
+    {
+      int n = nodes.size();
+      if ((pool==NULL) || (pool->getThreadCount()<2) || (n<MIN_PARALLEL_NODES))
+        {
+          int changedCount = updateRange(0,n);
+          finishUpdate(changedCount);
+          return changedCount;
+        }
+
+      unsigned int enough = 4*pool->getThreadCount();
+      if (batchedFor!=enough)
+        split(enough);
+
+      //the nodes above the subtrees are in order, so every parent is
+      //updated before its children
+      int changedCount = 0;
+      for (unsigned int i=0;i<topNodes.size();i++)
+        changedCount += updateRange(topNodes[i],topNodes[i]+1);
+
+      vector<int> counts(batches.size(),0);
+      util::ThreadPool::Batch jobs;
+      for (unsigned int b=0;b<batches.size();b++)
+        {
+          pool->submit(jobs,[this,&counts,b]()
+          {
+            for (unsigned int i=0;i<batches[b].size();i++)
+              counts[b] += updateRange(batches[b][i],ends[batches[b][i]]);
+          });
+        }
+      pool->wait(jobs);
+      for (unsigned int b=0;b<counts.size();b++)
+        changedCount += counts[b];
+      finishUpdate(changedCount);
+      return changedCount;
+    }
+
+    /**
+     * Find the leaves that may be in view, leaving out whole subtrees whose
+     * box is out of view. The boxes must be up to date
+     * \param frustum the view frustum, in world coordinates
+     * \param visible set to 1 for every leaf that may be in view, and 0 for
+     * the others
+     * \return the number of leaves that may be in view
+     */
+    int cull(const raytrace::Frustum& frustum,vector<char>& visible) const
+    {
+      int n = nodes.size();
+      int inView = 0;
+      visible.assign(leafNodes.size(),0);
+      int i = 0;
+      while (i<n)
+        {
+          if (!frustum.intersects(bounds[i]))
+            {
+              //the subtree follows its root, so skip past it
+              i = ends[i];
+              continue;
+            }
+          if (nodeLeaves[i]>=0)
+            {
+              visible[nodeLeaves[i]] = 1;
+              inView++;
+            }
+          i++;
+        }
+      return inView;
+    }
+
+    int getNodeCount() const
+    {
+      return nodes.size();
+    }
+
+    int getLeafCount() const
+    {
+      return leafNodes.size();
+    }
+
+  protected:
+    //below this many nodes, update() is done in one pass even given a pool
+    static const int MIN_PARALLEL_NODES = 4096;
+
+    /**
+     * Merge the boxes of the leaves upward, if anything moved
+     * \param changedCount the number of nodes whose world transformation
+     * changed
+     */
+    void finishUpdate(int changedCount)
+    {
+      if ((changedCount>0) || boundsChanged)
+        {
+          int n = nodes.size();
+          for (int i=0;i<n;i++)
+            bounds[i] = (nodeLeaves[i]>=0)?worldLeafBounds[nodeLeaves[i]]:raytrace::AABB();
+          //children come after their parent, so going backwards every box is
+          //complete before it is merged into its parent's
+          for (int i=n-1;i>0;i--)
+            bounds[parents[i]].expand(bounds[i]);
+        }
+      updated = true;
+      boundsChanged = false;
+    }
+
+    /**
+     * Split the nodes into subtrees, going down level by level from the root
+     * until there are enough of them, and gather consecutive subtrees into
+     * batches of about as many nodes each
+     * \param enough how many batches to aim for
+     */
+    void split(unsigned int enough)
+    {
+      int n = nodes.size();
+      topNodes.clear();
+      batches.clear();
+      vector<int> subtrees(1,0);
+      bool divisible = true;
+      while ((subtrees.size()<enough) && divisible)
+        {
+          vector<int> next;
+          divisible = false;
+          for (unsigned int i=0;i<subtrees.size();i++)
+            {
+              int s = subtrees[i];
+              if (ends[s]==s+1)
+                next.push_back(s);
+              else
+                {
+                  topNodes.push_back(s);
+                  divisible = true;
+                  //the children of a node follow it, one subtree after another
+                  for (int c=s+1;c<ends[s];c=ends[c])
+                    next.push_back(c);
+                }
+            }
+          subtrees.swap(next);
+        }
+      sort(topNodes.begin(),topNodes.end());
+
+      batches.push_back(vector<int>());
+      int batchSize = 0;
+      for (unsigned int i=0;i<subtrees.size();i++)
+        {
+          if (batchSize*(int)enough>=n)
+            {
+              batches.push_back(vector<int>());
+              batchSize = 0;
+            }
+          batches.back().push_back(subtrees[i]);
+          batchSize += ends[subtrees[i]]-subtrees[i];
+        }
+      batchedFor = enough;
+    }
+
+    /**
+     * Update the nodes from begin to end, in order. Their parents must be up
+     * to date already
+     * \return the number of them whose world transformation changed
+     */
+    int updateRange(int begin,int end)
+    {
+      int changedCount = 0;
+      for (int i=begin;i<end;i++)
+        {
+          int parent = parents[i];
+          //a parent comes before its children, so it is up to date already
+          bool dirty = !updated || ((parent>=0) && changed[parent]);
+          if ((sources[i]!=NULL) && (*sources[i]!=locals[i]))
+            {
+              locals[i] = *sources[i];
+              dirty = true;
+            }
+          changed[i] = dirty;
+          if (dirty)
+            {
+              if (parent<0)
+                worlds[i] = locals[i];
+              else if (sources[i]==NULL)
+                worlds[i] = worlds[parent];
+              else
+                worlds[i] = worlds[parent] * locals[i];
+              changedCount++;
+            }
+          int leaf = nodeLeaves[i];
+          if ((leaf>=0) && (dirty || boundsChanged))
+            worldLeafBounds[leaf] = leafBounds[leaf].transform(worlds[i]);
+        }
+      return changedCount;
+    }
+
+    /**
+     * The id of a name, given to it the first time it is seen
+     */
+    static int getId(map<string,int>& ids,vector<string>& names,const string& name)
+    {
+      map<string,int>::iterator it = ids.find(name);
+      if (it!=ids.end())
+        return it->second;
+      ids[name] = names.size();
+      names.push_back(name);
+      return names.size()-1;
+    }
+  };
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define _GLSCENEGRAPHRENDERER_H_
 
 #include "INode.h"
+#include "RenderQueue.h"
 #include "OpenGLFunctions.h"
 #include "glm/glm.hpp"
 #include <glm/gtc/type_ptr.hpp>
@@ -58,10 +59,46 @@ protected :
      */
     bool shaderLocationsSet;
 
+    /**
+     * The scene graph flattened for drawing, compiled again whenever it
+     * changes in anything but its transformations
+     */
+    RenderQueue queue;
+
+    /**
+     * If not NULL, the transformations of large scene graphs are brought up
+     * to date on this pool
+     */
+    util::ThreadPool *pool;
+
+    /**
+     * The bounds of every mesh in its own coordinate system, for culling
+     */
+    map<string, raytrace::AABB> meshBounds;
+
+    /**
+     * The projection that the scene graph is drawn with, and whether the
+     * leaves out of its view are culled
+     */
+    glm::mat4 projection;
+    bool projectionSet;
+    bool culling;
+
+    /**
+     * Which leaves may have been in view in the last draw, and how many leaves
+     * were drawn and culled
+     */
+    vector<char> visible;
+    int drawnLeaves,culledLeaves;
+
 public:
     GLScenegraphRenderer()
     {
         shaderLocationsSet = false;
+        pool = NULL;
+        projectionSet = false;
+        culling = true;
+        drawnLeaves = culledLeaves = 0;
     }
 
     /**
@@ -75,6 +112,58 @@ public:
 
     }
 
+    /**
+     * Share the work of bringing the transformations up to date before every
+     * draw on a pool of threads. draw() waits only for its own jobs, but helps
+     * with whatever else the pool has queued while it waits, so a pool busy
+     * with long jobs (e.g. a background raytrace) can hold up a frame
+     * \param pool the pool, or NULL to do it on the calling thread
+     */
+    void setThreadPool(util::ThreadPool *pool)
+    {
+        this->pool = pool;
+    }
+
+    /**
+     * Set the projection the scene graph is drawn with. Until it is set,
+     * nothing is culled
+     * \param projection the view-to-clip transformation
+     */
+    void setProjection(const glm::mat4& projection)
+    {
+        this->projection = projection;
+        projectionSet = true;
+    }
+
+    /**
+     * Turn culling of the leaves out of view on or off
+     */
+    void setCulling(bool culling)
+    {
+        this->culling = culling;
+    }
+
+    bool isCulling() const
+    {
+        return culling;
+    }
+
+    /**
+     * The number of leaves drawn in the last draw
+     */
+    int getDrawnCount() const
+    {
+        return drawnLeaves;
+    }
+
+    /**
+     * The number of leaves culled in the last draw, as out of view
+     */
+    int getCulledCount() const
+    {
+        return culledLeaves;
+    }
+
     /**
      * Add a mesh to be drawn later.
      * The rendering context should be set before calling this function, as this function needs it
@@ -100,6 +189,8 @@ public:
             if (!vertexData.hasData(it->second))
                 throw runtime_error("Mesh does not have vertex attribute "+it->second);
         }
+        meshBounds[name] = raytrace::AABB(glm::vec3(mesh.getMinimumBounds()),
+                                          glm::vec3(mesh.getMaximumBounds()));
         util::ObjectInstance *mr = new util::ObjectInstance(name);
         mr->initPolygonMesh<K>(*glContext,
                             shaderLocations,
@@ -124,7 +215,12 @@ public:
     }
 
     /**
-     * Begin rendering of the scene graph from the root
+     * Begin rendering of the scene graph from the root.
+     * The scene graph is drawn from its render queue, which is compiled the
+     * first time and whenever the scene graph has changed since, and whose
+     * transformations are brought up to date before drawing. Once the
+     * projection is set, whole subtrees out of view are left out (see
+     * FlatScenegraph::cull)
      * \param root
      * \param modelView
      */
@@ -137,9 +233,130 @@ public:
       if (loc >= 0) {
         glContext->glUniform1i(loc, 0);
       }
-      vector<util::Light> lightsInView = root->getLightsInView(modelView);
+      if (!queue.isCompiled(root))
+        compileQueue(root);
+      queue.update(pool);
+      vector<util::Light> lightsInView = queue.getLightsInView(modelView.top());
       this->initLightsInShader(lightsInView);
-      root->draw(*this,modelView);
+      const FlatScenegraph& scene = queue.getScene();
+      if (culling && projectionSet)
+        {
+          raytrace::Frustum frustum(projection * modelView.top());
+          drawnLeaves = scene.cull(frustum, visible);
+        }
+      else
+        {
+          visible.assign(scene.getLeafCount(), 1);
+          drawnLeaves = scene.getLeafCount();
+        }
+      culledLeaves = scene.getLeafCount() - drawnLeaves;
+      drawQueue(modelView.top());
+    }
+
+    /**
+     * Make the next draw compile the render queue again, e.g. after nodes
+     * were added or their materials changed
+     */
+    void invalidateRenderQueue()
+    {
+      queue.invalidate();
+    }
+
+    /**
+     * Flatten the scene graph and look up the mesh and texture of every item
+     * \param root
+     */
+    void compileQueue(INode *root)
+    {
+      queue.compile(root);
+      FlatScenegraph& scene = queue.getScene();
+      //look up every mesh and texture once, by id
+      vector<util::ObjectInstance *> meshesById;
+      for (unsigned int i = 0; i < scene.meshNames.size(); i++)
+        {
+          map<string, util::ObjectInstance *>::iterator mesh = meshRenderers.find(scene.meshNames[i]);
+          meshesById.push_back((mesh != meshRenderers.end()) ? mesh->second : NULL);
+        }
+      vector<util::TextureImage *> texturesById;
+      for (unsigned int i = 0; i < scene.textureNames.size(); i++)
+        {
+          map<string, util::TextureImage *>::iterator texture = textures.find(scene.textureNames[i]);
+          if (texture == textures.end())
+            texture = textures.find("white");
+          texturesById.push_back((texture != textures.end()) ? texture->second : NULL);
+        }
+      vector<RenderItem>& items = queue.getItems();
+      for (unsigned int i = 0; i < items.size(); i++)
+        {
+          items[i].mesh = meshesById[scene.meshes[items[i].leaf]];
+          items[i].texture = texturesById[scene.textures[items[i].leaf]];
+          map<string, raytrace::AABB>::iterator box = meshBounds.find(scene.meshNames[scene.meshes[items[i].leaf]]);
+          if (box != meshBounds.end())
+            scene.setLeafBounds(items[i].leaf, box->second);
+        }
+    }
+
+    /**
+     * Draw every item of the render queue in one pass, as drawMesh would draw
+     * them one by one. The shader locations are looked up once for all of
+     * them, and a texture is bound only when it differs from the last one.
+     * The leaves culled by draw() are skipped
+     * \param view the world-to-view transformation
+     */
+    void drawQueue(const glm::mat4& view)
+    {
+      util::OpenGLFunctions *gl = glContext;
+      int ambientLoc = getRequiredLocation("material.ambient");
+      int diffuseLoc = getRequiredLocation("material.diffuse");
+      int specularLoc = getRequiredLocation("material.specular");
+      int shininessLoc = getRequiredLocation("material.shininess");
+      int modelviewLoc = getRequiredLocation("modelview");
+      int normalLoc = getRequiredLocation("normalmatrix");
+      int textureLoc = getRequiredLocation("texturematrix");
+
+      glm::mat4 texturematrix = glm::mat4(1.0);
+      gl->glUniformMatrix4fv(textureLoc, 1, false, glm::value_ptr(texturematrix));
+      //the normal matrix of view*world is that of view times that of world
+      glm::mat4 normalView = glm::inverse(glm::transpose(view));
+
+      const vector<RenderItem>& items = queue.getItems();
+      const vector<util::Material>& materials = queue.getScene().materials;
+      util::TextureImage *bound = NULL;
+      for (unsigned int i = 0; i < items.size(); i++)
+        {
+          const RenderItem& item = items[i];
+          if ((item.mesh == NULL) || !visible[item.leaf])
+            continue;
+          const util::Material& material = materials[item.leaf];
+          gl->glUniform3fv(ambientLoc, 1, glm::value_ptr(material.getAmbient()));
+          gl->glUniform3fv(diffuseLoc, 1, glm::value_ptr(material.getDiffuse()));
+          gl->glUniform3fv(specularLoc, 1, glm::value_ptr(material.getSpecular()));
+          gl->glUniform1f(shininessLoc, material.getShininess());
+
+          glm::mat4 modelview = view * item.world;
+          glm::mat4 normalmatrix = normalView * item.normalWorld;
+          gl->glUniformMatrix4fv(modelviewLoc, 1, false, glm::value_ptr(modelview));
+          gl->glUniformMatrix4fv(normalLoc, 1, false, glm::value_ptr(normalmatrix));
+
+          if ((item.texture != NULL) && (item.texture != bound))
+            {
+              item.texture->getTexture()->bind();
+              bound = item.texture;
+            }
+          item.mesh->draw(*gl);
+        }
+    }
+
+    /**
+     * The location of a shader variable that drawing cannot do without
+     * \throws runtime_error if the shader has no such variable
+     */
+    int getRequiredLocation(const string& name) throw(runtime_error)
+    {
+      int loc = shaderLocations.getLocation(name);
+      if (loc < 0)
+        throw runtime_error("No shader variable for \" " + name + " \"");
+      return loc;
     }
 
     void initLightsInShader(const vector<util::Light>& lights)
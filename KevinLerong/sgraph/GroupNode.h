@@ -129,6 +129,8 @@ namespace sgraph
     {
       children.push_back(child);
       child->setParent(this);
+      if (scenegraph!=NULL)
+        scenegraph->invalidateRenderQueue();
     }
 
     /**
@@ -168,7 +170,33 @@ namespace sgraph
       return lights;
     }
 
-    HitRecord getIntersection(_3DRay ray, stack<glm::mat4>& modelview) {
+    /**
+       * Overridden version from @link{AbstractNode}. Collects the instances of
+       * all its children.
+       */
+    void getInstancesInView(vector<raytrace::Instance>& instances,stack<glm::mat4>& modelview)
+    {
+      for (unsigned int i = 0; i < children.size(); i++)
+        {
+          children[i]->getInstancesInView(instances,modelview);
+        }
+    }
+
+    /**
+       * Overridden version from @link{AbstractNode}. Adds itself, all its
+       * children below it, and then the lights of this node.
+       */
+    void addToFlatScenegraph(FlatScenegraph& scene,int parent)
+    {
+      int own = scene.addNode(this,parent,NULL);
+      for (unsigned int i = 0; i < children.size(); i++)
+        {
+          children[i]->addToFlatScenegraph(scene,own);
+        }
+      scene.addLights(own,lights);
+    }
+
+    HitRecord getIntersection(const _3DRay& ray, raytrace::MatrixStack& modelview) {
         HitRecord hit = HitRecord();
         for (int i = 0; i < children.size(); i++) {
           HitRecord childHit = children.at(i)->getIntersection(ray, modelview);
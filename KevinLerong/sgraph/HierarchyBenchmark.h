@@ -0,0 +1,194 @@
+#ifndef _HIERARCHYBENCHMARK_H_
+#define _HIERARCHYBENCHMARK_H_
+
+#include "FlatScenegraph.h"
+#include "GroupNode.h"
+#include "LeafNode.h"
+#include "TransformNode.h"
+#include "ThreadPool.h"
+#include "glm/glm.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+namespace sgraph
+{
+
+  /**
+ * Measures how FlatScenegraph::update() scales with threads, on a synthetic
+ * crowd of figures like the humanoids of the sample scenes: every figure is a
+ * transformation placing it, over a skeleton of joints, each a transformation
+ * with a box and the joints below it. Every frame animates every joint, so
+ * that every world transformation is computed again, as it is when a crowd is
+ * animated.
+ *
+ * The same frames are updated in one pass and on pools of 2, 4, ... threads,
+ * each in a flat scene graph of its own, and the world transformations are
+ * checked to come out identical.
+ */
+  class HierarchyBenchmark
+  {
+  public:
+    //how many transformation nodes and nodes in all the scene graph has
+    int transformCount,nodeCount;
+    //the seconds per update in one pass, and on each number of threads
+    double serialSeconds;
+    vector<unsigned int> threadCounts;
+    vector<double> seconds;
+    //false if any update on a pool differed from the one in one pass
+    bool identical;
+
+    HierarchyBenchmark()
+    {
+      transformCount = nodeCount = 0;
+      serialSeconds = 0;
+      identical = true;
+    }
+
+    /**
+     * Build a crowd of at least the given number of transformation nodes and
+     * time updating it
+     * \param transforms how many transformation nodes the scene graph should
+     * have at least
+     * \param maxThreads the most threads to try, 0 for one per core
+     * \param frames how many animated frames are updated for each timing
+     */
+    void run(int transforms,unsigned int maxThreads,int frames=20)
+    {
+      if (maxThreads==0)
+        maxThreads = max(1u,thread::hardware_concurrency());
+      int figures = max(1,(transforms+JOINTS)/(JOINTS+1));
+      vector<TransformNode *> joints;
+      INode *root = makeCrowd(figures,joints);
+      transformCount = joints.size();
+
+      FlatScenegraph serial;
+      serial.build(root);
+      nodeCount = serial.getNodeCount();
+      serialSeconds = timeUpdates(serial,NULL,joints,frames,NULL);
+
+      threadCounts.clear();
+      for (unsigned int t=2;t<maxThreads;t*=2)
+        threadCounts.push_back(t);
+      if (maxThreads>1)
+        threadCounts.push_back(maxThreads);
+      seconds.clear();
+      identical = true;
+      for (unsigned int i=0;i<threadCounts.size();i++)
+        {
+          util::ThreadPool pool(threadCounts[i]);
+          FlatScenegraph parallel;
+          parallel.build(root);
+          seconds.push_back(timeUpdates(parallel,&pool,joints,frames,&serial));
+        }
+      delete root;
+    }
+
+    void print() const
+    {
+      printf("scene graph of %d transformation nodes (%d nodes)\n",transformCount,nodeCount);
+      printf("1 thread: %.3f ms per update\n",1000*serialSeconds);
+      for (unsigned int i=0;i<threadCounts.size();i++)
+        printf("%u threads: %.3f ms per update (%.2fx)\n",threadCounts[i],1000*seconds[i],
+               (seconds[i]>0)?serialSeconds/seconds[i]:0.0);
+      printf("world transformations %s\n",identical?"identical on every thread count":"DIFFER");
+    }
+
+  private:
+    //the joints of a figure, and the parent of each (-1 for the pelvis)
+    static const int JOINTS = 17;
+
+    static int getJointParent(int joint)
+    {
+      //pelvis, spine, chest, neck, head, then the arms from the chest and the
+      //legs from the pelvis, three joints each
+      static const int parents[JOINTS] = {-1,0,1,2,3, 2,5,6, 2,8,9, 0,11,12, 0,14,15};
+      return parents[joint];
+    }
+
+    /**
+     * Build the crowd, side by side on a square grid
+     * \param joints set to every transformation node of the crowd, in the
+     * order they are animated
+     * \return the root of the scene graph
+     */
+    static INode *makeCrowd(int figures,vector<TransformNode *>& joints)
+    {
+      GroupNode *root = new GroupNode(NULL,"crowd");
+      int side = (int)ceil(sqrt((float)figures));
+      for (int f=0;f<figures;f++)
+        {
+          string name = "figure"+to_string(f);
+          TransformNode *figure = new TransformNode(NULL,name);
+          figure->setTransform(glm::translate(glm::mat4(1.0f),
+                                              glm::vec3(3.0f*(f%side),0,3.0f*(f/side))));
+          joints.push_back(figure);
+          root->addChild(figure);
+
+          vector<GroupNode *> groups;
+          for (int j=0;j<JOINTS;j++)
+            {
+              string joint = name+"-joint"+to_string(j);
+              TransformNode *transform = new TransformNode(NULL,joint);
+              transform->setTransform(glm::translate(glm::mat4(1.0f),glm::vec3(0,0.3f,0)));
+              GroupNode *group = new GroupNode(NULL,joint+"-group");
+              group->addChild(new LeafNode("box",NULL,joint+"-box"));
+              transform->addChild(group);
+              if (getJointParent(j)<0)
+                figure->addChild(transform);
+              else
+                groups[getJointParent(j)]->addChild(transform);
+              groups.push_back(group);
+              joints.push_back(transform);
+            }
+        }
+      return root;
+    }
+
+    /**
+     * Animate and update the given number of frames, and time the updates
+     * \param reference if not NULL, a flat scene graph of the same nodes,
+     * updated in one pass, that every update is compared to
+     * \return the seconds per update
+     */
+    double timeUpdates(FlatScenegraph& scene,util::ThreadPool *pool,
+                       const vector<TransformNode *>& joints,int frames,FlatScenegraph *reference)
+    {
+      //the first update computes everything; it is not timed
+      animate(joints,0);
+      scene.update(pool);
+      double total = 0;
+      for (int frame=1;frame<=frames;frame++)
+        {
+          animate(joints,frame);
+          chrono::steady_clock::time_point start = chrono::steady_clock::now();
+          scene.update(pool);
+          chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+          total += elapsed.count();
+          if (reference!=NULL)
+            {
+              reference->update();
+              if (reference->worlds!=scene.worlds)
+                identical = false;
+            }
+        }
+      return total/frames;
+    }
+
+    static void animate(const vector<TransformNode *>& joints,int frame)
+    {
+      for (unsigned int i=0;i<joints.size();i++)
+        {
+          float angle = 0.3f*sin(0.1f*frame+i);
+          joints[i]->setAnimationTransform(glm::rotate(glm::mat4(1.0f),angle,glm::vec3(1,0,0)));
+        }
+    }
+  };
+}
+
+#endif
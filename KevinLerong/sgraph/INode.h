@@ -7,6 +7,8 @@
 #include "Material.h"
 #include "HitRecord.h"
 #include "_3DRay.h"
+#include "raytrace/Instance.h"
+#include "raytrace/TraceContext.h"
 #include <vector>
 #include <stack>
 #include <string>
@@ -18,6 +20,7 @@ namespace sgraph
 {
   class Scenegraph;
   class GLScenegraphRenderer;
+  class FlatScenegraph;
 
   /**
  * This interface represents all the operations offered by any type of node in our scenegraph.
@@ -136,7 +139,32 @@ namespace sgraph
        */
     virtual vector<util::Light> getLightsInView(stack<glm::mat4>& modelview)=0;
 
-    virtual HitRecord getIntersection(_3DRay ray, stack<glm::mat4>& modelview)=0;
+    /**
+       * Append every leaf of the scene graph rooted at this node to the given list,
+       * together with its transformation to the view coordinate system. This is
+       * how the scene graph is flattened for raytracing. It is assumed that the
+       * modelview.peek is set to the world-to-view transformation.
+       */
+    virtual void getInstancesInView(vector<raytrace::Instance>& instances,stack<glm::mat4>& modelview)=0;
+
+    /**
+       * Append the nodes, leaves and lights of the scene graph rooted at this
+       * node to a flat scene graph, every node after its parent and in the
+       * order draw() and getLightsInView() reach them. This is how the scene
+       * graph is flattened for drawing.
+       * \param scene the flat scene graph being built
+       * \param parent the index in it of the parent of this node, or -1 for
+       * the root
+       */
+    virtual void addToFlatScenegraph(FlatScenegraph& scene,int parent)=0;
+
+    /**
+       * Find the closest intersection of a ray with the scene graph rooted at
+       * this node, by walking down to every leaf. This is what raycasting falls
+       * back to when the scene graph has not been compiled for ray queries.
+       * It is assumed that modelview.top() is the world-to-view transformation.
+       */
+    virtual HitRecord getIntersection(const _3DRay& ray, raytrace::MatrixStack& modelview)=0;
   };
 }
 
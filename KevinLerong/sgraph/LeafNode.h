@@ -29,6 +29,11 @@ class LeafNode: public AbstractNode
      */
 protected:
     string objInstanceName;
+    /**
+     * The kind of shape of the object instance, worked out from its name and
+     * model file once
+     */
+    raytrace::PrimitiveKind kind;
     /**
      * The material associated with the object instance at this leaf
      */
@@ -37,10 +42,18 @@ protected:
     string textureName;
 
 public:
-    LeafNode(const string& instanceOf,sgraph::Scenegraph *graph,const string& name)
+    /**
+     * \param instanceOf the name of the object instance
+     * \param graph the scene graph this leaf is part of
+     * \param name the name of this leaf
+     * \param path the file the object instance was loaded from, if known
+     */
+    LeafNode(const string& instanceOf,sgraph::Scenegraph *graph,const string& name,
+             const string& path="")
         :AbstractNode(graph,name)
     {
         this->objInstanceName = instanceOf;
+        this->kind = raytrace::getPrimitiveKind(instanceOf,path);
     }
 	
 	~LeafNode(){}
@@ -53,6 +66,8 @@ public:
     void setMaterial(const util::Material& mat) throw(runtime_error)
     {
         material = mat;
+        if (scenegraph!=NULL)
+            scenegraph->invalidateRenderQueue();
     }
 
     /**
@@ -62,6 +77,8 @@ public:
     void setTextureName(const string& name) throw(runtime_error)
     {
         textureName = name;
+        if (scenegraph!=NULL)
+            scenegraph->invalidateRenderQueue();
     }
 
     /*
@@ -75,6 +92,7 @@ public:
     INode *clone()
     {
         LeafNode *newclone = new LeafNode(this->objInstanceName,scenegraph,name);
+        newclone->kind = kind;
         newclone->setMaterial(this->getMaterial());
         return newclone;
     }
@@ -98,50 +116,65 @@ public:
         }
     }
 
-    HitRecord getIntersection(_3DRay ray, stack<glm::mat4>& modelview) {
-        glm::mat4 transform = glm::inverse(glm::mat4(modelview.top()));
-        HitRecord newOne = HitRecord();
-
-        if (objInstanceName.find("box") != std::string::npos) {
-            //newOne = intersectBox(newRay, modelview);
+    /**
+     * Adds itself as an instance, with the current top of the modelview stack as
+     * its transformation
+     */
+    void getInstancesInView(vector<raytrace::Instance>& instances,stack<glm::mat4>& modelview)
+    {
+        if (objInstanceName.length()>0)
+        {
+            raytrace::Instance instance;
+            instance.node = this;
+            instance.meshName = objInstanceName;
+            instance.kind = kind;
+            instance.textureName = textureName;
+            instance.material = material;
+            instance.setTransform(modelview.top());
+            instances.push_back(instance);
         }
-        else if (objInstanceName.find("sphere") != std::string::npos) {
-            HitRecord result = HitRecord();
-
-//            printf("%s", glm::to_string(modelview.top()).c_str());
+    }
 
-//            printf("ray pos: %f %f %f %f \n", ray.pos.x, ray.pos.y, ray.pos.z, ray.pos.operator[](3));
-//            printf("ray dir: %f %f %f \n", ray.dir.x, ray.dir.y, ray.dir.z);
+    /**
+     * Adds itself, as a leaf that draws its mesh if it has one, and then its
+     * lights
+     */
+    void addToFlatScenegraph(FlatScenegraph& scene,int parent)
+    {
+        int own = scene.addNode(this,parent,NULL);
+        if (objInstanceName.length()>0)
+        {
+            scene.addLeaf(own,objInstanceName,material,textureName);
+        }
+        scene.addLights(own,lights);
+    }
 
-            glm::vec4 pos = ray.pos * modelview.top();
-            glm::vec4 dir = ray.dir * modelview.top();
+    HitRecord getIntersection(const _3DRay& ray, raytrace::MatrixStack& modelview) {
+        glm::mat4 transform = glm::inverse(glm::mat4(modelview.top()));
+        HitRecord newOne = HitRecord();
 
+        if (kind == raytrace::PRIMITIVE_SPHERE) {
+            HitRecord result = HitRecord();
 
-//            printf("pos: %f %f %f \n", pos.x, pos.y, pos.z);
-//            printf("dir: %f %f %f \n", dir.x, dir.y, dir.z);
+            //bring the ray into the coordinate system of the unit sphere
+            glm::vec4 pos = transform * ray.pos;
+            glm::vec4 dir = transform * ray.dir;
 
             float A = dir.x * dir.x + dir.y*dir.y + dir.z*dir.z;
             float B = 2* (dir.x*pos.x + dir.y*pos.y + dir.z*pos.z);
             float C = pos.x*pos.x + pos.y*pos.y + pos.z*pos.z - 1;
 
-            //printf("A:%f B:%f C:%f \n", A, B, C);
-
             float d = B*B - 4 * A * C;
 
             if (d >= 0 ) {
-                float t1 = (-1.0 * B) - sqrt(d) / (2*A);
-                float t2 = (-1.0 * B) + sqrt(d) / (2*A);
-                //printf("t1 %f t2 %f \n", t1, t2);
-                float tMin = min(t1, t2);
+                float t1 = ((-1.0f * B) - sqrt(d)) / (2*A);
+                float t2 = ((-1.0f * B) + sqrt(d)) / (2*A);
+                //the closest root in front of the ray
+                float tMin = (t1 > 0) ? t1 : t2;
                 if (tMin > 0) {
-                    printf("t min than 0 \n");
-                    glm::vec4 inter = pos + dir * tMin;
-                    modelview.push(modelview.top());
-                    modelview.top() = glm::transpose(glm::inverse(modelview.top()));
-                    glm::vec4 normal = inter * modelview.top();
-                    normal = glm::vec4(normal.x, normal.y, normal.z, 0);
-                    modelview.pop();
-                    result = HitRecord(tMin, inter, normal, this->getMaterial());
+                    glm::vec4 objInter = pos + dir * tMin;
+                    glm::vec4 normal = glm::transpose(transform) * glm::vec4(objInter.x, objInter.y, objInter.z, 0);
+                    result = HitRecord(tMin, glm::normalize(glm::vec3(normal)), &material);
                 }
             }
             return result;
@@ -0,0 +1,161 @@
+#ifndef _RENDERQUEUE_H_
+#define _RENDERQUEUE_H_
+
+#include "FlatScenegraph.h"
+#include "INode.h"
+#include "glm/glm.hpp"
+#include "Light.h"
+#include <vector>
+using namespace std;
+
+namespace util
+{
+  class ObjectInstance;
+  class TextureImage;
+}
+
+namespace sgraph
+{
+
+  /**
+   * One mesh to be drawn, with everything drawing it takes
+   */
+  class RenderItem
+  {
+  public:
+    glm::mat4 world,normalWorld;
+    //the leaf of the sgraph::FlatScenegraph this item draws
+    int leaf;
+    util::ObjectInstance *mesh;
+    util::TextureImage *texture;
+  };
+
+  /**
+ * The scene graph flattened for drawing: every leaf in the order the
+ * recursive draw would reach it, with its transformation to the root and the
+ * mesh and texture that draw it, in one contiguous list.
+ *
+ * The nodes themselves are kept in a sgraph::FlatScenegraph, whose update()
+ * brings every transformation up to date in one pass, computing it again only
+ * where the node or one above it changed; the items copy only those. The
+ * view transformation is applied while drawing, so moving the camera changes
+ * nothing here.
+ *
+ * The queue refers to the matrices of the transformation nodes, so it
+ * must be compiled again whenever nodes are added, removed or changed in
+ * anything but their transformations (see invalidate()).
+ */
+  class RenderQueue
+  {
+  protected:
+    FlatScenegraph scene;
+    vector<RenderItem> items;
+    INode *root;
+    bool compiled;
+
+  public:
+    RenderQueue()
+    {
+      root = NULL;
+      compiled = false;
+    }
+
+    /**
+     * Flatten the scene graph rooted at the given node. The meshes and
+     * textures of the items are left for the renderer to look up
+     */
+    void compile(INode *root)
+    {
+      scene.build(root);
+      items.clear();
+      for (int i=0;i<scene.getLeafCount();i++)
+        {
+          RenderItem item;
+          item.world = item.normalWorld = glm::mat4(1.0f);
+          item.leaf = i;
+          item.mesh = NULL;
+          item.texture = NULL;
+          items.push_back(item);
+        }
+      this->root = root;
+      compiled = true;
+    }
+
+    /**
+     * Returns true if the queue was compiled from the given root, and nothing
+     * has made it out of date since
+     */
+    bool isCompiled(INode *root) const
+    {
+      return compiled && (this->root==root);
+    }
+
+    /**
+     * Make the next draw compile the queue again
+     */
+    void invalidate()
+    {
+      compiled = false;
+    }
+
+    /**
+     * Bring the transformations of all items up to date with their nodes
+     * \param pool if not NULL, the transformations of a large scene graph
+     * are brought up to date on this pool (see FlatScenegraph::update)
+     * \return the number of nodes whose transformation had changed
+     */
+    int update(util::ThreadPool *pool=NULL)
+    {
+      int changedCount = scene.update(pool);
+      for (unsigned int i=0;i<items.size();i++)
+        {
+          RenderItem& item = items[i];
+          int node = scene.leafNodes[item.leaf];
+          if (!scene.changed[node])
+            continue;
+          item.world = scene.worlds[node];
+          item.normalWorld = glm::inverse(glm::transpose(item.world));
+        }
+      return changedCount;
+    }
+
+    /**
+     * All the lights of the scene graph in the view coordinate system, in the
+     * order INode::getLightsInView gives them. The transformations must be up
+     * to date
+     * \param view the world-to-view transformation
+     */
+    vector<util::Light> getLightsInView(const glm::mat4& view) const
+    {
+      vector<util::Light> inView;
+      for (unsigned int i=0;i<scene.lights.size();i++)
+        {
+          int node = scene.lightNodes[i];
+          glm::mat4 m = (node>=0)?view*scene.worlds[node]:view;
+          util::Light light(scene.lights[i]);
+          light.setPosition(m * light.getPosition());
+          glm::vec4 spotDir = m * light.getSpotDirection();
+          light.setSpotDirection(spotDir.x,spotDir.y,spotDir.z);
+          inView.push_back(light);
+        }
+      return inView;
+    }
+
+    vector<RenderItem>& getItems()
+    {
+      return items;
+    }
+
+    FlatScenegraph& getScene()
+    {
+      return scene;
+    }
+
+    const FlatScenegraph& getScene() const
+    {
+      return scene;
+    }
+  };
+}
+
+#endif
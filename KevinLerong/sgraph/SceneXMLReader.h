@@ -72,6 +72,8 @@ namespace sgraph
   private:
     sgraph::Scenegraph *scenegraph;
     map<string,util::PolygonMesh<K>> meshes;
+    //the file every object instance was loaded from
+    map<string,string> meshPaths;
     INode *node;
     util::Light light;
     bool inLight;
@@ -199,7 +201,7 @@ namespace sgraph
             }
           if (objectname.length() > 0)
             {
-              node = new sgraph::LeafNode(objectname, scenegraph, name);
+              node = new sgraph::LeafNode(objectname, scenegraph, name, meshPaths[objectname]);
               node->setTextureName(textureName);
 
               stackNodes.top()->addChild(node);
@@ -231,6 +233,7 @@ namespace sgraph
               ifstream in(path.c_str());
               mesh = util::ObjImporter<K>::importFile(in, false);
               meshes[name] = mesh;
+              meshPaths[name] = path;
             }
         }
       else if (qName.compare("image")==0)
@@ -9,6 +9,19 @@
 #include "PolygonMesh.h"
 #include "_3DRay.h"
 #include "HitRecord.h"
+#include "raytrace/TriangleMesh.h"
+#include "raytrace/MipTexture.h"
+#include "raytrace/RayDifferential.h"
+#include "raytrace/RayScene.h"
+#include "raytrace/TracePath.h"
+#include "raytrace/TraceContext.h"
+#include "raytrace/TraceCounters.h"
+#include "raytrace/TileDependencies.h"
+#include "raytrace/Wavefront.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
 #include <string>
 #include <map>
 using namespace std;
@@ -39,6 +52,26 @@ namespace sgraph
 
     map<string,string> textures;
 
+    /**
+     * The triangles of every mesh with their own hierarchy, by mesh name
+     */
+    map<string,raytrace::TriangleMesh> rayMeshes;
+
+    /**
+     * The images of every texture, prepared for sampling by rays
+     */
+    map<string,raytrace::MipTexture> rayTextures;
+
+    /**
+     * The scene graph compiled for ray queries by compileRayScene
+     */
+    raytrace::RayScene rayScene;
+
+    /**
+     * How far reflected and refracted rays are followed
+     */
+    raytrace::TraceSettings traceSettings;
+
     /**
      * The associated renderer for this scene graph. This must be set before attempting to
      * render the scene graph
@@ -50,6 +83,7 @@ namespace sgraph
     Scenegraph()
     {
       root = NULL;
+      renderer = NULL;
     }
 
     ~Scenegraph()
@@ -87,6 +121,7 @@ namespace sgraph
         {
           this->renderer->addMesh<VertexType>(it->first,it->second);
         }
+      setRaytraceMeshes<VertexType>(meshes);
 
       //pass all the texture objects
       for (map<string,string>::iterator it=textures.begin();
@@ -95,6 +130,8 @@ namespace sgraph
         {
           this->renderer->addTexture(it->first,it->second);
         }
+      //the queue looks up the meshes and textures when it is compiled
+      this->renderer->invalidateRenderQueue();
 
     }
 
@@ -109,9 +146,21 @@ namespace sgraph
     {
       this->root = root;
       this->root->setScenegraph(this);
+      invalidateRenderQueue();
 
     }
 
+    /**
+     * Make the renderer flatten this scene graph again before it next draws
+     * it. Nodes call this when they change in anything but their
+     * transformations
+     */
+    void invalidateRenderQueue()
+    {
+      if (renderer!=NULL)
+        renderer->invalidateRenderQueue();
+    }
+
     /**
      * Draw this scene graph. It delegates this operation to the renderer
      * \param modelView
@@ -123,26 +172,383 @@ namespace sgraph
         }
     }
 
-    glm::vec3 raycast(_3DRay ray, stack<glm::mat4> modelview) {
+    /**
+     * Build the triangle hierarchies of all the meshes used for raytracing, and
+     * load the mipmaps of all the textures added so far. Each mesh is built
+     * once, however many leaves use it. setRenderer calls this, so it needs to
+     * be called directly only when raytracing without a renderer.
+     * \param meshes the meshes of this scene graph, by name
+     * \throws runtime_error if a texture cannot be read
+     */
+    template <class VertexType>
+    void setRaytraceMeshes(map<string,util::PolygonMesh<VertexType> >& meshes) throw(runtime_error)
+    {
+      //the compiled scene points into the meshes and textures about to go
+      rayScene = raytrace::RayScene();
+      rayMeshes.clear();
+      for (typename map<string,util::PolygonMesh<VertexType> >::iterator it=meshes.begin();
+           it!=meshes.end();
+           it++)
+        {
+          rayMeshes[it->first].init(it->second);
+        }
+
+      rayTextures.clear();
+      for (map<string,string>::iterator it=textures.begin();
+           it!=textures.end();
+           it++)
+        {
+          rayTextures[it->first] = raytrace::MipTexture(it->second);
+        }
+    }
+
+    /**
+     * Flatten the scene graph into a raytrace::RayScene with a bounding volume
+     * hierarchy over its leaves, each of which refers to the triangle
+     * hierarchy of its mesh. This must be called again whenever a
+     * transformation or the camera changes. Until it is called at least once,
+     * raycast() falls back to recursing through the nodes.
+     *
+     * If only transformations (or materials) changed since the last time, the
+     * compiled scene is refitted rather than built again.
+     * \param modelView the stack whose top is the world-to-view transformation
+     * \param pool if not NULL, a refit is shared out on this pool
+     */
+    void compileRayScene(stack<glm::mat4>& modelView, util::ThreadPool *pool = NULL)
+    {
+      raytrace::StageTimer timer(raytrace::STAGE_COMPILE);
+      if (!rayScene.refit(root,modelView,pool))
+        rayScene.build(root,modelView,rayMeshes,rayTextures);
+    }
+
+    /**
+     * Trace a primary ray with the context of the calling thread
+     * \param ray the ray in the view coordinate system
+     * \param modelview the stack whose top is the world-to-view transformation
+     * \return the color seen along the ray
+     */
+    glm::vec3 raycast(const _3DRay& ray, const stack<glm::mat4>& modelview) {
+        return raycast(ray, raytrace::TraceContext::local(modelview.top()));
+    }
+
+    /**
+     * Trace a primary ray, and also report what it hit. Textures are filtered
+     * over the area of one pixel, as a ray made by raytrace::Camera covers.
+     * Nothing is allocated on the heap while tracing.
+     * \param ray the ray in the view coordinate system
+     * \param context the context of the calling thread, whose matrix stack has
+     * the world-to-view transformation at its top
+     * \param depth if not NULL, receives the ray parameter of the hit, or
+     * infinity if nothing was hit
+     * \param object if not NULL, receives the instance of the compiled ray
+     * scene that was hit, or -1
+     * \return the color seen along the ray
+     */
+    glm::vec3 raycast(const _3DRay& ray, raytrace::TraceContext& context, float *depth = NULL, int *object = NULL) {
         //calculate the color here then return it;
 
         //default color
         glm::vec3 color = glm::vec3(0,0,0);
 
-        HitRecord hitRecord = getRoot()->getIntersection(ray, modelview);
+        raytrace::TracePath path(traceSettings, raytrace::TracePath::getSeed(glm::vec3(ray.dir)));
+        path.count(0);
+        path.dependencies = context.dependencies;
+        path.tile = context.tile;
+        raytrace::RayDifferential differential = raytrace::RayDifferential::primary();
+
+        HitRecord hitRecord;
+        if (rayScene.isCompiled())
+          hitRecord = rayScene.intersect(ray, &differential);
+        else
+          hitRecord = getRoot()->getIntersection(ray, context.modelview);
+        if (path.dependencies != NULL)
+          path.dependencies->addInstance(path.tile, hitRecord.instance);
+        if (depth != NULL)
+          *depth = hitRecord.hit ? hitRecord.t : numeric_limits<float>::infinity();
+        if (object != NULL)
+          *object = hitRecord.instance;
 
         if (hitRecord.hit) {
             //printf("hit\n");
-            color = shade(hitRecord);
+            path.hit(0);
+            color = shade(ray, hitRecord, differential, 0, 1.0f, path);
         } else {
             //printf("not hit \n");
         }
 
+        path.countInto(raytrace::TraceCounters::local());
         return color;
     }
 
-    glm::vec3 shade(HitRecord hitRecord) {
-        return glm::vec3(1,1,1);
+    /**
+     * Trace up to raytrace::SIMD_WIDTH rays together as one packet. This is
+     * faster than raycast() for coherent rays such as the primary rays of
+     * neighbouring pixels. It requires a compiled ray scene, and falls back to
+     * one raycast() per ray otherwise.
+     * \param rays the rays in the view coordinate system
+     * \param n the number of rays
+     * \param context the context of the calling thread, as for raycast()
+     * \param colors receives the color of each ray
+     * \param depths if not NULL, receives the ray parameter of each hit, or
+     * infinity for rays that hit nothing
+     * \param objects if not NULL, receives the instance each ray hit, or -1
+     */
+    void raycastPacket(const _3DRay *rays, int n, raytrace::TraceContext& context, glm::vec3 *colors,
+                       float *depths = NULL, int *objects = NULL) {
+        if (!rayScene.isCompiled()) {
+            for (int i = 0; i < n; i++)
+                colors[i] = raycast(rays[i], context,
+                                    depths ? depths + i : NULL, objects ? objects + i : NULL);
+            return;
+        }
+
+        raytrace::RayPacket packet(rays, n);
+        raytrace::PacketHit hits;
+        rayScene.intersect(packet, hits);
+        raytrace::RayDifferential differential = raytrace::RayDifferential::primary();
+        raytrace::TraceCounters& counters = raytrace::TraceCounters::local();
+        for (int i = 0; i < n; i++) {
+            raytrace::TracePath path(traceSettings, raytrace::TracePath::getSeed(glm::vec3(rays[i].dir)));
+            path.count(0);
+            path.dependencies = context.dependencies;
+            path.tile = context.tile;
+            if (path.dependencies != NULL)
+                path.dependencies->addInstance(path.tile, hits.instance[i]);
+            if (hits.instance[i] >= 0) {
+                path.hit(0);
+                colors[i] = shade(rays[i], rayScene.getHitRecord(rays[i], hits.instance[i], hits.hit[i], &differential),
+                                  differential, 0, 1.0f, path);
+            } else
+                colors[i] = glm::vec3(0,0,0);
+            if (depths != NULL)
+                depths[i] = (hits.instance[i] >= 0) ? hits.hit[i].t : numeric_limits<float>::infinity();
+            if (objects != NULL)
+                objects[i] = hits.instance[i];
+            path.countInto(counters);
+        }
+    }
+
+    /**
+     * Trace a large batch of rays, such as all the primary rays of a tile,
+     * through the stages of a raytrace::WavefrontTracer, which sorts the rays
+     * of every depth and their hits to keep them coherent. This pays off once
+     * there are many secondary rays. It requires a compiled ray scene, and
+     * falls back to one raycast() per ray otherwise.
+     * \param rays the rays in the view coordinate system
+     * \param n the number of rays
+     * \param context the context of the calling thread, as for raycast()
+     * \param colors receives the color of each ray
+     * \param depths if not NULL, receives the ray parameter of each hit, or
+     * infinity for rays that hit nothing
+     * \param objects if not NULL, receives the instance each ray hit, or -1
+     */
+    void raycastWavefront(const _3DRay *rays, int n, raytrace::TraceContext& context, glm::vec3 *colors,
+                          float *depths = NULL, int *objects = NULL) {
+        if (!rayScene.isCompiled()) {
+            for (int i = 0; i < n; i++)
+                colors[i] = raycast(rays[i], context,
+                                    depths ? depths + i : NULL, objects ? objects + i : NULL);
+            return;
+        }
+        raytrace::WavefrontTracer::local().trace(rayScene, traceSettings, rays, n, context, colors, depths, objects);
+    }
+
+    void setTraceSettings(const raytrace::TraceSettings& settings)
+    {
+      traceSettings = settings;
+    }
+
+    const raytrace::TraceSettings& getTraceSettings() const
+    {
+      return traceSettings;
+    }
+
+    /**
+     * Trace a secondary ray through the compiled ray scene
+     * \param ray the ray in the view coordinate system
+     * \param differential the footprint of the ray
+     * \param depth the number of bounces that led to this ray
+     * \param weight the fraction of the pixel's color this ray stands for
+     * \param path the state of the pixel being traced
+     * \return the color seen along the ray
+     */
+    glm::vec3 traceRay(const _3DRay& ray, const raytrace::RayDifferential& differential,
+                       int depth, float weight, raytrace::TracePath& path) {
+        path.count(depth);
+        HitRecord hitRecord = rayScene.intersect(ray, &differential);
+        if (path.dependencies != NULL)
+            path.dependencies->addRay(path.tile, glm::vec3(ray.pos), glm::vec3(ray.dir), 0.0f,
+                                      hitRecord.hit ? hitRecord.t : numeric_limits<float>::infinity(),
+                                      hitRecord.instance);
+        if (!hitRecord.hit)
+            return glm::vec3(0,0,0);
+        path.hit(depth);
+        return shade(ray, hitRecord, differential, depth, weight, path);
+    }
+
+    /**
+     * The color of a point hit by a ray, including what is seen in it by
+     * reflection and through it by refraction. The Phong color of the point
+     * is weighed by the absorption of its material, the reflected color by
+     * its reflection and the refracted color by its transparency. Whether the
+     * reflected and refracted rays are traced at all is up to the path, which
+     * keeps the cost of a pixel in line with what the rays add to it.
+     * \param ray the ray, in the view coordinate system, that hit the point
+     * \param hitRecord where and what the ray hit
+     * \param differential the footprint of the ray, passed on to the
+     * reflected and refracted rays
+     * \param depth the number of bounces that led to the ray
+     * \param weight the fraction of the pixel's color the ray stands for
+     * \param path the state of the pixel being traced
+     * \return the color of the point
+     */
+    glm::vec3 shade(const _3DRay& ray, const HitRecord& hitRecord, const raytrace::RayDifferential& differential,
+                    int depth, float weight, raytrace::TracePath& path) {
+        const util::Material& material = *hitRecord.material;
+        glm::vec3 color = material.getAbsorption() * shade(ray, hitRecord, &path);
+
+        float reflection = material.getReflection();
+        float transparency = material.getTransparency();
+        if ((reflection <= 0) && (transparency <= 0))
+            return color;
+
+        glm::vec3 position = glm::vec3(ray.pos + hitRecord.t * ray.dir);
+        glm::vec3 dir = glm::normalize(glm::vec3(ray.dir));
+        glm::vec3 normal = hitRecord.normal;
+        //make the normal face the ray, remembering whether the ray leaves the object
+        float cosIn = glm::dot(dir, normal);
+        float eta = 1.0f / material.getRefractiveIndex();
+        if (cosIn > 0) {
+            normal = -normal;
+            eta = material.getRefractiveIndex();
+        } else {
+            cosIn = -cosIn;
+        }
+        float offset = 1e-4f * max(1.0f, glm::length(position));
+        float scale;
+
+        //how the hit point moves from pixel to pixel, where the new rays start
+        glm::vec3 dPdx, dPdy;
+        differential.transfer(glm::vec3(ray.dir), hitRecord.t, normal, dPdx, dPdy);
+
+        if (transparency > 0) {
+            float k = 1.0f - eta * eta * (1.0f - cosIn * cosIn);
+            if (k < 0) {
+                //total internal reflection: the transmitted light is reflected too
+                reflection += transparency;
+            } else if (path.spawn(depth + 1, weight * transparency, scale)) {
+                glm::vec3 refracted = eta * dir + (eta * cosIn - sqrt(k)) * normal;
+                _3DRay refractedRay(glm::vec4(position - offset * normal, 1.0f),
+                                    glm::vec4(glm::normalize(refracted), 0.0f));
+                color += transparency * scale *
+                        traceRay(refractedRay, differential.refract(glm::vec3(ray.dir), normal, eta, dPdx, dPdy),
+                                 depth + 1, weight * transparency * scale, path);
+            }
+        }
+
+        if ((reflection > 0) && path.spawn(depth + 1, weight * reflection, scale)) {
+            glm::vec3 reflected = glm::reflect(dir, normal);
+            _3DRay reflectedRay(glm::vec4(position + offset * normal, 1.0f),
+                                glm::vec4(reflected, 0.0f));
+            color += reflection * scale *
+                    traceRay(reflectedRay, differential.reflect(glm::vec3(ray.dir), normal, dPdx, dPdy),
+                             depth + 1, weight * reflection * scale, path);
+        }
+        return color;
+    }
+
+    /**
+     * The scene graph as last compiled by compileRayScene
+     */
+    const raytrace::RayScene& getRayScene() const
+    {
+      return rayScene;
+    }
+
+    /**
+     * Light a point hit by a ray with the lights of the compiled ray scene, using
+     * the same Phong model as shaders/phong-multiple.frag. Points outside the
+     * cone of a spotlight get nothing from it, and this is decided before any
+     * shadow ray is cast. A point that faces a light but cannot see it, because
+     * a shadow ray towards the light is blocked, gets only its ambient part.
+     * Like the shader, the result is multiplied by the texture color at the point.
+     *
+     * If the trace settings ask for fewer light samples than there are point
+     * lights, only that many are picked at random from the light hierarchy of
+     * the ray scene, in proportion to how much they may light the point, and
+     * each is weighed by one over the chance of picking it. Directional lights
+     * are always all used.
+     * \param ray the ray, in the view coordinate system, that hit the point
+     * \param hitRecord where and what the ray hit
+     * \param path if not NULL, the pixel being traced, in whose tile the shadow
+     * rays are recorded and which supplies the random numbers. Without it,
+     * every light is used
+     * \return the color of the point
+     */
+    glm::vec3 shade(const _3DRay& ray, const HitRecord& hitRecord, raytrace::TracePath *path = NULL) {
+        const util::Material& material = *hitRecord.material;
+        const vector<raytrace::SceneLight>& lights = rayScene.getLights();
+        const raytrace::LightTree& lightTree = rayScene.getLightTree();
+        glm::vec3 position = glm::vec3(ray.pos + hitRecord.t * ray.dir);
+        glm::vec3 normalView = hitRecord.normal;
+        glm::vec3 viewVec = glm::normalize(-glm::vec3(ray.dir));
+        glm::vec3 color = glm::vec3(0,0,0);
+
+        //shadow rays start a little off the surface so that they do not hit it
+        glm::vec3 origin = position + 1e-4f * max(1.0f, glm::length(position)) * normalView;
+
+        int samples = traceSettings.lightSamples;
+        if ((path == NULL) || (samples <= 0) || (samples >= lightTree.getLightCount())) {
+            for (unsigned int i = 0; i < lights.size(); i++)
+                color += shade(lights[i], material, position, origin, normalView, viewVec, path);
+        } else {
+            const vector<int>& directional = lightTree.getDirectionalLights();
+            for (unsigned int i = 0; i < directional.size(); i++)
+                color += shade(lights[directional[i]], material, position, origin, normalView, viewVec, path);
+            for (int s = 0; s < samples; s++) {
+                float probability;
+                int i = lightTree.sample(position, normalView, path->random(), probability);
+                if (i < 0)
+                    continue;
+                color += shade(lights[i], material, position, origin, normalView, viewVec, path) /
+                        (probability * samples);
+            }
+        }
+        return color * hitRecord.textureColor;
+    }
+
+    /**
+     * The Phong color a single light gives a point, casting a shadow ray
+     * towards the light if the point faces it
+     * \param light the light
+     * \param material the material at the point
+     * \param position the point in the view coordinate system
+     * \param origin where shadow rays from the point start, a little off its
+     * surface
+     * \param normalView the normal at the point
+     * \param viewVec the normalized direction from the point to the eye
+     * \param path if not NULL, the pixel being traced, in whose tile the shadow
+     * ray is recorded
+     * \return the color, before texturing
+     */
+    glm::vec3 shade(const raytrace::SceneLight& light, const util::Material& material,
+                    const glm::vec3& position, const glm::vec3& origin, const glm::vec3& normalView,
+                    const glm::vec3& viewVec, raytrace::TracePath *path) {
+        glm::vec3 ambient, lit;
+        if (!light.getColor(material, position, normalView, viewVec, ambient, lit))
+            return ambient;
+
+        glm::vec3 toLight;
+        float far;
+        light.getShadowRay(origin, toLight, far);
+        int blocker = rayScene.findOccluder(origin, toLight, 0.0f, far);
+        if ((path != NULL) && (path->dependencies != NULL))
+            path->dependencies->addRay(path->tile, origin, toLight, 0.0f, far, blocker);
+        if (path != NULL)
+            path->shadow(blocker >= 0);
+        if (blocker >= 0)
+            return ambient;
+        return ambient + lit;
     }
 
     void animate(float time)
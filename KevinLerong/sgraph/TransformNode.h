@@ -29,6 +29,27 @@ namespace sgraph
   protected:
     glm::mat4 transform,animation_transform;
 
+    /**
+     * The product animation_transform * transform, kept up to date whenever
+     * either changes
+     */
+    glm::mat4 local;
+
+    /**
+     * The matrix this node last handed down to its subtree, i.e. the matrix
+     * it was reached with times local, and the matrix it was reached with.
+     * It is stale when dirty is set (local changed) or when the node is
+     * reached with a different matrix, which is what happens to the whole
+     * subtree below a node whose transformation changed, and to every node
+     * once the camera moves. Traversing an unchanged scene graph again, as
+     * collecting the lights and the instances do every frame, then costs a
+     * comparison per node instead of a matrix product.
+     * Only the traversals made on one thread (drawing, collecting lights and
+     * instances) write it; getIntersection() only reads it
+     */
+    glm::mat4 world,above;
+    bool dirty;
+
     /**
      * A reference to its only child
      */
@@ -40,6 +61,9 @@ namespace sgraph
     {
       this->transform = glm::mat4(1.0);
       animation_transform = glm::mat4(1.0);
+      local = glm::mat4(1.0);
+      world = above = glm::mat4(1.0);
+      dirty = true;
       child = NULL;
     }
 
@@ -115,6 +139,8 @@ namespace sgraph
         throw runtime_error("Transform node already has a child");
       this->child = child;
       this->child->setParent(this);
+      if (scenegraph!=NULL)
+        scenegraph->invalidateRenderQueue();
     }
 
     /**
@@ -129,10 +155,7 @@ namespace sgraph
 
     void draw(GLScenegraphRenderer& context,stack<glm::mat4>& modelView)
     {
-      modelView.push(modelView.top());
-      modelView.top() = modelView.top()
-          * animation_transform
-          * transform;
+      modelView.push(getWorldTransform(modelView.top()));
       if (child!=NULL)
         child->draw(context,modelView);
       modelView.pop();
@@ -140,12 +163,15 @@ namespace sgraph
 
 
     /**
-     * Sets the animation transform of this node
+     * Sets the animation transform of this node. The cached matrices of its
+     * subtree go stale with it, since they are reached with a different one
      * \param mat the animation transform of this node
      */
     void setAnimationTransform(const glm::mat4& mat) throw(runtime_error)
     {
       animation_transform = mat;
+      local = animation_transform * transform;
+      dirty = true;
     }
 
     /**
@@ -164,6 +190,25 @@ namespace sgraph
     void setTransform(const glm::mat4& t) throw(runtime_error)
     {
       this->transform = t;
+      local = animation_transform * transform;
+      dirty = true;
+    }
+
+    /**
+     * The matrix this node hands down to its subtree when it is reached with
+     * the given one, i.e. above * animation_transform * transform, from the
+     * cache if it is still good
+     * \param above the top of the modelview stack at this node
+     */
+    const glm::mat4& getWorldTransform(const glm::mat4& above)
+    {
+      if (dirty || (above!=this->above))
+        {
+          this->above = above;
+          world = above * local;
+          dirty = false;
+        }
+      return world;
     }
 
     /**
@@ -200,8 +245,7 @@ namespace sgraph
     {
       vector<util::Light> lights,templights;
 
-      modelview.push(modelview.top());
-      modelview.top() = modelview.top() * animation_transform * transform;
+      modelview.push(getWorldTransform(modelview.top()));
       if (child != NULL)
         {
           templights = child->getLightsInView(modelview);
@@ -221,9 +265,44 @@ namespace sgraph
       return lights;
     }
 
-    HitRecord getIntersection(_3DRay ray, stack<glm::mat4>& modelview) {
-        modelview.push(glm::mat4(modelview.top()));
-        modelview.top() = modelview.top() * transform;
+    /**
+       * Overridden version from @link{AbstractNode}. Collects the instances of
+       * its child after including its transformation and animation transformation,
+       * exactly as draw() does.
+       */
+    void getInstancesInView(vector<raytrace::Instance>& instances,stack<glm::mat4>& modelview)
+    {
+      if (child == NULL)
+        return;
+      modelview.push(getWorldTransform(modelview.top()));
+      child->getInstancesInView(instances,modelview);
+      modelview.pop();
+    }
+
+    /**
+       * Overridden version from @link{AbstractNode}. Adds itself with its
+       * transformation and animation transformation, then its child below it,
+       * and then the lights of this node, which are in the coordinate system
+       * of its parent as in getLightsInView().
+       */
+    void addToFlatScenegraph(FlatScenegraph& scene,int parent)
+    {
+      int own = scene.addNode(this,parent,&local);
+      if (child != NULL)
+        child->addToFlatScenegraph(scene,own);
+      scene.addLights(parent,lights);
+    }
+
+    /**
+       * Rays may be cast on many threads at once, so this reuses the cached
+       * matrix when it is good but never writes it
+       */
+    HitRecord getIntersection(const _3DRay& ray, raytrace::MatrixStack& modelview) {
+        modelview.push();
+        if (!dirty && (modelview.top()==above))
+          modelview.top() = world;
+        else
+          modelview.top() = modelview.top() * local;
         HitRecord hit = HitRecord();
         if (child!=NULL) {
           hit = child->getIntersection(ray, modelview);
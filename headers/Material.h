@@ -168,6 +168,7 @@ class Material
             setAbsorption(1);
             setReflection(0);
             setTransparency(0);
+            setRefractiveIndex(1);
         }
 
     private:
@@ -0,0 +1,281 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+namespace util
+{
+
+  /*
+   * A fixed-size pool of worker threads with work stealing.
+   *
+   * Every worker owns a queue of jobs. Jobs are handed out round-robin to
+   * these queues. A worker takes jobs from the back of its own queue, and when
+   * that runs dry it steals from the front of the other workers' queues, so
+   * that uneven jobs (e.g. tiles of an image that cost very different amounts
+   * of time) still keep every core busy until the very end.
+   *
+   * Jobs are submitted as part of a Batch, and wait() blocks only until the
+   * jobs of one batch are done, so that several users of one pool (or a job
+   * that submits jobs of its own) do not wait for each other. The thread
+   * calling wait() also executes jobs instead of just sleeping.
+   */
+  class ThreadPool
+  {
+  public:
+    typedef function<void()> Job;
+
+    /*
+     * The jobs one user of the pool waits for together, e.g. the tiles of an
+     * image. A batch must outlive the wait() for its jobs
+     */
+    class Batch
+    {
+    public:
+      Batch()
+      {
+        pending = 0;
+      }
+
+    private:
+      Batch(const Batch&);
+      Batch& operator=(const Batch&);
+
+      atomic<int> pending;
+      //the first exception thrown by a job of the batch, guarded by sleepLock
+      exception_ptr error;
+
+      friend class ThreadPool;
+    };
+
+    /*
+     * Create a pool with the given number of threads. If 0 is passed, one
+     * thread per hardware core is created
+     * \param numThreads the number of worker threads
+     */
+    explicit ThreadPool(unsigned int numThreads=0)
+    {
+      if (numThreads==0)
+        numThreads = thread::hardware_concurrency();
+      if (numThreads==0)
+        numThreads = 1;
+
+      stopping = false;
+      queued = 0;
+      nextQueue = 0;
+
+      for (unsigned int i=0;i<numThreads;i++)
+        {
+          queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+        }
+      for (unsigned int i=0;i<numThreads;i++)
+        {
+          workers.push_back(thread(&ThreadPool::workerLoop,this,i));
+        }
+    }
+
+    ~ThreadPool()
+    {
+      {
+        unique_lock<mutex> lock(sleepLock);
+        stopping = true;
+      }
+      workAvailable.notify_all();
+      for (unsigned int i=0;i<workers.size();i++)
+        {
+          workers[i].join();
+        }
+    }
+
+    /*
+     * Add a job to the pool. It will be executed on some worker thread
+     * \param batch the batch the job is part of
+     * \param job the job to be executed
+     */
+    void submit(Batch& batch,Job job)
+    {
+      batch.pending++;
+      unsigned int q = (nextQueue++) % queues.size();
+      {
+        lock_guard<mutex> lock(queues[q]->lock);
+        queues[q]->jobs.push_back(Task(move(job),&batch));
+      }
+      {
+        lock_guard<mutex> lock(sleepLock);
+        queued++;
+      }
+      workAvailable.notify_one();
+    }
+
+    /*
+     * Block until every job of the given batch has finished, even if some of
+     * them threw. The calling thread helps execute jobs (of any batch) while
+     * it waits, so this may also be called from inside a job
+     * \param batch the batch to wait for
+     * \throws the first exception thrown by a job of the batch, once all its
+     * jobs have finished
+     */
+    void wait(Batch& batch)
+    {
+      Task task;
+      while (batch.pending>0)
+        {
+          if (steal(queues.size(),task))
+            {
+              run(task);
+            }
+          else
+            {
+              unique_lock<mutex> lock(sleepLock);
+              batchDone.wait(lock,[this,&batch]{return (batch.pending==0) || (queued>0);});
+            }
+        }
+      exception_ptr error;
+      {
+        lock_guard<mutex> lock(sleepLock);
+        swap(error,batch.error);
+      }
+      if (error)
+        rethrow_exception(error);
+    }
+
+    /*
+     * Returns the number of worker threads in this pool
+     */
+    unsigned int getThreadCount() const
+    {
+      return workers.size();
+    }
+
+  private:
+    class Task
+    {
+    public:
+      Job job;
+      Batch *batch;
+
+      Task():batch(NULL) {}
+      Task(Job&& job,Batch *batch):job(move(job)),batch(batch) {}
+    };
+
+    class WorkQueue
+    {
+    public:
+      mutex lock;
+      deque<Task> jobs;
+    };
+
+    void workerLoop(unsigned int index)
+    {
+      Task task;
+      while (true)
+        {
+          if (popLocal(index,task) || steal(index,task))
+            {
+              run(task);
+              continue;
+            }
+
+          unique_lock<mutex> lock(sleepLock);
+          workAvailable.wait(lock,[this]{return stopping || (queued>0);});
+          if (stopping && (queued==0))
+            return;
+        }
+    }
+
+    /*
+     * Take the most recently added job from this worker's own queue
+     */
+    bool popLocal(unsigned int index,Task& task)
+    {
+      WorkQueue& q = *queues[index];
+      {
+        lock_guard<mutex> lock(q.lock);
+        if (q.jobs.empty())
+          return false;
+        task = move(q.jobs.back());
+        q.jobs.pop_back();
+      }
+      taken();
+      return true;
+    }
+
+    /*
+     * Take the oldest job from any queue other than the given one. Passing an
+     * index outside the range of queues makes every queue a candidate.
+     */
+    bool steal(unsigned int index,Task& task)
+    {
+      unsigned int n = queues.size();
+      for (unsigned int i=1;i<=n;i++)
+        {
+          unsigned int victim = (index+i) % n;
+          if (victim==index)
+            continue;
+          WorkQueue& q = *queues[victim];
+          {
+            lock_guard<mutex> lock(q.lock);
+            if (q.jobs.empty())
+              continue;
+            task = move(q.jobs.front());
+            q.jobs.pop_front();
+          }
+          taken();
+          return true;
+        }
+      return false;
+    }
+
+    void taken()
+    {
+      lock_guard<mutex> lock(sleepLock);
+      queued--;
+    }
+
+    /*
+     * Execute a job and count it as done in its batch. An exception thrown by
+     * the job is kept for wait() to rethrow instead of ending the thread
+     */
+    void run(Task& task)
+    {
+      Batch *batch = task.batch;
+      try
+        {
+          task.job();
+        }
+      catch (...)
+        {
+          lock_guard<mutex> lock(sleepLock);
+          if (!batch->error)
+            batch->error = current_exception();
+        }
+      task = Task();
+      if (--batch->pending==0)
+        {
+          lock_guard<mutex> lock(sleepLock);
+          batchDone.notify_all();
+        }
+    }
+
+    vector<unique_ptr<WorkQueue> > queues;
+    vector<thread> workers;
+    atomic<unsigned int> nextQueue;
+    //number of jobs sitting in queues, guarded by sleepLock
+    int queued;
+    bool stopping;
+    mutex sleepLock;
+    condition_variable workAvailable;
+    condition_variable batchDone;
+  };
+}
+
+#endif